@@ -145,36 +145,212 @@ out:
 	free(buf);
 }
 
+static ckmsgring_t *create_ckmsgring(ckpool_t *ckp)
+{
+	ckmsgring_t *ring;
+	uint64_t i;
+
+	if (unlikely(posix_memalign((void **)&ring, 64, sizeof(ckmsgring_t))))
+		quit(1, "Failed to posix_memalign ckmsgring");
+	memset(ring, 0, sizeof(ckmsgring_t));
+	ring->cells = ckalloc(sizeof(ckmsgcell_t) * CKMSGQ_RING);
+	ring->mask = CKMSGQ_RING - 1;
+	for (i = 0; i < CKMSGQ_RING; i++) {
+		ring->cells[i].seq = i;
+		ring->cells[i].data = NULL;
+	}
+	mutex_init(&ring->lock);
+	ring->slab = ckp->ckmsg_slab;
+	return ring;
+}
+
+/* Claim the next free cell and put data in it, returning false if the ring is
+ * full. */
+static bool ring_enqueue(ckmsgring_t *ring, void *data)
+{
+	uint64_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+	ckmsgcell_t *cell;
+
+	while (42) {
+		int64_t dif;
+
+		cell = &ring->cells[pos & ring->mask];
+		dif = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Claim up to max consecutive filled cells at once and take their data,
+ * returning how many were taken. */
+static int ring_dequeue(ckmsgring_t *ring, void **data, const int max)
+{
+	uint64_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+	int msgs, i;
+
+	while (42) {
+		int64_t dif = 0;
+
+		for (msgs = 0; msgs < max; msgs++) {
+			ckmsgcell_t *cell = &ring->cells[(pos + msgs) & ring->mask];
+
+			dif = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+			      (int64_t)(pos + msgs + 1);
+			if (dif)
+				break;
+		}
+		if (!msgs) {
+			if (dif < 0)
+				return 0;
+			/* Another consumer got here first */
+			pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + msgs, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+	for (i = 0; i < msgs; i++) {
+		ckmsgcell_t *cell = &ring->cells[(pos + i) & ring->mask];
+
+		data[i] = cell->data;
+		__atomic_store_n(&cell->seq, pos + i + ring->mask + 1, __ATOMIC_RELEASE);
+	}
+	return msgs;
+}
+
+/* Take up to max messages off one of the locked lists */
+static int list_dequeue(ckmsgring_t *ring, ckmsg_t **list, int64_t *count, void **data,
+			const int max)
+{
+	ckmsg_t *msg;
+	int msgs = 0;
+
+	mutex_lock(&ring->lock);
+	while (msgs < max && (msg = *list)) {
+		DL_DELETE(*list, msg);
+		data[msgs++] = msg->data;
+		ckslab_free(ring->slab, msg);
+	}
+	__atomic_sub_fetch(count, msgs, __ATOMIC_RELEASE);
+	mutex_unlock(&ring->lock);
+
+	return msgs;
+}
+
+/* Take up to max messages, high priority ones first, then those on the ring
+ * and then any that overflowed it. */
+static int ckmsgring_take(ckmsgring_t *ring, void **data, const int max)
+{
+	int msgs = 0;
+
+	if (unlikely(__atomic_load_n(&ring->prios, __ATOMIC_ACQUIRE)))
+		msgs = list_dequeue(ring, &ring->prio, &ring->prios, data, max);
+	if (msgs < max)
+		msgs += ring_dequeue(ring, data + msgs, max - msgs);
+	if (msgs < max && unlikely(__atomic_load_n(&ring->overflows, __ATOMIC_ACQUIRE)))
+		msgs += list_dequeue(ring, &ring->overflow, &ring->overflows, data + msgs, max - msgs);
+	return msgs;
+}
+
+static int64_t ckmsgring_queued(ckmsgring_t *ring)
+{
+	int64_t queued;
+
+	queued = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_SEQ_CST) -
+		 __atomic_load_n(&ring->dequeue_pos, __ATOMIC_SEQ_CST);
+	queued += __atomic_load_n(&ring->prios, __ATOMIC_SEQ_CST);
+	queued += __atomic_load_n(&ring->overflows, __ATOMIC_SEQ_CST);
+	return queued;
+}
+
+/* Sleep till woken by a producer or a second passes. Registering as a sleeper
+ * before checking the queue one last time means a producer that queues
+ * after the check always sees us and bumps the futex word. */
+static void ckmsgring_wait(ckmsgring_t *ring)
+{
+	int wakeups;
+
+	__atomic_add_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+	wakeups = __atomic_load_n(&ring->wakeups, __ATOMIC_SEQ_CST);
+	if (!ckmsgring_queued(ring))
+		ckfutex_wait(&ring->wakeups, wakeups, 1000);
+	__atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Wake only as many sleeping consumers as there are new messages, and none
+ * at all without the syscall if they're all busy. */
+static void ckmsgring_wake(ckmsgring_t *ring, const int messages)
+{
+	int sleepers;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	sleepers = __atomic_load_n(&ring->sleepers, __ATOMIC_SEQ_CST);
+	if (!sleepers)
+		return;
+	__atomic_add_fetch(&ring->wakeups, 1, __ATOMIC_SEQ_CST);
+	ckfutex_wake(&ring->wakeups, MIN(sleepers, messages));
+}
+
 /* Generic function for creating a message queue receiving and parsing thread */
 static void *ckmsg_queue(void *arg)
 {
 	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
+	ckmsgring_t *ring = ckmsgq->ring;
 	ckpool_t *ckp = ckmsgq->ckp;
+	void **data;
 
 	pthread_detach(pthread_self());
 	rename_proc(ckmsgq->name);
+	data = ckalloc(sizeof(void *) * ckmsgq->batch);
 	ckmsgq->active = true;
 
 	while (42) {
-		ckmsg_t *msg;
-		tv_t now;
-		ts_t abs;
+		int msgs, i;
 
-		mutex_lock(ckmsgq->lock);
-		tv_time(&now);
-		tv_to_ts(&abs, &now);
-		abs.tv_sec++;
-		if (!ckmsgq->msgs)
-			cond_timedwait(ckmsgq->cond, ckmsgq->lock, &abs);
-		msg = ckmsgq->msgs;
-		if (msg)
-			DL_DELETE(ckmsgq->msgs, msg);
-		mutex_unlock(ckmsgq->lock);
-
-		if (!msg)
+		msgs = ckmsgring_take(ring, data, ckmsgq->batch);
+		if (!msgs) {
+			ckmsgring_wait(ring);
 			continue;
-		ckmsgq->func(ckp, msg->data);
-		free(msg);
+		}
+		for (i = 0; i < msgs; i++)
+			ckmsgq->func(ckp, data[i]);
+	}
+	return NULL;
+}
+
+/* As ckmsg_queue but takes as many messages as are queued, up to the batch
+ * size, and hands them to the batch function together. */
+static void *ckmsg_batch_queue(void *arg)
+{
+	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
+	ckmsgring_t *ring = ckmsgq->ring;
+	ckpool_t *ckp = ckmsgq->ckp;
+	void **data;
+
+	pthread_detach(pthread_self());
+	rename_proc(ckmsgq->name);
+	data = ckalloc(sizeof(void *) * ckmsgq->batch);
+	ckmsgq->active = true;
+
+	while (42) {
+		int msgs;
+
+		msgs = ckmsgring_take(ring, data, ckmsgq->batch);
+		if (!msgs) {
+			ckmsgring_wait(ring);
+			continue;
+		}
+		ckmsgq->bfunc(ckp, data, msgs);
 	}
 	return NULL;
 }
@@ -185,45 +361,78 @@ ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
 
 	strncpy(ckmsgq->name, name, 15);
 	ckmsgq->func = func;
+	ckmsgq->batch = CKMSGQ_BATCH;
 	ckmsgq->ckp = ckp;
-	ckmsgq->lock = ckalloc(sizeof(mutex_t));
-	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(ckmsgq->lock);
-	cond_init(ckmsgq->cond);
+	ckmsgq->ring = create_ckmsgring(ckp);
 	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
 
 	return ckmsgq;
 }
 
+/* Create count threads sharing one queue. They take one message at a time so
+ * that a burst is spread across all of them, which means messages are
+ * processed concurrently and not necessarily in the order they were queued. */
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
 {
 	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
-	mutex_t *lock;
-	pthread_cond_t *cond;
+	ckmsgring_t *ring = create_ckmsgring(ckp);
 	int i;
 
-	lock = ckalloc(sizeof(mutex_t));
-	cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(lock);
-	cond_init(cond);
-
 	for (i = 0; i < count; i++) {
 		snprintf(ckmsgq[i].name, 15, "%.6s%x", name, i);
 		ckmsgq[i].func = func;
+		ckmsgq[i].batch = 1;
 		ckmsgq[i].ckp = ckp;
-		ckmsgq[i].lock = lock;
-		ckmsgq[i].cond = cond;
+		ckmsgq[i].ring = ring;
 		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
 	}
 
 	return ckmsgq;
 }
 
-/* Generic function for adding messages to a ckmsgq linked list and signal the
- * ckmsgq parsing thread(s) to wake up and process it. */
+/* Create count threads, each with a queue of its own so that the caller can
+ * keep related messages in order by always choosing the same queue in the
+ * array for them. Threads consume up to batch messages at a time in one call
+ * to bfunc if it is passed, otherwise they call func for each message. */
+ckmsgq_t *create_ckmsgq_shards(ckpool_t *ckp, const char *name, const void *func,
+			       const void *bfunc, const int count, const int batch)
+{
+	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		snprintf(ckmsgq[i].name, 15, "%.6s%x", name, i);
+		ckmsgq[i].ckp = ckp;
+		ckmsgq[i].ring = create_ckmsgring(ckp);
+		if (bfunc) {
+			ckmsgq[i].bfunc = bfunc;
+			ckmsgq[i].batch = batch;
+			create_pthread(&ckmsgq[i].pth, ckmsg_batch_queue, &ckmsgq[i]);
+		} else {
+			ckmsgq[i].func = func;
+			ckmsgq[i].batch = CKMSGQ_BATCH;
+			create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
+		}
+	}
+
+	return ckmsgq;
+}
+
+/* Once anything has overflowed the ring, keep queueing on the overflow list
+ * till it's drained so that messages from any one producer stay in order. */
+static void ckmsgring_overflow(ckmsgring_t *ring, ckmsg_t *msgs, const int messages)
+{
+	mutex_lock(&ring->lock);
+	DL_CONCAT(ring->overflow, msgs);
+	__atomic_add_fetch(&ring->overflows, messages, __ATOMIC_RELEASE);
+	mutex_unlock(&ring->lock);
+}
+
+/* Generic function for adding messages to a ckmsgq and waking a ckmsgq
+ * parsing thread to process it. */
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
 {
-	ckmsg_t *msg;
+	ckmsgring_t *ring;
 
 	if (unlikely(!ckmsgq)) {
 		LOGWARNING("Sending messages to no queue from %s %s:%d", file, func, line);
@@ -235,32 +444,67 @@ bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *fun
 	while (unlikely(!ckmsgq->active))
 		cksleep_ms(10);
 
-	msg = ckalloc(sizeof(ckmsg_t));
-	msg->data = data;
+	ring = ckmsgq->ring;
+	__atomic_add_fetch(&ring->messages, 1, __ATOMIC_RELAXED);
+	if (unlikely(__atomic_load_n(&ring->overflows, __ATOMIC_ACQUIRE) ||
+		     !ring_enqueue(ring, data))) {
+		ckmsg_t *msg = ckslab_alloc(ring->slab);
 
-	mutex_lock(ckmsgq->lock);
-	ckmsgq->messages++;
-	DL_APPEND(ckmsgq->msgs, msg);
-	pthread_cond_broadcast(ckmsgq->cond);
-	mutex_unlock(ckmsgq->lock);
+		msg->data = data;
+		msg->prev = msg;
+		ckmsgring_overflow(ring, msg, 1);
+	}
+	ckmsgring_wake(ring, 1);
 
 	return true;
 }
 
-/* Return whether there are any messages queued in the ckmsgq linked list. */
-bool ckmsgq_empty(ckmsgq_t *ckmsgq)
+/* Add a list of messages already created to a ckmsgq, putting them ahead of
+ * everything else queued if they are high priority. */
+void ckmsgq_add_bulk(ckmsgq_t *ckmsgq, ckmsg_t *msgs, const int messages, const bool prio)
 {
-	bool ret = true;
+	ckmsgring_t *ring = ckmsgq->ring;
+	ckmsg_t *msg, *tmp;
+	int remaining;
 
-	if (unlikely(!ckmsgq || !ckmsgq->active))
+	__atomic_add_fetch(&ring->messages, messages, __ATOMIC_RELAXED);
+	if (prio) {
+		mutex_lock(&ring->lock);
+		tmp = ring->prio;
+		ring->prio = msgs;
+		DL_CONCAT(ring->prio, tmp);
+		__atomic_add_fetch(&ring->prios, messages, __ATOMIC_RELEASE);
+		mutex_unlock(&ring->lock);
 		goto out;
+	}
 
-	mutex_lock(ckmsgq->lock);
-	if (ckmsgq->msgs)
-		ret = (ckmsgq->msgs->next == ckmsgq->msgs->prev);
-	mutex_unlock(ckmsgq->lock);
+	remaining = messages;
+	DL_FOREACH_SAFE(msgs, msg, tmp) {
+		if (unlikely(__atomic_load_n(&ring->overflows, __ATOMIC_ACQUIRE) ||
+			     !ring_enqueue(ring, msg->data)))
+			break;
+		DL_DELETE(msgs, msg);
+		ckslab_free(ring->slab, msg);
+		remaining--;
+	}
+	if (unlikely(msgs))
+		ckmsgring_overflow(ring, msgs, remaining);
 out:
-	return ret;
+	ckmsgring_wake(ring, messages);
+}
+
+/* Return how many messages are queued on a ckmsgq */
+int64_t ckmsgq_queued(ckmsgq_t *ckmsgq)
+{
+	return ckmsgring_queued(ckmsgq->ring);
+}
+
+/* Return whether there are any messages queued in the ckmsgq. */
+bool ckmsgq_empty(ckmsgq_t *ckmsgq)
+{
+	if (unlikely(!ckmsgq || !ckmsgq->active))
+		return true;
+	return !ckmsgring_queued(ckmsgq->ring);
 }
 
 /* Create a standalone thread that queues received unix messages for a proc
@@ -1460,6 +1704,12 @@ static void parse_config(ckpool_t *ckp)
 	json_get_int64(&ckp->maxdiff, json_conf, "maxdiff");
 	json_get_string(&ckp->logdir, json_conf, "logdir");
 	json_get_int(&ckp->maxclients, json_conf, "maxclients");
+	json_get_int(&ckp->receivers, json_conf, "receivers");
+	json_get_bool(&ckp->iouring, json_conf, "iouring");
+	json_get_bool(&ckp->binsharelog, json_conf, "binsharelog");
+	json_get_int(&ckp->stratifierthreads, json_conf, "stratifierthreads");
+	json_get_bool(&ckp->clientaffinity, json_conf, "clientaffinity");
+	json_get_bool(&ckp->runtocompletion, json_conf, "runtocompletion");
 	json_get_double(&ckp->donation, json_conf, "donation");
 	/* Avoid dust-sized donations */
 	if (ckp->donation < 0.1)
@@ -1576,6 +1826,8 @@ int main(int argc, char **argv)
 	ckp.starttime = time(NULL);
 	ckp.startpid = getpid();
 	ckp.loglevel = LOG_NOTICE;
+	ckp.ckmsg_slab = ckslab_create("ckmsg", sizeof(ckmsg_t));
+	ckp.smsg_slab = ckslab_create("smsg", sizeof(smsg_t));
 	ckp.initial_args = ckalloc(sizeof(char *) * (argc + 2)); /* Leave room for extra -H */
 	for (ckp.args = 0; ckp.args < argc; ckp.args++)
 		ckp.initial_args[ckp.args] = strdup(argv[ckp.args]);
@@ -1788,6 +2040,11 @@ int main(int argc, char **argv)
 		quit(0, "No redirect entries found in config file %s", ckp.config);
 	if (!ckp.zmqblock)
 		ckp.zmqblock = "tcp://127.0.0.1:28332";
+	if (ckp.receivers < 1)
+		ckp.receivers = 1;
+	/* Default to half as many stratifier threads as there are CPUs */
+	if (ckp.stratifierthreads < 1)
+		ckp.stratifierthreads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
 
 	/* Create the log directory */
 	trail_slash(&ckp.logdir);
@@ -41,15 +41,58 @@ struct unix_msg {
 	char *buf;
 };
 
+/* Messages are queued on a bounded lock free multi producer multi consumer
+ * ring shared by all the threads of a ckmsgq. Each cell's sequence number
+ * tells producers and consumers whose turn it is to use it. */
+#define CKMSGQ_RING 16384
+/* Messages taken at a time by single threaded queues */
+#define CKMSGQ_BATCH 16
+
+struct ckmsgcell {
+	uint64_t seq;
+	void *data;
+};
+
+typedef struct ckmsgcell ckmsgcell_t;
+
+struct ckmsgring {
+	ckmsgcell_t *cells;
+	uint64_t mask;
+
+	/* Producer and consumer positions on their own cachelines */
+	uint64_t enqueue_pos __attribute__((aligned(64)));
+	uint64_t dequeue_pos __attribute__((aligned(64)));
+
+	/* Futex word idle consumers sleep on and how many are sleeping */
+	int wakeups __attribute__((aligned(64)));
+	int sleepers;
+
+	/* High priority messages that go ahead of the ring, and messages that
+	 * did not fit in it, with their counts */
+	mutex_t lock;
+	ckmsg_t *prio;
+	ckmsg_t *overflow;
+	int64_t prios;
+	int64_t overflows;
+
+	int64_t messages;
+
+	/* Where the ckmsg_t wrappers of listed messages are freed to */
+	ckslab_t *slab;
+};
+
+typedef struct ckmsgring ckmsgring_t;
+
 struct ckmsgq {
 	ckpool_t *ckp;
 	char name[16];
 	pthread_t pth;
-	mutex_t *lock;
-	pthread_cond_t *cond;
-	ckmsg_t *msgs;
+	ckmsgring_t *ring;
 	void (*func)(ckpool_t *, void *);
-	int64_t messages;
+	/* Consumers get up to batch messages at a time, batch consumers in
+	 * one call to bfunc */
+	void (*bfunc)(ckpool_t *, void **, int);
+	int batch;
 	bool active;
 };
 
@@ -141,6 +184,8 @@ struct ckpool_instance {
 	bool killold;
 	/* Whether to log shares or not */
 	bool logshares;
+	/* Log shares in the binary sharelog format instead of json */
+	bool binsharelog;
 	/* Logging level */
 	int loglevel;
 	/* Main process name */
@@ -163,6 +208,24 @@ struct ckpool_instance {
 	bool handover;
 	/* How many clients maximum to accept before rejecting further */
 	int maxclients;
+	/* Number of connector receiver threads each with their own listening
+	 * sockets and subset of clients */
+	int receivers;
+	/* Use the io_uring connector backend where the kernel supports it */
+	bool iouring;
+	/* Number of threads in each of the stratifier's receive, share
+	 * processing and send pipelines */
+	int stratifierthreads;
+	/* Give each pipeline thread its own queue and always route a client's
+	 * messages to the same one */
+	bool clientaffinity;
+	/* Process shares on the connector thread that reads them */
+	bool runtocompletion;
+
+	/* Allocators for the message wrappers and stratum messages passed
+	 * between threads */
+	ckslab_t *ckmsg_slab;
+	ckslab_t *smsg_slab;
 
 	/* API message queue */
 	ckmsgq_t *ckpapi;
@@ -346,8 +409,12 @@ void get_timestamp(char *stamp);
 
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func);
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t *create_ckmsgq_shards(ckpool_t *ckp, const char *name, const void *func,
+			       const void *bfunc, const int count, const int batch);
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
 #define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, __FILE__, __func__, __LINE__)
+void ckmsgq_add_bulk(ckmsgq_t *ckmsgq, ckmsg_t *msgs, const int messages, const bool prio);
+int64_t ckmsgq_queued(ckmsgq_t *ckmsgq);
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
 
@@ -0,0 +1,319 @@
+/*
+ * Copyright 2026 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Decodes binary .sharebin sharelogs written with the binsharelog option,
+ * printing each share as a json line like the json sharelogs, as csv, or
+ * summarised per user. */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "sharelog.h"
+#include "uthash.h"
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= LOG_WARNING) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+typedef struct user_summary user_summary_t;
+
+struct user_summary {
+	UT_hash_handle hh;
+	char *username;
+	int64_t accepted;
+	int64_t rejected;
+	double diff_accepted;
+	double diff_rejected;
+	double best_diff;
+};
+
+static user_summary_t *users;
+
+static struct option long_options[] = {
+	{"csv",		no_argument,		0,	'c'},
+	{"help",	no_argument,		0,	'h'},
+	{"users",	no_argument,		0,	'u'},
+	{0, 0, 0, 0}
+};
+
+static bool csv;
+static bool csv_header;
+
+/* Print str as a csv field, quoting it if needed */
+static void csv_string(const char *str, const bool last)
+{
+	if (strpbrk(str, ",\"\n")) {
+		putchar('"');
+		for (; *str; str++) {
+			if (*str == '"')
+				putchar('"');
+			putchar(*str);
+		}
+		putchar('"');
+	} else
+		fputs(str, stdout);
+	putchar(last ? '\n' : ',');
+}
+
+static const char *dict_string(char **strings, const uint32_t nstrings, const uint32_t id)
+{
+	if (id && id <= nstrings && strings[id])
+		return strings[id];
+	return "";
+}
+
+static void print_share(const struct sharelog_share *share, const int64_t workinfoid,
+			char **strings, const uint32_t nstrings)
+{
+	char enonce1[36], nonce2[36], nonce[12], ntime[12], hash[68] = {}, cdfield[64];
+	const char *workername, *username, *address, *agent, *createinet;
+	static const uint8_t nohash[32];
+	json_t *val;
+	char *s;
+
+	__bin2hex(enonce1, share->enonce1, MIN(share->enonce1len, sizeof(share->enonce1)));
+	__bin2hex(nonce2, share->nonce2, MIN(share->nonce2len, sizeof(share->nonce2)));
+	__bin2hex(nonce, &share->nonce, 4);
+	sprintf(ntime, "%08x", share->ntime);
+	if (memcmp(share->hash, nohash, 32))
+		__bin2hex(hash, share->hash, 32);
+	sprintf(cdfield, "%"PRId64",%u", share->sec, share->nsec);
+	workername = dict_string(strings, nstrings, share->workername);
+	username = dict_string(strings, nstrings, share->username);
+	address = dict_string(strings, nstrings, share->address);
+	agent = dict_string(strings, nstrings, share->agent);
+	createinet = dict_string(strings, nstrings, share->createinet);
+
+	if (csv) {
+		if (!csv_header) {
+			printf("workinfoid,clientid,enonce1,nonce2,nonce,ntime,diff,sdiff,hash,"
+			       "result,errn,createdate,createinet,workername,username,address,agent\n");
+			csv_header = true;
+		}
+		printf("%"PRId64",%"PRId64",%s,%s,%s,%s,%f,%f,%s,%s,%d,\"%s\",",
+		       workinfoid, share->clientid, enonce1, nonce2, nonce, ntime, share->diff,
+		       share->sdiff, hash, share->result ? "true" : "false", share->errn, cdfield);
+		csv_string(createinet, false);
+		csv_string(workername, false);
+		csv_string(username, false);
+		csv_string(address, false);
+		csv_string(agent, true);
+		return;
+	}
+
+	val = json_object();
+	json_set_int64(val, "workinfoid", workinfoid);
+	json_set_int64(val, "clientid", share->clientid);
+	json_set_string(val, "enonce1", enonce1);
+	json_set_string(val, "nonce2", nonce2);
+	json_set_string(val, "nonce", nonce);
+	json_set_string(val, "ntime", ntime);
+	json_set_double(val, "diff", share->diff);
+	json_set_double(val, "sdiff", share->sdiff);
+	json_set_string(val, "hash", hash);
+	json_set_bool(val, "result", share->result);
+	json_set_int(val, "errn", share->errn);
+	json_set_string(val, "createdate", cdfield);
+	json_set_string(val, "createinet", createinet);
+	json_set_string(val, "workername", workername);
+	json_set_string(val, "username", username);
+	json_set_string(val, "address", address);
+	json_set_string(val, "agent", agent);
+	s = json_dumps(val, JSON_PRESERVE_ORDER | JSON_COMPACT);
+	puts(s);
+	free(s);
+	json_decref(val);
+}
+
+static void add_user_share(const struct sharelog_share *share, char **strings,
+			   const uint32_t nstrings)
+{
+	const char *username = dict_string(strings, nstrings, share->username);
+	user_summary_t *user;
+
+	HASH_FIND_STR(users, username, user);
+	if (!user) {
+		user = ckzalloc(sizeof(user_summary_t));
+		user->username = strdup(username);
+		HASH_ADD_KEYPTR(hh, users, user->username, strlen(user->username), user);
+	}
+	if (share->result) {
+		user->accepted++;
+		user->diff_accepted += share->diff;
+	} else {
+		user->rejected++;
+		user->diff_rejected += share->diff;
+	}
+	if (share->sdiff > user->best_diff)
+		user->best_diff = share->sdiff;
+}
+
+static void print_users(void)
+{
+	user_summary_t *user, *tmp;
+
+	if (csv)
+		printf("username,accepted,rejected,diffaccepted,diffrejected,bestdiff\n");
+	HASH_ITER(hh, users, user, tmp) {
+		if (csv) {
+			csv_string(user->username, false);
+			printf("%"PRId64",%"PRId64",%f,%f,%f\n", user->accepted, user->rejected,
+			       user->diff_accepted, user->diff_rejected, user->best_diff);
+		} else {
+			json_t *val = json_object();
+			char *s;
+
+			json_set_string(val, "username", user->username);
+			json_set_int64(val, "accepted", user->accepted);
+			json_set_int64(val, "rejected", user->rejected);
+			json_set_double(val, "diffaccepted", user->diff_accepted);
+			json_set_double(val, "diffrejected", user->diff_rejected);
+			json_set_double(val, "bestdiff", user->best_diff);
+			s = json_dumps(val, JSON_PRESERVE_ORDER | JSON_COMPACT);
+			puts(s);
+			free(s);
+			json_decref(val);
+		}
+		HASH_DEL(users, user);
+		free(user->username);
+		free(user);
+	}
+}
+
+/* Stream through the records of a mmapped sharelog, building its string
+ * dictionary as string records appear before the shares that use them. */
+static bool decode_sharelog(const char *path, const bool summarise)
+{
+	const struct sharelog_header *hdr;
+	uint32_t nstrings = 0, i;
+	char **strings = NULL;
+	const char *map;
+	size_t size, ofs;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGERR("Failed to open %s", path);
+		return false;
+	}
+	if (fstat(fd, &st)) {
+		LOGERR("Failed to stat %s", path);
+		close(fd);
+		return false;
+	}
+	size = st.st_size;
+	if (size < sizeof(struct sharelog_header)) {
+		LOGWARNING("%s is too small to be a binary sharelog", path);
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOGERR("Failed to mmap %s", path);
+		return false;
+	}
+	madvise((void *)map, size, MADV_SEQUENTIAL);
+
+	hdr = (const struct sharelog_header *)map;
+	if (memcmp(hdr->magic, SHARELOG_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SHARELOG_VERSION || hdr->recsize != SHARELOG_RECSIZE) {
+		LOGWARNING("%s is not a version %d binary sharelog", path, SHARELOG_VERSION);
+		munmap((void *)map, size);
+		return false;
+	}
+
+	for (ofs = SHARELOG_RECSIZE; ofs + SHARELOG_RECSIZE <= size; ofs += SHARELOG_RECSIZE) {
+		const sharelog_rec_t *rec = (const sharelog_rec_t *)(map + ofs);
+
+		if (rec->type == SLR_STRING) {
+			const struct sharelog_string *str = &rec->string;
+
+			if (str->len > SHARELOG_STRLEN || !str->id)
+				continue;
+			if (str->id > nstrings) {
+				strings = realloc(strings, sizeof(char *) * (str->id + 1));
+				if (unlikely(!strings))
+					quit(1, "Failed to realloc string dictionary");
+				memset(strings + nstrings + 1, 0, sizeof(char *) * (str->id - nstrings));
+				nstrings = str->id;
+			}
+			free(strings[str->id]);
+			strings[str->id] = strndup(str->str, str->len);
+		} else if (rec->type == SLR_SHARE) {
+			if (summarise)
+				add_user_share(&rec->share, strings, nstrings);
+			else
+				print_share(&rec->share, hdr->workinfoid, strings, nstrings);
+		}
+	}
+	if (ofs != size)
+		LOGWARNING("%s has a trailing partial record", path);
+
+	for (i = 1; i <= nstrings; i++)
+		free(strings[i]);
+	free(strings);
+	munmap((void *)map, size);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	bool summarise = false, ret = true;
+	int c, i = 0, j;
+
+	while ((c = getopt_long(argc, argv, "chu", long_options, &i)) != -1) {
+		switch(c) {
+			case 'c':
+				csv = true;
+				break;
+			case 'h':
+				printf("Usage: %s [options] file.sharebin...\n", argv[0]);
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'u':
+				summarise = true;
+				break;
+			default:
+				exit(1);
+		}
+	}
+	if (optind >= argc)
+		quit(1, "No sharelog files specified, see %s -h", argv[0]);
+
+	for (i = optind; i < argc; i++)
+		ret &= decode_sharelog(argv[i], summarise);
+	if (summarise)
+		print_users();
+	return ret ? 0 : 1;
+}
@@ -11,10 +11,16 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "ckpool.h"
 #include "libckpool.h"
@@ -22,28 +28,48 @@
 #include "utlist.h"
 #include "stratifier.h"
 #include "generator.h"
+#include "connector.h"
+#include "uring.h"
 
 #define MAX_MSGSIZE 1024
+/* Maximum number of epoll events drained per receiver wakeup */
+#define RECEIVER_EVENTS 256
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 typedef struct client_instance client_instance_t;
+typedef struct client_shard cshard_t;
 typedef struct sender_send sender_send_t;
 typedef struct share share_t;
 typedef struct redirect redirect_t;
 
 struct client_instance {
-	/* For clients hashtable */
-	UT_hash_handle hh;
+	/* For the shard's list of all clients */
+	client_instance_t *next;
+	client_instance_t *prev;
 	int64_t id;
 
 	/* fd cannot be changed while a ref is held */
 	int fd;
 
-	/* Reference count for when this instance is used outside of the
-	 * connector_data lock */
+	/* Atomic reference count for when this instance is in use */
 	int ref;
 
+	/* Which receiver shard owns this instance */
+	cshard_t *shard;
+
+	/* Epoll events not yet serviced, and the count of events received
+	 * since the client was last scheduled. Non-zero needs_read means a
+	 * thread is already servicing this client. */
+	uint32_t pending_events;
+	int needs_read;
+
 	/* Have we disabled this client to be removed when there are no refs? */
 	bool invalid;
+	/* Epoch stamp of when this client was removed from the client table */
+	uint64_t dead_epoch;
 
 	/* For dead_clients list */
 	client_instance_t *dead_next;
@@ -60,11 +86,23 @@ struct client_instance {
 	/* Which serverurl is this instance connected to */
 	int server;
 
+	/* Receive buffer from the pool, held only while there is a partial
+	 * message. Unparsed data is the window from bufstart to bufofs. */
 	char *buf;
+	unsigned long bufsize;
+	unsigned long bufstart;
 	unsigned long bufofs;
 
-	/* Are we currently sending a blocked message from this client */
-	sender_send_t *sending;
+	/* Queue of sends not yet fully written to this client, protected by
+	 * send_lock */
+	mutex_t send_lock;
+	sender_send_t *sends;
+	int sends_queued;
+	int64_t sends_size;
+	/* Count of sends that could not be written out immediately */
+	int64_t sends_delayed;
+	/* Is this client registered for EPOLLOUT events */
+	bool epollout;
 
 	/* Is this a trusted remote server */
 	bool remote;
@@ -80,8 +118,13 @@ struct client_instance {
 	/* Has this client been authorised in redirector mode */
 	bool authorised;
 
-	/* Time this client started blocking, 0 when not blocked */
+	/* Time this client started blocking, 0 when not blocked. Only changed
+	 * with both send_lock and the cdata sender_lock held so either lock is
+	 * enough to read it. */
 	time_t blocked_time;
+	/* For the blocked_clients list */
+	client_instance_t *blocked_next;
+	client_instance_t *blocked_prev;
 
 	/* The size of the socket send buffer */
 	int sendbufsize;
@@ -95,8 +138,14 @@ struct sender_send {
 	char *buf;
 	int len;
 	int ofs;
+
+	/* Shared broadcast buf belongs to, if any, instead of owning buf */
+	broadcast_t *bcast;
 };
 
+/* Allocator for the sender_sends queued for every message to a client */
+static ckslab_t *send_slab;
+
 struct share {
 	share_t *next;
 	share_t *prev;
@@ -112,9 +161,78 @@ struct redirect {
 	int redirect_no;
 };
 
+/* A batch of clients scheduled for servicing by a cevent thread */
+typedef struct client_batch {
+	int count;
+	client_instance_t *clients[];
+} cbatch_t;
+
+typedef struct connector_data cdata_t;
+
+/* Clients are indexed by the sequence number in their id within a shard in a
+ * three level radix table, looked up without locks. Leaves are freed once
+ * every id they cover has been retired; the top level wraps around after
+ * 2^36 ids per shard. */
+#define CTABLE_BITS 12
+#define CTABLE_SIZE (1 << CTABLE_BITS)
+#define CTABLE_MASK (CTABLE_SIZE - 1)
+
+typedef struct ctable_leaf {
+	client_instance_t *clients[CTABLE_SIZE];
+	/* Count of ids in this leaf that have been removed or never used */
+	int retired;
+} ctleaf_t;
+
+typedef struct ctable_mid {
+	ctleaf_t *leaves[CTABLE_SIZE];
+} ctmid_t;
+
+/* Each receiver thread owns a shard with its own listening sockets, epoll set
+ * and subset of clients, so accepting and reading from clients on different
+ * shards never contends on the same lock. */
+struct client_shard {
+	cdata_t *cdata;
+	int id;
+
+	/* Protects the client lists and modifying the client table of this
+	 * shard. Looking clients up in the table takes no lock. */
+	cklock_t lock;
+
+	/* Table of clients by id */
+	ctmid_t *table[CTABLE_SIZE];
+	/* Linked list of all clients */
+	client_instance_t *clients;
+	int nclients;
+	/* Linked list of dead clients no longer in use but may still have references */
+	client_instance_t *dead_clients;
+	/* Linked list of client structures we can reuse */
+	client_instance_t *recycled_clients;
+
+	int clients_generated;
+	int dead_generated;
+
+	/* Ids are handed out as serverurls + client_ids * receivers + shard id */
+	int64_t client_ids;
+
+	/* Array of server fds this shard accepts on */
+	int *serverfd;
+	/* The epoll fd */
+	int epfd;
+
+	/* The io_uring and its receive buffers when using the io_uring
+	 * backend instead of epoll. Submissions are serialised by ring_lock
+	 * as sends from other threads may need to wait for POLLOUT */
+	ckring_t *ring;
+	ckbufring_t *bufring;
+	mutex_t ring_lock;
+
+	pthread_t pth_receiver;
+};
+
 /* Private data for the connector */
 struct connector_data {
 	ckpool_t *ckp;
+	/* Protects the redirects hashtable */
 	cklock_t lock;
 	proc_instance_t *pi;
 
@@ -124,24 +242,13 @@ struct connector_data {
 	int *serverfd;
 	/* All time count of clients connected */
 	int nfds;
-	/* The epoll fd */
-	int epfd;
 
 	bool accept;
 	pthread_t pth_sender;
-	pthread_t pth_receiver;
 
-	/* For the hashtable of all clients */
-	client_instance_t *clients;
-	/* Linked list of dead clients no longer in use but may still have references */
-	client_instance_t *dead_clients;
-	/* Linked list of client structures we can reuse */
-	client_instance_t *recycled_clients;
-
-	int clients_generated;
-	int dead_generated;
-
-	int64_t client_ids;
+	/* Array of receiver shards */
+	cshard_t *shards;
+	int receivers;
 
 	/* client message process queue */
 	ckmsgq_t *cmpq;
@@ -149,17 +256,14 @@ struct connector_data {
 	/* client message event process queue */
 	ckmsgq_t *cevents;
 
-	/* For the linked list of pending sends */
-	sender_send_t *sender_sends;
-
 	int64_t sends_generated;
 	int64_t sends_delayed;
-	int64_t sends_queued;
-	int64_t sends_size;
 
-	/* For protecting the pending sends list */
+	/* Linked list of clients with sends blocked on a full socket */
+	client_instance_t *blocked_clients;
+
+	/* For protecting the blocked clients list */
 	mutex_t sender_lock;
-	pthread_cond_t sender_cond;
 
 	/* Hash list of all redirected IP address in redirector mode */
 	redirect_t *redirects;
@@ -172,9 +276,15 @@ struct connector_data {
 
 	/* Have we given the warning about inability to raise sendbuf size */
 	bool wmem_warn;
-};
 
-typedef struct connector_data cdata_t;
+	/* Pool of PAGESIZE receive buffers not in use by any client, linked
+	 * through their first bytes and protected by recvbuf_lock */
+	mutex_t recvbuf_lock;
+	char *recvbufs;
+	int recvbufs_pooled;
+	int recvbufs_used;
+	int64_t recvbufs_generated;
+};
 
 void connector_upstream_msg(ckpool_t *ckp, char *msg)
 {
@@ -185,44 +295,123 @@ void connector_upstream_msg(ckpool_t *ckp, char *msg)
 }
 
 /* Increase the reference count of instance */
-static void __inc_instance_ref(client_instance_t *client)
+static void inc_instance_ref(client_instance_t *client)
 {
-	client->ref++;
+	__atomic_add_fetch(&client->ref, 1, __ATOMIC_ACQ_REL);
 }
 
-static void inc_instance_ref(cdata_t *cdata, client_instance_t *client)
+/* Decrease the reference count of instance */
+static void dec_instance_ref(client_instance_t *client)
 {
-	ck_wlock(&cdata->lock);
-	__inc_instance_ref(client);
-	ck_wunlock(&cdata->lock);
+	__atomic_sub_fetch(&client->ref, 1, __ATOMIC_ACQ_REL);
 }
 
-/* Increase the reference count of instance */
-static void __dec_instance_ref(client_instance_t *client)
+/* Find which shard a client id belongs to. Ids below serverurls are the
+ * server fds and never belong to a client. */
+static cshard_t *shard_by_id(cdata_t *cdata, const int64_t id)
 {
-	client->ref--;
+	int64_t base = cdata->ckp->serverurls;
+
+	if (unlikely(id < base))
+		return NULL;
+	return &cdata->shards[(id - base) % cdata->receivers];
 }
 
-static void dec_instance_ref(cdata_t *cdata, client_instance_t *client)
+/* Sequence number of an id within its shard, wrapping at the size of the
+ * client table */
+static uint64_t ctable_index(cdata_t *cdata, const int64_t id)
 {
-	ck_wlock(&cdata->lock);
-	__dec_instance_ref(client);
-	ck_wunlock(&cdata->lock);
+	uint64_t idx = (id - cdata->ckp->serverurls) / cdata->receivers;
+
+	return idx & ((1ULL << (CTABLE_BITS * 3)) - 1);
+}
+
+/* Find the table leaf for idx, creating it if create is set. Creating must
+ * be done with the shard lock held. */
+static ctleaf_t *ctable_leaf(cshard_t *shard, const uint64_t idx, const bool create)
+{
+	ctmid_t *mid, **midp = &shard->table[idx >> (CTABLE_BITS * 2)];
+	ctleaf_t *leaf, **leafp;
+
+	mid = __atomic_load_n(midp, __ATOMIC_ACQUIRE);
+	if (!mid) {
+		if (!create)
+			return NULL;
+		mid = ckzalloc(sizeof(ctmid_t));
+		__atomic_store_n(midp, mid, __ATOMIC_RELEASE);
+	}
+	leafp = &mid->leaves[(idx >> CTABLE_BITS) & CTABLE_MASK];
+	leaf = __atomic_load_n(leafp, __ATOMIC_ACQUIRE);
+	if (!leaf && create) {
+		leaf = ckzalloc(sizeof(ctleaf_t));
+		__atomic_store_n(leafp, leaf, __ATOMIC_RELEASE);
+	}
+	return leaf;
+}
+
+/* Lock free lookup of the client with id. Must be called inside an epoch
+ * section and the returned client checked against id. */
+static client_instance_t *ctable_find(cdata_t *cdata, cshard_t *shard, const int64_t id)
+{
+	const uint64_t idx = ctable_index(cdata, id);
+	ctleaf_t *leaf = ctable_leaf(shard, idx, false);
+
+	if (unlikely(!leaf))
+		return NULL;
+	return __atomic_load_n(&leaf->clients[idx & CTABLE_MASK], __ATOMIC_ACQUIRE);
+}
+
+/* Enter with shard lock held */
+static void __ctable_add(cshard_t *shard, client_instance_t *client)
+{
+	const uint64_t idx = ctable_index(shard->cdata, client->id);
+	ctleaf_t *leaf = ctable_leaf(shard, idx, true);
+
+	__atomic_store_n(&leaf->clients[idx & CTABLE_MASK], client, __ATOMIC_RELEASE);
+}
+
+/* Mark the table slot for id as no longer in use, removing any client from
+ * it and freeing the leaf once all its slots are retired. Enter with shard
+ * lock held. */
+static void __ctable_retire(cshard_t *shard, const int64_t id)
+{
+	const uint64_t idx = ctable_index(shard->cdata, id);
+	ctleaf_t *leaf = ctable_leaf(shard, idx, true);
+	ctmid_t *mid;
+
+	__atomic_store_n(&leaf->clients[idx & CTABLE_MASK], NULL, __ATOMIC_RELEASE);
+	if (++leaf->retired < CTABLE_SIZE)
+		return;
+	mid = shard->table[idx >> (CTABLE_BITS * 2)];
+	__atomic_store_n(&mid->leaves[(idx >> CTABLE_BITS) & CTABLE_MASK], NULL, __ATOMIC_RELEASE);
+	ckepoch_free(leaf);
+}
+
+/* Take a reference on client if it is still the valid client for id, as
+ * the instance may have been dropped since it was found in the table. */
+static bool ref_valid_client(client_instance_t *client, const int64_t id)
+{
+	inc_instance_ref(client);
+	if (likely(__atomic_load_n(&client->id, __ATOMIC_ACQUIRE) == id &&
+		   !__atomic_load_n(&client->invalid, __ATOMIC_ACQUIRE)))
+		return true;
+	dec_instance_ref(client);
+	return false;
 }
 
 /* Recruit a client structure from a recycled one if available, creating a
  * new structure only if we have none to reuse. */
-static client_instance_t *recruit_client(cdata_t *cdata)
+static client_instance_t *recruit_client(cshard_t *shard)
 {
 	client_instance_t *client = NULL;
 
-	ck_wlock(&cdata->lock);
-	if (cdata->recycled_clients) {
-		client = cdata->recycled_clients;
-		DL_DELETE2(cdata->recycled_clients, client, recycled_prev, recycled_next);
+	ck_wlock(&shard->lock);
+	if (shard->recycled_clients) {
+		client = shard->recycled_clients;
+		DL_DELETE2(shard->recycled_clients, client, recycled_prev, recycled_next);
 	} else
-		cdata->clients_generated++;
-	ck_wunlock(&cdata->lock);
+		shard->clients_generated++;
+	ck_wunlock(&shard->lock);
 
 	if (!client) {
 		LOGDEBUG("Connector created new client instance");
@@ -230,77 +419,81 @@ static client_instance_t *recruit_client(cdata_t *cdata)
 	} else
 		LOGDEBUG("Connector recycled client instance");
 
-	client->buf = ckzalloc(PAGESIZE);
+	client->shard = shard;
+	mutex_init(&client->send_lock);
 
 	return client;
 }
 
-static void __recycle_client(cdata_t *cdata, client_instance_t *client)
+static void put_recvbuf(cdata_t *cdata, client_instance_t *client);
+
+static void __recycle_client(cshard_t *shard, client_instance_t *client)
 {
-	dealloc(client->buf);
+	if (client->buf)
+		put_recvbuf(shard->cdata, client);
+	mutex_destroy(&client->send_lock);
 	memset(client, 0, sizeof(client_instance_t));
 	client->id = -1;
-	DL_APPEND2(cdata->recycled_clients, client, recycled_prev, recycled_next);
+	client->shard = shard;
+	DL_APPEND2(shard->recycled_clients, client, recycled_prev, recycled_next);
 }
 
-static void recycle_client(cdata_t *cdata, client_instance_t *client)
+static void recycle_client(client_instance_t *client)
 {
-	ck_wlock(&cdata->lock);
-	__recycle_client(cdata, client);
-	ck_wunlock(&cdata->lock);
+	cshard_t *shard = client->shard;
+
+	ck_wlock(&shard->lock);
+	__recycle_client(shard, client);
+	ck_wunlock(&shard->lock);
+}
+
+/* Enter with shard lock held */
+static int64_t __shard_newclientid(cshard_t *shard)
+{
+	cdata_t *cdata = shard->cdata;
+
+	return cdata->ckp->serverurls + shard->client_ids++ * cdata->receivers + shard->id;
 }
 
 /* Allows the stratifier to get a unique local virtualid for subclients */
 int64_t connector_newclientid(ckpool_t *ckp)
 {
+	cdata_t *cdata = ckp->cdata;
+	cshard_t *shard = &cdata->shards[0];
 	int64_t ret;
 
-	cdata_t *cdata = ckp->cdata;
+	ck_wlock(&shard->lock);
+	ret = __shard_newclientid(shard);
+	/* These ids never have a client in the table */
+	__ctable_retire(shard, ret);
+	ck_wunlock(&shard->lock);
 
-	ck_wlock(&cdata->lock);
-	ret = cdata->client_ids++;
-	ck_wunlock(&cdata->lock);
+	return ret;
+}
+
+/* Total count of clients across all shards */
+static int connected_clients(cdata_t *cdata)
+{
+	int i, ret = 0;
 
+	for (i = 0; i < cdata->receivers; i++)
+		ret += __atomic_load_n(&cdata->shards[i].nclients, __ATOMIC_RELAXED);
 	return ret;
 }
 
-/* Accepts incoming connections on the server socket and generates client
- * instances */
-static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
+static bool uring_recv_client(cshard_t *shard, client_instance_t *client);
+
+/* Set up a client instance for a newly accepted fd and start watching it for
+ * incoming data */
+static int add_client(cshard_t *shard, client_instance_t *client, int fd,
+		      const int no_clients)
 {
-	int fd, port, no_clients, sockd;
-	ckpool_t *ckp = cdata->ckp;
-	client_instance_t *client;
+	cdata_t *cdata = shard->cdata;
 	struct epoll_event event;
-	socklen_t address_len;
 	socklen_t optlen;
+	int port, nfds;
 
-	ck_rlock(&cdata->lock);
-	no_clients = HASH_COUNT(cdata->clients);
-	ck_runlock(&cdata->lock);
-
-	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
-		LOGWARNING("Server full with %d clients", no_clients);
-		return 0;
-	}
-
-	sockd = cdata->serverfd[server];
-	client = recruit_client(cdata);
-	client->server = server;
-	client->address = (struct sockaddr *)&client->address_storage;
-	address_len = sizeof(client->address_storage);
-	fd = accept(sockd, client->address, &address_len);
-	if (unlikely(fd < 0)) {
-		/* Handle these errors gracefully should we ever share this
-		 * socket */
-		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
-			LOGERR("Recoverable error on accept in accept_client");
-			return 0;
-		}
-		LOGERR("Failed to accept on socket %d in acceptor", sockd);
-		recycle_client(cdata, client);
-		return -1;
-	}
+	nfds = __atomic_fetch_add(&cdata->nfds, 1, __ATOMIC_RELAXED);
 
 	switch (client->address->sa_family) {
 		const struct sockaddr_in *inet4_in;
@@ -318,9 +511,9 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 			break;
 		default:
 			LOGWARNING("Unknown INET type for client %d on socket %d",
-				   cdata->nfds, fd);
+				   nfds, fd);
 			Close(fd);
-			recycle_client(cdata, client);
+			recycle_client(client);
 			return 0;
 	}
 
@@ -328,50 +521,108 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	noblock_socket(fd);
 
 	LOGINFO("Connected new client %d on socket %d to %d active clients from %s:%d",
-		cdata->nfds, fd, no_clients, client->address_name, port);
-
-	ck_wlock(&cdata->lock);
-	client->id = cdata->client_ids++;
-	HASH_ADD_I64(cdata->clients, id, client);
-	cdata->nfds++;
-	ck_wunlock(&cdata->lock);
+		nfds, fd, no_clients, client->address_name, port);
 
 	/* We increase the ref count on this client as epoll creates a pointer
 	 * to it. We drop that reference when the socket is closed which
-	 * removes it automatically from the epoll list. */
-	__inc_instance_ref(client);
+	 * removes it automatically from the epoll list. With io_uring the
+	 * reference is for the outstanding receive which is terminated by
+	 * shutting down the socket when it's dropped. */
+	inc_instance_ref(client);
 	client->fd = fd;
+
+	ck_wlock(&shard->lock);
+	client->id = __shard_newclientid(shard);
+	__ctable_add(shard, client);
+	DL_APPEND(shard->clients, client);
+	shard->nclients++;
+	ck_wunlock(&shard->lock);
 	optlen = sizeof(client->sendbufsize);
 	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
 	LOGDEBUG("Client sendbufsize detected as %d", client->sendbufsize);
 
+	if (shard->ring) {
+		if (unlikely(!uring_recv_client(shard, client))) {
+			LOGERR("Failed to submit io_uring recv in add_client");
+			dec_instance_ref(client);
+		}
+		return 1;
+	}
+
 	event.data.u64 = client->id;
-	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if (unlikely(epoll_ctl(shard->epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
 		LOGERR("Failed to epoll_ctl add in accept_client");
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 		return 0;
 	}
 
 	return 1;
 }
 
-static int __drop_client(cdata_t *cdata, client_instance_t *client)
+/* Accepts incoming connections on the server socket and generates client
+ * instances */
+static int accept_client(cshard_t *shard, const uint64_t server)
+{
+	cdata_t *cdata = shard->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	client_instance_t *client;
+	int fd, no_clients, sockd;
+	socklen_t address_len;
+
+	no_clients = connected_clients(cdata);
+
+	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
+		LOGWARNING("Server full with %d clients", no_clients);
+		return 0;
+	}
+
+	sockd = shard->serverfd[server];
+	client = recruit_client(shard);
+	client->server = server;
+	client->address = (struct sockaddr *)&client->address_storage;
+	address_len = sizeof(client->address_storage);
+	fd = accept(sockd, client->address, &address_len);
+	if (unlikely(fd < 0)) {
+		/* Handle these errors gracefully should we ever share this
+		 * socket */
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+			LOGERR("Recoverable error on accept in accept_client");
+			recycle_client(client);
+			return 0;
+		}
+		LOGERR("Failed to accept on socket %d in acceptor", sockd);
+		recycle_client(client);
+		return -1;
+	}
+
+	return add_client(shard, client, fd, no_clients);
+}
+
+/* Enter with shard lock held */
+static int __drop_client(cshard_t *shard, client_instance_t *client)
 {
 	int ret = -1;
 
 	if (client->invalid)
 		goto out;
-	client->invalid = true;
+	__atomic_store_n(&client->invalid, true, __ATOMIC_RELEASE);
 	ret = client->fd;
+	/* The io_uring holds its own reference to the file so shut the socket
+	 * down to terminate any outstanding receive on it */
+	if (shard->ring)
+		shutdown(client->fd, SHUT_RDWR);
 	/* Closing the fd will automatically remove it from the epoll list */
 	Close(client->fd);
-	HASH_DEL(cdata->clients, client);
-	DL_APPEND2(cdata->dead_clients, client, dead_prev, dead_next);
+	__ctable_retire(shard, client->id);
+	DL_DELETE(shard->clients, client);
+	shard->nclients--;
+	client->dead_epoch = ckepoch_retire();
+	DL_APPEND2(shard->dead_clients, client, dead_prev, dead_next);
 	/* This is the reference to this client's presence in the
 	 * epoll list. */
-	__dec_instance_ref(client);
-	cdata->dead_generated++;
+	dec_instance_ref(client);
+	shard->dead_generated++;
 out:
 	return ret;
 }
@@ -389,13 +640,14 @@ static int drop_client(cdata_t *cdata, client_instance_t *client)
 {
 	bool passthrough = client->passthrough, remote = client->remote;
 	char address_name[INET6_ADDRSTRLEN];
+	cshard_t *shard = client->shard;
 	int64_t client_id = client->id;
 	int fd = -1;
 
 	strcpy(address_name, client->address_name);
-	ck_wlock(&cdata->lock);
-	fd = __drop_client(cdata, client);
-	ck_wunlock(&cdata->lock);
+	ck_wlock(&shard->lock);
+	fd = __drop_client(shard, client);
+	ck_wunlock(&shard->lock);
 
 	if (fd > -1) {
 		if (passthrough) {
@@ -432,33 +684,40 @@ static void stratifier_drop_client(ckpool_t *ckp, const client_instance_t *clien
  * regularly but keep the instances in a linked list until their ref count
  * drops to zero when we can remove them lazily. Client must hold a reference
  * count. */
+static void clear_client_sends(cdata_t *cdata, client_instance_t *client);
+static sender_send_t *__detach_client_sends(cdata_t *cdata, client_instance_t *client);
+static void clear_sender_sends(sender_send_t *sends);
+
 static int invalidate_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
 {
+	cshard_t *shard = client->shard;
 	client_instance_t *tmp;
 	int ret;
 
 	ret = drop_client(cdata, client);
+	clear_client_sends(cdata, client);
 	if ((!ckp->passthrough || ckp->node) && !client->passthrough)
 		stratifier_drop_client(ckp, client);
 	if (ckp->passthrough)
 		generator_drop_client(ckp, client);
 
 	/* Cull old unused clients lazily when there are no more reference
-	 * counts for them. */
-	ck_wlock(&cdata->lock);
-	DL_FOREACH_SAFE2(cdata->dead_clients, client, tmp, dead_next) {
-		if (!client->ref) {
-			DL_DELETE2(cdata->dead_clients, client, dead_prev, dead_next);
+	 * counts for them and no lock free lookup can still find them. */
+	ck_wlock(&shard->lock);
+	DL_FOREACH_SAFE2(shard->dead_clients, client, tmp, dead_next) {
+		if (!__atomic_load_n(&client->ref, __ATOMIC_ACQUIRE) &&
+		    ckepoch_safe(client->dead_epoch)) {
+			DL_DELETE2(shard->dead_clients, client, dead_prev, dead_next);
 			LOGINFO("Connector recycling client %"PRId64, client->id);
 			/* We only close the client fd once we're sure there
 			 * are no references to it left to prevent fds being
 			 * reused on new and old clients. */
 			nolinger_socket(client->fd);
 			Close(client->fd);
-			__recycle_client(cdata, client);
+			__recycle_client(shard, client);
 		}
 	}
-	ck_wunlock(&cdata->lock);
+	ck_wunlock(&shard->lock);
 
 	return ret;
 }
@@ -466,20 +725,32 @@ static int invalidate_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *c
 static void drop_all_clients(cdata_t *cdata)
 {
 	client_instance_t *client, *tmp;
+	int i;
+
+	for (i = 0; i < cdata->receivers; i++) {
+		cshard_t *shard = &cdata->shards[i];
+		sender_send_t *sends = NULL;
+
+		ck_wlock(&shard->lock);
+		DL_FOREACH_SAFE(shard->clients, client, tmp) {
+			__drop_client(shard, client);
+			mutex_lock(&client->send_lock);
+			DL_CONCAT(sends, __detach_client_sends(cdata, client));
+			mutex_unlock(&client->send_lock);
+		}
+		ck_wunlock(&shard->lock);
 
-	ck_wlock(&cdata->lock);
-	HASH_ITER(hh, cdata->clients, client, tmp) {
-		__drop_client(cdata, client);
+		clear_sender_sends(sends);
 	}
-	ck_wunlock(&cdata->lock);
 }
 
 static void send_client(ckpool_t *ckp, cdata_t *cdata, int64_t id, char *buf);
 
 /* Look for shares being submitted via a redirector and add them to a linked
  * list for looking up the responses. */
-static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, const json_t *val)
+static void parse_redirector_share(client_instance_t *client, const json_t *val)
 {
+	cshard_t *shard = client->shard;
 	share_t *share, *tmp;
 	time_t now;
 	int64_t id;
@@ -495,9 +766,9 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 
 	LOGINFO("Redirector adding client %"PRId64" share id: %"PRId64, client->id, id);
 
-	/* We use the cdata lock instead of a separate lock since this function
+	/* We use the shard lock instead of a separate lock since this function
 	 * is called infrequently. */
-	ck_wlock(&cdata->lock);
+	ck_wlock(&shard->lock);
 	DL_APPEND(client->shares, share);
 
 	/* Age old shares. */
@@ -507,350 +778,1230 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 			dealloc(share);
 		}
 	}
-	ck_wunlock(&cdata->lock);
+	ck_wunlock(&shard->lock);
 }
 
-/* Client is holding a reference count from being on the epoll list. Returns
- * true if we will still be receiving messages from this client. */
-static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+/* Maximum number of idle receive buffers kept in the pool */
+#define RECVBUF_POOL 4096
+
+/* Get a PAGESIZE receive buffer from the pool, allocating one only if the
+ * pool is empty */
+static char *get_recvbuf(cdata_t *cdata)
 {
-	int buflen, ret;
-	json_t *val;
-	char *eol;
+	char *buf;
 
-retry:
-	if (unlikely(client->bufofs > MAX_MSGSIZE)) {
-		if (!client->remote) {
-			LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
-				client->id, client->fd);
-			return false;
-		}
-		client->buf = realloc(client->buf, round_up_page(client->bufofs + MAX_MSGSIZE + 1));
+	mutex_lock(&cdata->recvbuf_lock);
+	buf = cdata->recvbufs;
+	if (buf) {
+		cdata->recvbufs = *(char **)buf;
+		cdata->recvbufs_pooled--;
+	} else
+		cdata->recvbufs_generated++;
+	cdata->recvbufs_used++;
+	mutex_unlock(&cdata->recvbuf_lock);
+
+	if (!buf)
+		buf = ckalloc(PAGESIZE);
+	return buf;
+}
+
+/* Return a client's receive buffer to the pool once it has no partial data
+ * left in it, freeing it instead if it was enlarged or the pool is full. */
+static void put_recvbuf(cdata_t *cdata, client_instance_t *client)
+{
+	const unsigned long bufsize = client->bufsize;
+	char *buf = client->buf;
+	bool pooled = false;
+
+	client->buf = NULL;
+	client->bufsize = client->bufstart = client->bufofs = 0;
+
+	mutex_lock(&cdata->recvbuf_lock);
+	cdata->recvbufs_used--;
+	if (bufsize == PAGESIZE && cdata->recvbufs_pooled < RECVBUF_POOL) {
+		*(char **)buf = cdata->recvbufs;
+		cdata->recvbufs = buf;
+		cdata->recvbufs_pooled++;
+		pooled = true;
 	}
-	/* This read call is non-blocking since the socket is set to O_NOBLOCK */
-	ret = read(client->fd, client->buf + client->bufofs, MAX_MSGSIZE);
-	if (ret < 1) {
-		if (likely(errno == EAGAIN || errno == EWOULDBLOCK || !ret))
-			return true;
-		LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with bufofs %lu ret %d errno %d %s",
-			client->id, client->fd, client->bufofs, ret, errno, ret && errno ? strerror(errno) : "");
+	mutex_unlock(&cdata->recvbuf_lock);
+
+	if (!pooled)
+		free(buf);
+}
+
+/* Make sure the client has a receive buffer with room for another len bytes
+ * after bufofs, taking one from the pool if it has none. The partial message
+ * left in the window is only moved to the start of the buffer when it runs
+ * out of room at the end. Returns false if the client should be dropped. */
+static bool client_buf_space(cdata_t *cdata, client_instance_t *client, const unsigned long len)
+{
+	unsigned long pending;
+
+	if (!client->buf) {
+		client->buf = get_recvbuf(cdata);
+		client->bufsize = PAGESIZE;
+	}
+	pending = client->bufofs - client->bufstart;
+	if (unlikely(pending > MAX_MSGSIZE && !client->remote)) {
+		LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
+			  client->id, client->fd);
 		return false;
 	}
-	client->bufofs += ret;
-reparse:
-	eol = memchr(client->buf, '\n', client->bufofs);
-	if (!eol)
-		goto retry;
+	if (client->bufofs + len <= client->bufsize)
+		return true;
+	if (client->bufstart) {
+		memmove(client->buf, client->buf + client->bufstart, pending);
+		client->bufstart = 0;
+		client->bufofs = pending;
+	}
+	if (client->bufofs + len > client->bufsize) {
+		/* Only trusted remote servers send messages this large */
+		client->bufsize = round_up_page(client->bufofs + len);
+		client->buf = realloc(client->buf, client->bufsize);
+	}
+	return true;
+}
 
-	/* Do something useful with this message now */
-	buflen = eol - client->buf + 1;
-	if (unlikely(buflen > MAX_MSGSIZE && !client->remote)) {
-		LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
-		return false;
+/* Find the first quote or backslash in [p, end), returning end if there is
+ * none, checking 16 bytes at a time where SSE2 is available. */
+static char *scan_quote(char *p, char *end)
+{
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)p);
+		int mask;
+
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+						      _mm_cmpeq_epi8(chunk, bslash)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (p < end && *p != '"' && *p != '\\')
+		p++;
+	return p;
+}
+
+static char *skip_space(char *p, char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	return p;
+}
+
+/* Scan a json string without escapes at *pp, terminating it in place and
+ * moving *pp past it. Returns NULL if there is no such string. */
+static char *scan_string(char **pp, char *end)
+{
+	char *p = *pp, *str;
+
+	if (p >= end || *p != '"')
+		return NULL;
+	str = ++p;
+	p = scan_quote(p, end);
+	if (p >= end || *p != '"')
+		return NULL;
+	*p = '\0';
+	*pp = p + 1;
+	return str;
+}
+
+/* Scan the id of a message, which is an integer, string without escapes or
+ * null, into a json value for the stratifier to return in its response. */
+static json_t *scan_id(char **pp, char *end)
+{
+	char *p = *pp, *str;
+	int64_t id = 0;
+	int digits = 0;
+	bool neg;
+
+	if (p < end && *p == '"') {
+		str = scan_string(pp, end);
+		return str ? json_string(str) : NULL;
+	}
+	if (end - p >= 4 && !memcmp(p, "null", 4)) {
+		*pp = p + 4;
+		return json_null();
+	}
+	neg = (p < end && *p == '-');
+	if (neg)
+		p++;
+	while (p < end && *p >= '0' && *p <= '9') {
+		/* Leave anything that may overflow to jansson */
+		if (++digits > 18)
+			return NULL;
+		id = id * 10 + *p++ - '0';
+	}
+	if (!digits)
+		return NULL;
+	*pp = p;
+	return json_integer(neg ? -id : id);
+}
+
+/* Scan a mining.submit message with its keys in any order, decoding the id
+ * and up to six string params into submit. The strings are terminated in
+ * place in submit->buf. Anything else, or anything unusual in the message,
+ * fails the scan so the message is handled by jansson instead. */
+static bool scan_submit(submit_t *submit, const int len)
+{
+	char *p = submit->buf, *end = submit->buf + len, *str;
+	const char **params[6] = { &submit->workername, &submit->job_id, &submit->nonce2,
+				   &submit->ntime, &submit->nonce, &submit->version_mask };
+	bool method = false, have_params = false, id = false;
+
+	p = skip_space(p, end);
+	if (p >= end || *p++ != '{')
+		goto out_fail;
+	while (42) {
+		char *key;
+
+		p = skip_space(p, end);
+		key = scan_string(&p, end);
+		if (!key)
+			goto out_fail;
+		p = skip_space(p, end);
+		if (p >= end || *p++ != ':')
+			goto out_fail;
+		p = skip_space(p, end);
+		if (!strcmp(key, "method")) {
+			str = scan_string(&p, end);
+			if (method || !str || strcmp(str, "mining.submit"))
+				goto out_fail;
+			method = true;
+		} else if (!strcmp(key, "params")) {
+			if (have_params || p >= end || *p++ != '[')
+				goto out_fail;
+			p = skip_space(p, end);
+			if (p < end && *p == ']')
+				p++;
+			else while (42) {
+				if (submit->params >= 6)
+					goto out_fail;
+				str = scan_string(&p, end);
+				if (!str)
+					goto out_fail;
+				*params[submit->params++] = str;
+				p = skip_space(p, end);
+				if (p < end && *p == ',') {
+					p = skip_space(p + 1, end);
+					continue;
+				}
+				if (p >= end || *p++ != ']')
+					goto out_fail;
+				break;
+			}
+			have_params = true;
+		} else if (!strcmp(key, "id")) {
+			if (id)
+				goto out_fail;
+			submit->id_val = scan_id(&p, end);
+			if (!submit->id_val)
+				goto out_fail;
+			id = true;
+		} else
+			goto out_fail;
+		p = skip_space(p, end);
+		if (p < end && *p == ',') {
+			p++;
+			continue;
+		}
+		if (p >= end || *p++ != '}')
+			goto out_fail;
+		break;
 	}
+	if (skip_space(p, end) != end || !method || !have_params)
+		goto out_fail;
+	return true;
 
-	if (!(val = json_loads(client->buf, JSON_DISABLE_EOF_CHECK, NULL))) {
-		char *buf = strdup("Invalid JSON, disconnecting\n");
+out_fail:
+	if (submit->id_val) {
+		json_decref(submit->id_val);
+		submit->id_val = NULL;
+	}
+	return false;
+}
 
-		LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, client->buf);
-		send_client(ckp, cdata, client->id, buf);
+/* Try to decode a line as a mining.submit and hand it straight to the
+ * stratifier's share processor, or process it right here in runtocompletion
+ * mode. Returns false if the line needs parsing by
+ * jansson instead. */
+static bool fast_submit(ckpool_t *ckp, client_instance_t *client, const char *line,
+			const int linelen)
+{
+	submit_t *submit = ckzalloc(sizeof(submit_t) + linelen);
+
+	memcpy(submit->buf, line, linelen);
+	if (!scan_submit(submit, linelen)) {
+		free(submit);
 		return false;
-	} else {
-		if (client->passthrough) {
-			int64_t passthrough_id;
+	}
+	submit->client_id = client->id;
+	/* As with the json path, discard messages of dropped clients */
+	if (unlikely(client->invalid)) {
+		json_decref(submit->id_val);
+		free(submit);
+	} else if (ckp->runtocompletion)
+		stratifier_process_submit(ckp, submit);
+	else
+		stratifier_add_submit(ckp, submit);
+	return true;
+}
+
+/* Process every complete message in buf in place, returning how many bytes
+ * were consumed or -1 if the client should be dropped. */
+static int parse_client_lines(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			      const char *buf, const int len)
+{
+	const char *line = buf, *end = buf + len, *eol;
+	bool fastpath;
+	int linelen;
+	json_t *val;
+
+	/* Shares from ordinary clients to the stratifier are decoded without
+	 * jansson where possible */
+	fastpath = !ckp->passthrough && !ckp->node && !ckp->redirector && !client->passthrough &&
+		!client->remote;
+
+	while ((eol = memchr(line, '\n', end - line)) != NULL) {
+		/* Do something useful with this message now */
+		linelen = eol - line + 1;
+		if (unlikely(linelen > MAX_MSGSIZE && !client->remote)) {
+			LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
+			return -1;
+		}
+		if (fastpath && fast_submit(ckp, client, line, linelen)) {
+			line = eol + 1;
+			continue;
+		}
 
-			json_getdel_int64(&passthrough_id, val, "client_id");
-			passthrough_id = (client->id << 32) | passthrough_id;
-			json_object_set_new_nocheck(val, "client_id", json_integer(passthrough_id));
+		if (!(val = json_loadb(line, linelen, JSON_DISABLE_EOF_CHECK, NULL))) {
+			char *msg = strdup("Invalid JSON, disconnecting\n");
+
+			LOGINFO("Client id %"PRId64" sent invalid json message %.*s", client->id,
+				linelen - 1, line);
+			send_client(ckp, cdata, client->id, msg);
+			return -1;
 		} else {
-			if (ckp->redirector && !client->redirected && strstr(client->buf, "mining.submit"))
-				parse_redirector_share(cdata, client, val);
-			json_object_set_new_nocheck(val, "client_id", json_integer(client->id));
-			json_object_set_new_nocheck(val, "address", json_string(client->address_name));
+			const char *address = client->address_name;
+			int64_t client_id = client->id;
+
+			if (client->passthrough) {
+				/* Messages from a passthrough carry the id and
+				 * address of the client behind it */
+				json_getdel_int64(&client_id, val, "client_id");
+				client_id = (client->id << 32) | client_id;
+				if (json_is_string(json_object_get(val, "address")))
+					address = json_string_value(json_object_get(val, "address"));
+			} else if (client->remote) {
+				/* Remote servers' messages are attributed to
+				 * the remote server's address */
+				json_object_set_new_nocheck(val, "address", json_string(address));
+			} else if (ckp->redirector && !client->redirected) {
+				const char *method = json_string_value(json_object_get(val, "method"));
+
+				if (method && !strcmp(method, "mining.submit"))
+					parse_redirector_share(client, val);
+			}
+
+			/* Do not send messages of clients we've already dropped. We
+			 * do this unlocked as the occasional false negative can be
+			 * filtered by the stratifier. */
+			if (unlikely(client->invalid))
+				json_decref(val);
+			else if (!ckp->passthrough)
+				stratifier_add_msg(ckp, client_id, client->server, address, val);
+			else {
+				/* Messages passed upstream carry their routing
+				 * details in the json */
+				json_object_set_new_nocheck(val, "client_id", json_integer(client_id));
+				if (!client->passthrough)
+					json_object_set_new_nocheck(val, "address", json_string(client->address_name));
+				json_object_set_new_nocheck(val, "server", json_integer(client->server));
+				if (!ckp->node)
+					generator_add_send(ckp, val);
+				else {
+					/* generator_add_send serialises the json
+					 * before returning so the same json can then
+					 * go to the stratifier without a deep copy */
+					generator_add_send(ckp, json_incref(val));
+					json_object_del(val, "client_id");
+					json_object_del(val, "address");
+					json_object_del(val, "server");
+					stratifier_add_msg(ckp, client_id, client->server, client->address_name, val);
+				}
+			}
 		}
-		json_object_set_new_nocheck(val, "server", json_integer(client->server));
-
-		/* Do not send messages of clients we've already dropped. We
-		 * do this unlocked as the occasional false negative can be
-		 * filtered by the stratifier. */
-		if (likely(!client->invalid)) {
-			if (!ckp->passthrough)
-				stratifier_add_recv(ckp, val);
-			if (ckp->node)
-				stratifier_add_recv(ckp, json_deep_copy(val));
-			if (ckp->passthrough)
-				generator_add_send(ckp, val);
-		} else
-			json_decref(val);
+		line = eol + 1;
 	}
-	client->bufofs -= buflen;
-	if (client->bufofs)
-		memmove(client->buf, client->buf + buflen, client->bufofs);
-	client->buf[client->bufofs] = '\0';
+	return line - buf;
+}
 
-	if (client->bufofs)
-		goto reparse;
-	goto retry;
+/* Process the messages in the client's buffer window, giving the buffer back
+ * to the pool once no partial message remains. Returns false if the client
+ * should be dropped. */
+static bool parse_client_buf(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	int parsed;
+
+	parsed = parse_client_lines(ckp, cdata, client, client->buf + client->bufstart,
+				    client->bufofs - client->bufstart);
+	if (unlikely(parsed < 0))
+		return false;
+	client->bufstart += parsed;
+	if (client->bufstart == client->bufofs)
+		put_recvbuf(cdata, client);
+	return true;
+}
+
+/* Process len bytes received for a client into a transient buffer, parsing
+ * them in place and only copying into a client buffer what is left of a
+ * partial message. Returns false if the client should be dropped. */
+static bool recv_client_data(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			     const char *data, const int len)
+{
+	int parsed = 0;
+
+	if (!client->buf) {
+		parsed = parse_client_lines(ckp, cdata, client, data, len);
+		if (unlikely(parsed < 0))
+			return false;
+		if (parsed == len)
+			return true;
+	}
+	if (unlikely(!client_buf_space(cdata, client, len - parsed)))
+		return false;
+	memcpy(client->buf + client->bufofs, data + parsed, len - parsed);
+	client->bufofs += len - parsed;
+	if (parsed)
+		return client_buf_space(cdata, client, 0);
+	return parse_client_buf(ckp, cdata, client);
+}
+
+/* Per thread buffer for reading from clients with no partial message */
+static __thread char recv_scratch[PAGESIZE];
+
+/* Client is holding a reference count from being on the epoll list. Reads
+ * until the socket is drained. Clients with a partial message buffered read
+ * straight into their buffer, others into a per thread buffer so a client
+ * buffer is only needed if part of a message is left over. Returns true if
+ * we will still be receiving messages from this client. */
+static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	bool buffered;
+	char *buf;
+	int ret;
+
+	while (42) {
+		buffered = client->buf;
+		if (buffered) {
+			if (unlikely(!client_buf_space(cdata, client, MAX_MSGSIZE)))
+				return false;
+			buf = client->buf + client->bufofs;
+			ret = client->bufsize - client->bufofs;
+		} else {
+			buf = recv_scratch;
+			ret = PAGESIZE;
+		}
+		/* This read call is non-blocking since the socket is set to O_NOBLOCK */
+		ret = read(client->fd, buf, ret);
+		if (ret < 1) {
+			if (likely(errno == EAGAIN || errno == EWOULDBLOCK || !ret))
+				return true;
+			LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with bufofs %lu ret %d errno %d %s",
+				client->id, client->fd, client->bufofs, ret, errno, ret && errno ? strerror(errno) : "");
+			return false;
+		}
+		if (buffered) {
+			client->bufofs += ret;
+			if (unlikely(!parse_client_buf(ckp, cdata, client)))
+				return false;
+		} else if (unlikely(!recv_client_data(ckp, cdata, client, buf, ret)))
+			return false;
+	}
 }
 
 static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
 {
+	cshard_t *shard = shard_by_id(cdata, id);
 	client_instance_t *client;
 
-	ck_wlock(&cdata->lock);
-	HASH_FIND_I64(cdata->clients, &id, client);
-	if (client) {
-		if (!client->invalid)
-			__inc_instance_ref(client);
-		else
-			client = NULL;
+	if (unlikely(!shard))
+		return NULL;
+
+	ckepoch_enter();
+	client = ctable_find(cdata, shard, id);
+	if (client && !ref_valid_client(client, id))
+		client = NULL;
+	ckepoch_exit();
+
+	return client;
+}
+
+static void redirect_client(ckpool_t *ckp, client_instance_t *client);
+
+static bool redirect_matches(cdata_t *cdata, client_instance_t *client)
+{
+	redirect_t *redirect;
+
+	ck_rlock(&cdata->lock);
+	HASH_FIND_STR(cdata->redirects, client->address_name, redirect);
+	ck_runlock(&cdata->lock);
+
+	return redirect;
+}
+
+static void flush_client_sends(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client);
+
+/* Service all pending epoll events on a client. Clients are registered edge
+ * triggered so each event is only reported once and we must drain the socket
+ * of all data. The needs_read count ensures only one thread services a client
+ * at a time; events arriving while we're servicing it are picked up by
+ * looping here instead of scheduling the client again. Drops the reference
+ * taken when the client was scheduled. */
+static void service_client(ckpool_t *ckp, client_instance_t *client)
+{
+	cdata_t *cdata = ckp->cdata;
+	int reads;
+
+	do {
+		uint32_t events;
+
+		reads = __atomic_load_n(&client->needs_read, __ATOMIC_ACQUIRE);
+		events = __atomic_exchange_n(&client->pending_events, 0, __ATOMIC_ACQ_REL);
+
+		/* We can have both messages and read hang ups so process the
+		 * message first. */
+		if (likely(events & EPOLLIN)) {
+			if (unlikely(!parse_client_msg(ckp, cdata, client))) {
+				invalidate_client(ckp, cdata, client);
+				break;
+			}
+		}
+		/* Resume writing out queued sends now the socket has room */
+		if (events & EPOLLOUT)
+			flush_client_sends(ckp, cdata, client);
+		if (unlikely(events & EPOLLERR)) {
+			socklen_t errlen = sizeof(int);
+			int error = 0;
+
+			/* See what type of error this is and raise the log
+			 * level of the message if it's unexpected. */
+			getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
+			if (error != 104) {
+				LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+					  client->id, client->fd, error, strerror(error));
+			} else {
+				LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+					client->id, client->fd, error, strerror(error));
+			}
+			invalidate_client(ckp, cdata, client);
+			break;
+		} else if (unlikely(events & EPOLLHUP)) {
+			/* Client connection reset by peer */
+			LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
+			invalidate_client(ckp, cdata, client);
+			break;
+		} else if (unlikely(events & EPOLLRDHUP)) {
+			/* Client disconnected by peer */
+			LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
+			invalidate_client(ckp, cdata, client);
+			break;
+		}
+	} while (__atomic_sub_fetch(&client->needs_read, reads, __ATOMIC_ACQ_REL));
+
+	dec_instance_ref(client);
+}
+
+/* Service a batch of clients handed over by a receiver */
+static void client_event_processor(ckpool_t *ckp, cbatch_t *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->count; i++)
+		service_client(ckp, batch->clients[i]);
+	free(batch);
+}
+
+/* Look up the clients for a whole batch of epoll events in one epoch section,
+ * recording the events against each client and returning in clients those
+ * that were not already scheduled for servicing, with a reference held on
+ * them. Events on the listening sockets are skipped. */
+static int schedule_clients(cshard_t *shard, const struct epoll_event *events, const int nevents,
+			    client_instance_t **clients)
+{
+	cdata_t *cdata = shard->cdata;
+	const int64_t serverfds = cdata->ckp->serverurls;
+	int i, scheduled = 0;
+
+	ckepoch_enter();
+	for (i = 0; i < nevents; i++) {
+		const int64_t id = events[i].data.u64;
+		client_instance_t *client;
+
+		if (id < serverfds)
+			continue;
+		client = ctable_find(cdata, shard, id);
+		if (unlikely(!client)) {
+			LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
+			continue;
+		}
+		if (unlikely(!ref_valid_client(client, id)))
+			continue;
+		__atomic_or_fetch(&client->pending_events, events[i].events, __ATOMIC_RELEASE);
+		if (__atomic_fetch_add(&client->needs_read, 1, __ATOMIC_ACQ_REL)) {
+			/* Already being serviced */
+			dec_instance_ref(client);
+			continue;
+		}
+		clients[scheduled++] = client;
 	}
-	ck_wunlock(&cdata->lock);
+	ckepoch_exit();
+
+	return scheduled;
+}
+
+/* Waits on fds ready to read on from the listening sockets and clients owned
+ * by this receiver shard and handles the incoming messages, draining up to
+ * RECEIVER_EVENTS per wakeup. With a single receiver, each batch of clients
+ * is queued for the pool of cevent processing threads, otherwise each shard
+ * services its own clients inline. */
+static void *receiver(void *arg)
+{
+	cshard_t *shard = (cshard_t *)arg;
+	struct epoll_event *events = ckzalloc(sizeof(struct epoll_event) * RECEIVER_EVENTS);
+	client_instance_t **clients = ckalloc(sizeof(client_instance_t *) * RECEIVER_EVENTS);
+	cdata_t *cdata = shard->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	int ret, epfd;
+	uint64_t serverfds, i;
+
+	if (cdata->receivers > 1) {
+		char buf[16];
+
+		snprintf(buf, 15, "creceiver%d", shard->id);
+		rename_proc(buf);
+	} else
+		rename_proc("creceiver");
+
+	epfd = shard->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		LOGEMERG("FATAL: Failed to create epoll in receiver");
+		goto out;
+	}
+	serverfds = ckp->serverurls;
+	/* Add all the serverfds to the epoll */
+	for (i = 0; i < serverfds; i++) {
+		struct epoll_event event;
+
+		/* The small values will be less than the first client ids */
+		event.data.u64 = i;
+		event.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+		/* Shards that failed to bind their own socket share the
+		 * primary one and only want one of them woken per incoming
+		 * connection. The kernel rejects EPOLLEXCLUSIVE combined with
+		 * EPOLLRDHUP, which listening sockets don't need anyway. */
+		if (shard->id && shard->serverfd[i] == cdata->serverfd[i])
+			event.events |= EPOLLEXCLUSIVE;
+#endif
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, shard->serverfd[i], &event);
+		if (ret < 0) {
+			LOGEMERG("FATAL: Failed to add epfd %d to epoll_ctl", epfd);
+			goto out;
+		}
+	}
+
+	/* Wait for the stratifier to be ready for us */
+	while (!ckp->stratifier_ready)
+		cksleep_ms(10);
+
+	while (42) {
+		int nevents, scheduled, j;
+		cbatch_t *batch;
+
+		while (unlikely(!cdata->accept))
+			cksleep_ms(10);
+		nevents = epoll_wait(epfd, events, RECEIVER_EVENTS, 1000);
+		if (unlikely(nevents < 1)) {
+			if (unlikely(nevents == -1)) {
+				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
+				break;
+			}
+			/* Nothing to service, still very unlikely */
+			continue;
+		}
+		for (j = 0; j < nevents; j++) {
+			const uint64_t edu64 = events[j].data.u64;
+
+			if (edu64 >= serverfds)
+				continue;
+			ret = accept_client(shard, edu64);
+			if (unlikely(ret < 0)) {
+				LOGEMERG("FATAL: Failed to accept_client in receiver");
+				goto out;
+			}
+		}
+		scheduled = schedule_clients(shard, events, nevents, clients);
+		if (!scheduled)
+			continue;
+		if (cdata->receivers > 1) {
+			for (j = 0; j < scheduled; j++)
+				service_client(ckp, clients[j]);
+			continue;
+		}
+		/* Whichever cevent thread is free takes the whole batch */
+		batch = ckalloc(sizeof(cbatch_t) + sizeof(client_instance_t *) * scheduled);
+		batch->count = scheduled;
+		memcpy(batch->clients, clients, sizeof(client_instance_t *) * scheduled);
+		ckmsgq_add(cdata->cevents, batch);
+	}
+out:
+	/* We shouldn't get here unless there's an error */
+	return NULL;
+}
+
+/* The io_uring completion user_data holds the operation in the top bits and
+ * the server or client id below it */
+#define URING_ACCEPT	1ULL
+#define URING_RECV	2ULL
+#define URING_POLLOUT	3ULL
+#define URING_OP_SHIFT	56
+#define URING_VAL_MASK	((1ULL << URING_OP_SHIFT) - 1)
+
+#define URING_ENTRIES	4096
+/* Provided receive buffers per shard, must be a power of 2 */
+#define URING_BUFS	1024
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* Enter with ring_lock held */
+static void __uring_accept_server(cshard_t *shard, const int server)
+{
+	struct io_uring_sqe *sqe = ckring_get_sqe(shard->ring);
+
+	if (unlikely(!sqe)) {
+		LOGERR("Failed to get io_uring sqe to accept on server %d", server);
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = shard->serverfd[server];
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = URING_ACCEPT << URING_OP_SHIFT | server;
+}
+
+/* Arm a multishot receive into the shard's provided buffers for a client.
+ * Only called from the shard's receiver thread, which submits it. */
+static bool uring_recv_client(cshard_t *shard, client_instance_t *client)
+{
+	struct io_uring_sqe *sqe;
+
+	mutex_lock(&shard->ring_lock);
+	sqe = ckring_get_sqe(shard->ring);
+	if (likely(sqe)) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = client->fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = shard->bufring->bgid;
+		sqe->user_data = URING_RECV << URING_OP_SHIFT | client->id;
+	}
+	mutex_unlock(&shard->ring_lock);
 
-	return client;
+	return sqe;
 }
 
-static void redirect_client(ckpool_t *ckp, client_instance_t *client);
-
-static bool redirect_matches(cdata_t *cdata, client_instance_t *client)
+/* Ask to be told when a client's socket is writable again. Called from
+ * whichever thread found the socket full so it is submitted immediately. */
+static void uring_pollout_client(client_instance_t *client)
 {
-	redirect_t *redirect;
+	cshard_t *shard = client->shard;
+	struct io_uring_sqe *sqe;
+
+	mutex_lock(&shard->ring_lock);
+	sqe = ckring_get_sqe(shard->ring);
+	if (likely(sqe)) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = client->fd;
+		sqe->poll32_events = POLLOUT;
+		sqe->user_data = URING_POLLOUT << URING_OP_SHIFT | client->id;
+		ckring_submit(shard->ring);
+	} else
+		LOGERR("Failed to get io_uring sqe to poll client id %"PRId64, client->id);
+	mutex_unlock(&shard->ring_lock);
+}
 
-	ck_rlock(&cdata->lock);
-	HASH_FIND_STR(cdata->redirects, client->address_name, redirect);
-	ck_runlock(&cdata->lock);
+/* A connection has been accepted by a multishot accept */
+static void uring_accept(cshard_t *shard, const int server, int fd)
+{
+	cdata_t *cdata = shard->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	client_instance_t *client;
+	socklen_t address_len;
+	int no_clients;
 
-	return redirect;
+	if (unlikely(fd < 0)) {
+		if (fd != -EAGAIN && fd != -ECONNABORTED)
+			LOGWARNING("io_uring accept on server %d failed with errno %d: %s",
+				   server, -fd, strerror(-fd));
+		return;
+	}
+	/* The connection has already been accepted so close it if we're
+	 * full rather than leaving it in the backlog */
+	no_clients = connected_clients(cdata);
+	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
+		LOGWARNING("Server full with %d clients", no_clients);
+		Close(fd);
+		return;
+	}
+	client = recruit_client(shard);
+	client->server = server;
+	client->address = (struct sockaddr *)&client->address_storage;
+	address_len = sizeof(client->address_storage);
+	if (unlikely(getpeername(fd, client->address, &address_len))) {
+		LOGINFO("Failed to getpeername on accepted socket %d", fd);
+		Close(fd);
+		recycle_client(client);
+		return;
+	}
+	add_client(shard, client, fd, no_clients);
 }
 
-static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
+/* Data, end of file or an error has arrived for a client's multishot
+ * receive. The data is processed out of the provided buffer which is then
+ * handed straight back to the kernel. */
+static void uring_recv(cshard_t *shard, const int64_t id, const int res, const uint32_t flags)
 {
-	const uint32_t events = event->events;
-	const uint64_t id = event->data.u64;
-	cdata_t *cdata = ckp->cdata;
+	cdata_t *cdata = shard->cdata;
+	ckpool_t *ckp = cdata->ckp;
 	client_instance_t *client;
+	unsigned short bid = 0;
+	bool valid = true;
 
+	if (flags & IORING_CQE_F_BUFFER)
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
 	client = ref_client_by_id(cdata, id);
 	if (unlikely(!client)) {
-		LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
-		goto outnoclient;
-	}
-	/* We can have both messages and read hang ups so process the
-	 * message first. */
-	if (likely(events & EPOLLIN)) {
-		/* Rearm the client for epoll events if we have successfully
-		 * parsed a message from it */
-		if (unlikely(!parse_client_msg(ckp, cdata, client))) {
-			invalidate_client(ckp, cdata, client);
-			goto out;
-		}
+		if (flags & IORING_CQE_F_BUFFER)
+			ckbufring_recycle(shard->bufring, bid);
+		return;
 	}
-	if (unlikely(events & EPOLLERR)) {
-		socklen_t errlen = sizeof(int);
-		int error = 0;
-
-		/* See what type of error this is and raise the log
-			* level of the message if it's unexpected. */
-		getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
-		if (error != 104) {
-			LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-					client->id, client->fd, error, strerror(error));
-		} else {
-			LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-				client->id, client->fd, error, strerror(error));
-		}
-		invalidate_client(cdata->pi->ckp, cdata, client);
-	} else if (unlikely(events & EPOLLHUP)) {
-		/* Client connection reset by peer */
-		LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
-		invalidate_client(cdata->pi->ckp, cdata, client);
-	} else if (unlikely(events & EPOLLRDHUP)) {
+	if (likely(res > 0)) {
+		/* Parsed in place, copying out only any partial message */
+		valid = recv_client_data(ckp, cdata, client, ckbufring_buf(shard->bufring, bid), res);
+		ckbufring_recycle(shard->bufring, bid);
+	} else if (!res) {
 		/* Client disconnected by peer */
-		LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
-		invalidate_client(cdata->pi->ckp, cdata, client);
+		LOGINFO("Client id %"PRId64" fd %d disconnected", client->id, client->fd);
+		valid = false;
+	} else if (res != -ENOBUFS) {
+		LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with errno %d %s",
+			client->id, client->fd, -res, strerror(-res));
+		valid = false;
 	}
-out:
-	if (likely(!client->invalid)) {
-		/* Rearm the fd in the epoll list if it's still active */
-		event->data.u64 = id;
-		event->events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-		epoll_ctl(cdata->epfd, EPOLL_CTL_MOD, client->fd, event);
+	if (unlikely(!valid))
+		invalidate_client(ckp, cdata, client);
+	else if (!(flags & IORING_CQE_F_MORE) && !client->invalid) {
+		/* The multishot receive has ended, usually from running out
+		 * of provided buffers, so rearm it */
+		if (unlikely(!uring_recv_client(shard, client)))
+			invalidate_client(ckp, cdata, client);
 	}
-	dec_instance_ref(cdata, client);
-outnoclient:
-	free(event);
+	dec_instance_ref(client);
 }
 
-/* Waits on fds ready to read on from the list stored in conn_instance and
- * handles the incoming messages */
-static void *receiver(void *arg)
+/* A client's socket is writable again */
+static void uring_pollout(cshard_t *shard, const int64_t id)
 {
-	cdata_t *cdata = (cdata_t *)arg;
-	struct epoll_event *event = ckzalloc(sizeof(struct epoll_event));
-	ckpool_t *ckp = cdata->ckp;
-	uint64_t serverfds, i;
-	int ret, epfd;
+	cdata_t *cdata = shard->cdata;
+	client_instance_t *client;
+
+	client = ref_client_by_id(cdata, id);
+	if (unlikely(!client))
+		return;
+	mutex_lock(&client->send_lock);
+	client->epollout = false;
+	mutex_unlock(&client->send_lock);
+	flush_client_sends(cdata->ckp, cdata, client);
+	dec_instance_ref(client);
+}
 
-	rename_proc("creceiver");
+/* The io_uring equivalent of receiver(). Accepts arrive via multishot accepts
+ * on the listening sockets and client data via multishot receives into the
+ * shard's provided buffers, with all completions processed inline. */
+static void *uring_receiver(void *arg)
+{
+	cshard_t *shard = (cshard_t *)arg;
+	cdata_t *cdata = shard->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	ckring_t *ring = shard->ring;
+	char buf[16];
+	int i;
 
-	epfd = cdata->epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0) {
-		LOGEMERG("FATAL: Failed to create epoll in receiver");
-		goto out;
-	}
-	serverfds = ckp->serverurls;
-	/* Add all the serverfds to the epoll */
-	for (i = 0; i < serverfds; i++) {
-		/* The small values will be less than the first client ids */
-		event->data.u64 = i;
-		event->events = EPOLLIN | EPOLLRDHUP;
-		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], event);
-		if (ret < 0) {
-			LOGEMERG("FATAL: Failed to add epfd %d to epoll_ctl", epfd);
-			goto out;
-		}
-	}
+	snprintf(buf, 15, "cureceiver%d", shard->id);
+	rename_proc(buf);
 
 	/* Wait for the stratifier to be ready for us */
 	while (!ckp->stratifier_ready)
 		cksleep_ms(10);
 
+	mutex_lock(&shard->ring_lock);
+	for (i = 0; i < ckp->serverurls; i++)
+		__uring_accept_server(shard, i);
+	mutex_unlock(&shard->ring_lock);
+
 	while (42) {
-		uint64_t edu64;
+		struct io_uring_cqe *cqe;
+		int ret;
 
 		while (unlikely(!cdata->accept))
 			cksleep_ms(10);
-		ret = epoll_wait(epfd, event, 1, 1000);
-		if (unlikely(ret < 1)) {
-			if (unlikely(ret == -1)) {
-				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
-				break;
-			}
-			/* Nothing to service, still very unlikely */
-			continue;
+
+		mutex_lock(&shard->ring_lock);
+		ret = ckring_submit(ring);
+		mutex_unlock(&shard->ring_lock);
+		if (likely(ret >= 0))
+			ret = ckring_wait(ring, 1000);
+		if (unlikely(ret < 0)) {
+			LOGEMERG("FATAL: Failed to submit or wait on io_uring in receiver");
+			break;
 		}
-		edu64 = event->data.u64;
-		if (edu64 < serverfds) {
-			ret = accept_client(cdata, epfd, edu64);
-			if (unlikely(ret < 0)) {
-				LOGEMERG("FATAL: Failed to accept_client in receiver");
-				break;
+
+		while ((cqe = ckring_peek_cqe(ring)) != NULL) {
+			const uint64_t op = cqe->user_data >> URING_OP_SHIFT;
+			const int64_t val = cqe->user_data & URING_VAL_MASK;
+			const uint32_t flags = cqe->flags;
+			const int res = cqe->res;
+
+			ckring_cqe_seen(ring);
+			switch (op) {
+				case URING_ACCEPT:
+					uring_accept(shard, val, res);
+					if (!(flags & IORING_CQE_F_MORE)) {
+						mutex_lock(&shard->ring_lock);
+						__uring_accept_server(shard, val);
+						mutex_unlock(&shard->ring_lock);
+					}
+					break;
+				case URING_RECV:
+					uring_recv(shard, val, res, flags);
+					break;
+				case URING_POLLOUT:
+					uring_pollout(shard, val);
+					break;
+				default:
+					LOGWARNING("Unknown io_uring completion type %"PRIu64, op);
+					break;
 			}
-			continue;
 		}
-		/* Event structure is handed off to client_event_processor
-		 * here to be freed so we need to allocate a new one */
-		ckmsgq_add(cdata->cevents, event);
-		event = ckzalloc(sizeof(struct epoll_event));
 	}
-out:
 	/* We shouldn't get here unless there's an error */
 	return NULL;
 }
 
-/* Send a sender_send message and return true if we've finished sending it or
- * are unable to send any more. */
-static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send)
+/* Set up the io_uring and provided receive buffers for a shard, returning
+ * false if the shard should fall back to epoll */
+static bool uring_init_shard(cshard_t *shard)
+{
+	shard->ring = ckring_init(URING_ENTRIES);
+	if (unlikely(!shard->ring))
+		return false;
+	shard->bufring = ckring_setup_bufring(shard->ring, 0, URING_BUFS, MAX_MSGSIZE);
+	if (unlikely(!shard->bufring)) {
+		/* Leave the ring unused, it is only created once at startup */
+		shard->ring = NULL;
+		return false;
+	}
+	mutex_init(&shard->ring_lock);
+	return true;
+}
+#else /* HAVE_LINUX_IO_URING_H */
+static bool uring_recv_client(cshard_t __maybe_unused *shard, client_instance_t __maybe_unused *client)
 {
-	client_instance_t *client = sender_send->client;
-	time_t now_t;
+	return false;
+}
 
-	if (unlikely(client->invalid))
-		goto out_true;
+static void uring_pollout_client(client_instance_t __maybe_unused *client)
+{
+}
 
-	/* Make sure we only send one message at a time to each client */
-	if (unlikely(client->sending && client->sending != sender_send))
-		return false;
+static void *uring_receiver(void __maybe_unused *arg)
+{
+	return NULL;
+}
 
-	client->sending = sender_send;
-	now_t = time(NULL);
+static bool uring_init_shard(cshard_t __maybe_unused *shard)
+{
+	return false;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
 
-	/* Increase sendbufsize to match large messages sent to clients - this
-	 * usually only applies to clients as mining nodes. */
-	if (unlikely(!ckp->wmem_warn && sender_send->len > client->sendbufsize))
-		client->sendbufsize = set_sendbufsize(ckp, client->fd, sender_send->len);
+/* Set the epoll events this client is registered for, adding EPOLLOUT only
+ * while it has unsent data. Enter with client send_lock held. */
+static void __client_epollout(client_instance_t *client, const bool epollout)
+{
+	struct epoll_event event;
+
+	if (client->epollout == epollout)
+		return;
+	client->epollout = epollout;
+	if (client->shard->ring) {
+		/* The poll is one shot so there is nothing to remove */
+		if (epollout)
+			uring_pollout_client(client);
+		return;
+	}
+	event.data.u64 = client->id;
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if (epollout)
+		event.events |= EPOLLOUT;
+	if (unlikely(epoll_ctl(client->shard->epfd, EPOLL_CTL_MOD, client->fd, &event) < 0))
+		LOGDEBUG("Failed to epoll_ctl mod client id %"PRId64" fd %d", client->id, client->fd);
+}
+
+/* Enter with client send_lock held */
+static void __add_blocked(cdata_t *cdata, client_instance_t *client)
+{
+	client->sends_delayed += client->sends_queued;
+	__atomic_add_fetch(&cdata->sends_delayed, client->sends_queued, __ATOMIC_RELAXED);
+	mutex_lock(&cdata->sender_lock);
+	client->blocked_time = time(NULL);
+	DL_APPEND2(cdata->blocked_clients, client, blocked_prev, blocked_next);
+	mutex_unlock(&cdata->sender_lock);
+}
+
+/* Enter with client send_lock held */
+static void __del_blocked(cdata_t *cdata, client_instance_t *client)
+{
+	mutex_lock(&cdata->sender_lock);
+	client->blocked_time = 0;
+	DL_DELETE2(cdata->blocked_clients, client, blocked_prev, blocked_next);
+	mutex_unlock(&cdata->sender_lock);
+}
+
+/* Serialise a json message once for broadcasting to many clients, taking
+ * ownership of the client_ids array and consuming the reference to val. */
+broadcast_t *connector_new_broadcast(json_t *val, int64_t *client_ids, const int clients)
+{
+	broadcast_t *bcast = ckzalloc(sizeof(broadcast_t));
+
+	bcast->buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
+	json_decref(val);
+	bcast->len = strlen(bcast->buf);
+	bcast->ref = 1;
+	bcast->client_ids = client_ids;
+	bcast->clients = clients;
+	return bcast;
+}
+
+static void put_broadcast(broadcast_t *bcast)
+{
+	if (__atomic_sub_fetch(&bcast->ref, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(bcast->client_ids);
+	free(bcast->buf);
+	free(bcast);
+}
 
-	while (sender_send->len) {
-		int ret = write(client->fd, sender_send->buf + sender_send->ofs, sender_send->len);
+static void clear_sender_send(sender_send_t *sender_send)
+{
+	dec_instance_ref(sender_send->client);
+	if (sender_send->bcast)
+		put_broadcast(sender_send->bcast);
+	else
+		free(sender_send->buf);
+	ckslab_free(send_slab, sender_send);
+}
+
+static void clear_sender_sends(sender_send_t *sends)
+{
+	sender_send_t *sender_send, *tmp;
+
+	DL_FOREACH_SAFE(sends, sender_send, tmp) {
+		DL_DELETE(sends, sender_send);
+		clear_sender_send(sender_send);
+	}
+}
+
+/* Take the whole send queue off a client. Enter with client send_lock held */
+static sender_send_t *__detach_client_sends(cdata_t *cdata, client_instance_t *client)
+{
+	sender_send_t *sends = client->sends;
+
+	client->sends = NULL;
+	client->sends_queued = 0;
+	client->sends_size = 0;
+	if (client->blocked_time)
+		__del_blocked(cdata, client);
+	return sends;
+}
+
+/* Discard everything queued to an invalidated client, dropping the references
+ * the sends hold on it. */
+static void clear_client_sends(cdata_t *cdata, client_instance_t *client)
+{
+	sender_send_t *sends;
+
+	mutex_lock(&client->send_lock);
+	sends = __detach_client_sends(cdata, client);
+	mutex_unlock(&client->send_lock);
+
+	clear_sender_sends(sends);
+}
 
+/* Write out as much of a client's send queue as the socket will take,
+ * gathering up to IOV_MAX queued buffers into each writev() call. If it would
+ * block, register the client for EPOLLOUT so the receiver resumes writing
+ * once the socket is writable, deregistering it once the queue is empty.
+ * Completed sends are freed outside of the send_lock. */
+static void flush_client_sends(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	sender_send_t *sender_send, *done = NULL;
+	struct iovec iov[IOV_MAX];
+	bool invalidate = false;
+
+	mutex_lock(&client->send_lock);
+	while (client->sends) {
+		ssize_t ret;
+		int iovcnt = 0;
+
+		if (unlikely(client->invalid)) {
+			DL_CONCAT(done, __detach_client_sends(cdata, client));
+			break;
+		}
+		DL_FOREACH(client->sends, sender_send) {
+			iov[iovcnt].iov_base = sender_send->buf + sender_send->ofs;
+			iov[iovcnt].iov_len = sender_send->len;
+			if (++iovcnt >= IOV_MAX)
+				break;
+		}
+		ret = writev(client->fd, iov, iovcnt);
 		if (ret < 1) {
-			/* Invalidate clients that block for more than 60 seconds */
-			if (unlikely(client->blocked_time && now_t - client->blocked_time >= 60)) {
-				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
-					  client->id, client->fd);
-				invalidate_client(ckp, cdata, client);
-				goto out_true;
-			}
 			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret) {
 				if (!client->blocked_time)
-					client->blocked_time = now_t;
-				return false;
+					__add_blocked(cdata, client);
+				__client_epollout(client, true);
+				break;
 			}
 			LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
 				client->id, client->fd, errno, strerror(errno));
-			invalidate_client(ckp, cdata, client);
-			goto out_true;
+			invalidate = true;
+			break;
+		}
+		client->sends_size -= ret;
+		if (client->blocked_time)
+			__del_blocked(cdata, client);
+		/* Retire every send fully covered by what was written and
+		 * advance the offset into the one partially written, if any */
+		while (ret > 0) {
+			sender_send = client->sends;
+			if (ret < sender_send->len) {
+				sender_send->ofs += ret;
+				sender_send->len -= ret;
+				break;
+			}
+			ret -= sender_send->len;
+			sender_send->ofs += sender_send->len;
+			sender_send->len = 0;
+			DL_DELETE(client->sends, sender_send);
+			DL_APPEND(done, sender_send);
+			client->sends_queued--;
 		}
-		sender_send->ofs += ret;
-		sender_send->len -= ret;
-		client->blocked_time = 0;
 	}
-out_true:
-	client->sending = NULL;
-	return true;
+	if (!client->sends)
+		__client_epollout(client, false);
+	mutex_unlock(&client->send_lock);
+
+	clear_sender_sends(done);
+	if (unlikely(invalidate))
+		invalidate_client(ckp, cdata, client);
 }
 
-static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
+/* Append a heap allocated buffer, or a reference to a broadcast's shared
+ * buffer, to a client's send queue, the caller having already taken the
+ * reference the send holds on the client. If nothing was queued ahead of it
+ * we try to write it out immediately, otherwise it goes out when the socket
+ * next becomes writable. */
+static void queue_client_send(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			      char *buf, const int len, broadcast_t *bcast)
 {
-	dec_instance_ref(cdata, sender_send->client);
-	free(sender_send->buf);
-	free(sender_send);
+	sender_send_t *sender_send = ckslab_alloc(send_slab);
+	bool flush;
+
+	sender_send->client = client;
+	sender_send->buf = buf;
+	sender_send->len = len;
+	sender_send->bcast = bcast;
+	__atomic_add_fetch(&cdata->sends_generated, 1, __ATOMIC_RELAXED);
+
+	mutex_lock(&client->send_lock);
+	/* Don't queue sends to clients already invalidated as nothing will
+	 * clear them. */
+	if (unlikely(client->invalid)) {
+		mutex_unlock(&client->send_lock);
+		clear_sender_send(sender_send);
+		return;
+	}
+	/* Increase sendbufsize to match large messages sent to clients - this
+	 * usually only applies to clients as mining nodes. */
+	if (unlikely(!ckp->wmem_warn && len > client->sendbufsize))
+		client->sendbufsize = set_sendbufsize(ckp, client->fd, len);
+	flush = !client->sends;
+	DL_APPEND(client->sends, sender_send);
+	client->sends_queued++;
+	client->sends_size += len;
+	mutex_unlock(&client->send_lock);
+
+	if (flush)
+		flush_client_sends(ckp, cdata, client);
 }
 
-/* Use a thread to send queued messages, appending them to the sends list and
- * iterating over all of them, attempting to send them all non-blocking to
- * only send to those clients ready to receive data. */
+/* Use a thread to watch for clients that have been unable to accept any data
+ * for too long. Writes themselves are driven by the receivers servicing
+ * EPOLLOUT events so this only has to look at the list of blocked clients
+ * once a second. */
 static void *sender(void *arg)
 {
 	cdata_t *cdata = (cdata_t *)arg;
-	sender_send_t *sends = NULL;
 	ckpool_t *ckp = cdata->ckp;
+	int64_t *stale = NULL;
+	int stale_size = 0;
 
 	rename_proc("csender");
 
 	while (42) {
-		int64_t sends_queued = 0, sends_size = 0;
-		sender_send_t *sending, *tmp;
-
-		/* Check all sends to see if they can be written out */
-		DL_FOREACH_SAFE(sends, sending, tmp) {
-			if (send_sender_send(ckp, cdata, sending)) {
-				DL_DELETE(sends, sending);
-				clear_sender_send(sending, cdata);
-			} else {
-				sends_queued++;
-				sends_size += sizeof(sender_send_t) + sending->len + 1;
-			}
-		}
+		client_instance_t *client;
+		time_t now_t;
+		int i, nstale = 0;
 
+		sleep(1);
+		now_t = time(NULL);
+
+		/* Only collect the ids here and look them up again since the
+		 * clients may be dropped once we release the lock. */
 		mutex_lock(&cdata->sender_lock);
-		cdata->sends_delayed += sends_queued;
-		cdata->sends_queued = sends_queued;
-		cdata->sends_size = sends_size;
-		/* Poll every 10ms if there are no new sends. */
-		if (!cdata->sender_sends) {
-			const ts_t polltime = {0, 10000000};
-			ts_t timeout_ts;
-
-			ts_realtime(&timeout_ts);
-			timeraddspec(&timeout_ts, &polltime);
-			cond_timedwait(&cdata->sender_cond, &cdata->sender_lock, &timeout_ts);
-		}
-		if (cdata->sender_sends) {
-			DL_CONCAT(sends, cdata->sender_sends);
-			cdata->sender_sends = NULL;
+		DL_FOREACH2(cdata->blocked_clients, client, blocked_next) {
+			if (now_t - client->blocked_time < 60)
+				continue;
+			if (nstale >= stale_size) {
+				stale_size += 64;
+				stale = realloc(stale, sizeof(int64_t) * stale_size);
+			}
+			stale[nstale++] = client->id;
 		}
 		mutex_unlock(&cdata->sender_lock);
+
+		for (i = 0; i < nstale; i++) {
+			client = ref_client_by_id(cdata, stale[i]);
+			if (!client)
+				continue;
+			LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
+				  client->id, client->fd);
+			invalidate_client(ckp, cdata, client);
+			dec_instance_ref(client);
+		}
 	}
 	/* We shouldn't get here unless there's an error */
 	return NULL;
@@ -882,7 +2033,6 @@ static int add_redirect(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client
 
 static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 {
-	sender_send_t *sender_send;
 	cdata_t *cdata = ckp->cdata;
 	json_t *val;
 	char *buf;
@@ -897,17 +2047,8 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
 	json_decref(val);
 
-	sender_send = ckzalloc(sizeof(sender_send_t));
-	sender_send->client = client;
-	sender_send->buf = buf;
-	sender_send->len = strlen(buf);
-	inc_instance_ref(cdata, client);
-
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	inc_instance_ref(client);
+	queue_client_send(ckp, cdata, client, buf, strlen(buf), NULL);
 }
 
 /* Look for accepted shares in redirector mode to know we can redirect this
@@ -929,7 +2070,7 @@ static bool test_redirector_shares(cdata_t *cdata, client_instance_t *client, co
 		goto out;
 	}
 
-	ck_rlock(&cdata->lock);
+	ck_rlock(&client->shard->lock);
 	DL_FOREACH(client->shares, share) {
 		if (share->id == id) {
 			LOGDEBUG("Found matching share %"PRId64" in trs for client %"PRId64,
@@ -938,7 +2079,7 @@ static bool test_redirector_shares(cdata_t *cdata, client_instance_t *client, co
 			break;
 		}
 	}
-	ck_runlock(&cdata->lock);
+	ck_runlock(&client->shard->lock);
 
 	if (found) {
 		bool result = false;
@@ -960,12 +2101,12 @@ static bool test_redirector_shares(cdata_t *cdata, client_instance_t *client, co
 		ret = true;
 
 		/* Clear the list now since we don't need it any more */
-		ck_wlock(&cdata->lock);
+		ck_wlock(&client->shard->lock);
 		DL_FOREACH_SAFE(client->shares, share, found) {
 			DL_DELETE(client->shares, share);
 			dealloc(share);
 		}
-		ck_wunlock(&cdata->lock);
+		ck_wunlock(&client->shard->lock);
 	}
 out:
 	json_decref(val);
@@ -976,7 +2117,6 @@ out:
  * free the ram. */
 static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf)
 {
-	sender_send_t *sender_send;
 	client_instance_t *client;
 	bool redirect = false;
 	int64_t pass_id;
@@ -1014,7 +2154,7 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 			client = ref_client_by_id(cdata, client_id);
 			if (client) {
 				invalidate_client(ckp, cdata, client);
-				dec_instance_ref(cdata, client);
+				dec_instance_ref(client);
 			} else
 				stratifier_drop_id(ckp, id);
 			free(buf);
@@ -1039,16 +2179,7 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 		}
 	}
 
-	sender_send = ckzalloc(sizeof(sender_send_t));
-	sender_send->client = client;
-	sender_send->buf = buf;
-	sender_send->len = len;
-
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_client_send(ckp, cdata, client, buf, len, NULL);
 
 	/* Redirect after sending response to shares and authorise */
 	if (unlikely(redirect))
@@ -1061,13 +2192,9 @@ static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, j
 	char *msg;
 
 	if (ckp->node && (client = ref_client_by_id(cdata, client_id))) {
-		json_t *val = json_deep_copy(json_msg);
-
-		json_object_set_new_nocheck(val, "client_id", json_integer(client_id));
-		json_object_set_new_nocheck(val, "address", json_string(client->address_name));
-		json_object_set_new_nocheck(val, "server", json_integer(client->server));
-		dec_instance_ref(cdata, client);
-		stratifier_add_recv(ckp, val);
+		stratifier_add_msg(ckp, client_id, client->server, client->address_name,
+				   json_deep_copy(json_msg));
+		dec_instance_ref(client);
 	}
 	if (ckp->passthrough && client_id)
 		json_object_del(json_msg, "node.method");
@@ -1083,15 +2210,22 @@ static bool client_exists(cdata_t *cdata, int64_t id)
 {
 	int64_t parent_id = subclient(id);
 	client_instance_t *client;
+	cshard_t *shard;
+	bool ret;
 
 	if (parent_id)
 		id = parent_id;
 
-	ck_rlock(&cdata->lock);
-	HASH_FIND_I64(cdata->clients, &id, client);
-	ck_runlock(&cdata->lock);
+	shard = shard_by_id(cdata, id);
+	if (unlikely(!shard))
+		return false;
+
+	ckepoch_enter();
+	client = ctable_find(cdata, shard, id);
+	ret = client && __atomic_load_n(&client->id, __ATOMIC_ACQUIRE) == id;
+	ckepoch_exit();
 
-	return !!client;
+	return ret;
 }
 
 static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
@@ -1294,15 +2428,47 @@ out:
 	return ret;
 }
 
-static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
+/* Queue a reference to a broadcast's shared buffer on every client it is
+ * addressed to, dropping the reference the broadcast was created with. */
+static void send_client_broadcast(ckpool_t *ckp, cdata_t *cdata, broadcast_t *bcast)
+{
+	int i;
+
+	for (i = 0; i < bcast->clients; i++) {
+		const int64_t id = bcast->client_ids[i];
+		client_instance_t *client;
+
+		/* Redirectors need to inspect what is sent to each client */
+		if (unlikely(ckp->redirector)) {
+			send_client(ckp, cdata, id, strdup(bcast->buf));
+			continue;
+		}
+		client = ref_client_by_id(cdata, id);
+		if (unlikely(!client)) {
+			LOGINFO("Connector failed to find client id %"PRId64" to send to", id);
+			stratifier_drop_id(ckp, id);
+			continue;
+		}
+		__atomic_add_fetch(&bcast->ref, 1, __ATOMIC_RELAXED);
+		queue_client_send(ckp, cdata, client, bcast->buf, bcast->len, bcast);
+	}
+	put_broadcast(bcast);
+}
+
+static void client_message_processor(ckpool_t *ckp, smsg_t *msg)
 {
+	json_t *json_msg = msg->json_msg;
+	int64_t client_id = msg->client_id;
 	cdata_t *cdata = ckp->cdata;
 	client_instance_t *client;
-	int64_t client_id;
 
-	/* Extract the client id from the json message and remove its entry */
-	client_id = json_integer_value(json_object_get(json_msg, "client_id"));
-	json_object_del(json_msg, "client_id");
+	if (msg->bcast) {
+		send_client_broadcast(ckp, cdata, msg->bcast);
+		ckslab_free(ckp->smsg_slab, msg);
+		return;
+	}
+	ckslab_free(ckp->smsg_slab, msg);
+
 	/* Put client_id back in for a passthrough subclient, passing its
 	 * upstream client_id instead of the passthrough's. */
 	if (subclient(client_id))
@@ -1317,16 +2483,25 @@ static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 			if (!safecmp(method, stratum_msgs[SM_AUTHRESULT]))
 				client->authorised = true;
 		}
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 	}
 	send_client_json(ckp, cdata, client_id, json_msg);
 }
 
-void connector_add_message(ckpool_t *ckp, json_t *val)
+/* The connector takes ownership of msg and its contents */
+void connector_add_message(ckpool_t *ckp, smsg_t *msg)
 {
 	cdata_t *cdata = ckp->cdata;
 
-	ckmsgq_add(cdata->cmpq, val);
+	ckmsgq_add(cdata->cmpq, msg);
+}
+
+/* Send json_msg to a client from the calling thread instead of via the
+ * message queue, taking ownership of json_msg. For share results processed
+ * to completion on a connector thread. */
+void connector_send_json(ckpool_t *ckp, const int64_t client_id, json_t *json_msg)
+{
+	send_client_json(ckp, ckp->cdata, client_id, json_msg);
 }
 
 /* Send the passthrough the terminate node.method */
@@ -1346,51 +2521,88 @@ static void drop_passthrough_client(ckpool_t *ckp, cdata_t *cdata, const int64_t
 char *connector_stats(void *data, const int runtime)
 {
 	json_t *val = json_object(), *subval;
+	int objects, generated, count, delayed, i;
+	int64_t memsize, delaysize;
 	client_instance_t *client;
-	int objects, generated;
 	cdata_t *cdata = data;
-	sender_send_t *send;
-	int64_t memsize;
 	char *buf;
 
 	/* If called in passthrough mode we log stats instead of the stratifier */
 	if (runtime)
 		json_set_int(val, "runtime", runtime);
 
-	ck_rlock(&cdata->lock);
-	objects = HASH_COUNT(cdata->clients);
-	memsize = SAFE_HASH_OVERHEAD(cdata->clients) + sizeof(client_instance_t) * objects;
-	generated = cdata->clients_generated;
-	ck_runlock(&cdata->lock);
+	objects = generated = 0;
+	memsize = 0;
+	for (i = 0; i < cdata->receivers; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		count = shard->nclients;
+		objects += count;
+		memsize += sizeof(client_instance_t) * count;
+		generated += shard->clients_generated;
+		ck_runlock(&shard->lock);
+	}
 
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "clients", subval);
 
-	ck_rlock(&cdata->lock);
-	DL_COUNT2(cdata->dead_clients, client, objects, dead_next);
-	generated = cdata->dead_generated;
-	ck_runlock(&cdata->lock);
+	objects = generated = 0;
+	for (i = 0; i < cdata->receivers; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		DL_COUNT2(shard->dead_clients, client, count, dead_next);
+		objects += count;
+		generated += shard->dead_generated;
+		ck_runlock(&shard->lock);
+	}
 
 	memsize = objects * sizeof(client_instance_t);
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "dead", subval);
 
-	objects = 0;
-	memsize = 0;
-
-	mutex_lock(&cdata->sender_lock);
-	DL_FOREACH(cdata->sender_sends, send) {
-		objects++;
-		memsize += sizeof(sender_send_t) + send->len + 1;
+	/* Sends are now queued per client so sum the queues of all clients,
+	 * counting separately those on clients that are blocked. */
+	objects = delayed = 0;
+	memsize = delaysize = 0;
+	for (i = 0; i < cdata->receivers; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		DL_FOREACH(shard->clients, client) {
+			mutex_lock(&client->send_lock);
+			objects += client->sends_queued;
+			memsize += sizeof(sender_send_t) * client->sends_queued + client->sends_size;
+			if (client->blocked_time) {
+				delayed += client->sends_queued;
+				delaysize += sizeof(sender_send_t) * client->sends_queued + client->sends_size;
+			}
+			mutex_unlock(&client->send_lock);
+		}
+		ck_runlock(&shard->lock);
 	}
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", cdata->sends_generated);
 	json_set_object(val, "sends", subval);
 
-	JSON_CPACK(subval, "{si,si,si}", "count", cdata->sends_queued, "memory", cdata->sends_size, "generated", cdata->sends_delayed);
-	mutex_unlock(&cdata->sender_lock);
-
+	JSON_CPACK(subval, "{si,si,si}", "count", delayed, "memory", delaysize, "generated", cdata->sends_delayed);
 	json_set_object(val, "delays", subval);
 
+	/* Receive buffers held by clients with partial messages and idle in
+	 * the pool */
+	mutex_lock(&cdata->recvbuf_lock);
+	objects = cdata->recvbufs_used;
+	memsize = (int64_t)(cdata->recvbufs_used + cdata->recvbufs_pooled) * PAGESIZE;
+	generated = cdata->recvbufs_generated;
+	mutex_unlock(&cdata->recvbuf_lock);
+	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
+	json_set_object(val, "buffers", subval);
+
+	ckslab_stats(send_slab, &subval);
+	json_set_object(val, "sendslab", subval);
+	ckslab_stats(cdata->ckp->smsg_slab, &subval);
+	json_set_object(val, "smsgs", subval);
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	if (runtime)
@@ -1449,8 +2661,19 @@ retry:
 	 * so look for them first. */
 	if (likely(buf[0] == '{')) {
 		json_t *val = json_loads(buf, JSON_DISABLE_EOF_CHECK, NULL);
+		smsg_t *msg;
 
-		ckmsgq_add(cdata->cmpq, val);
+		if (unlikely(!val)) {
+			LOGWARNING("Connector received invalid json message: %s", buf);
+			goto retry;
+		}
+		/* Extract the client id from the json message and remove its
+		 * entry */
+		msg = ckslab_alloc(ckp->smsg_slab);
+		msg->client_id = json_integer_value(json_object_get(val, "client_id"));
+		json_object_del(val, "client_id");
+		msg->json_msg = val;
+		ckmsgq_add(cdata->cmpq, msg);
 	} else if (cmdmatch(buf, "dropclient")) {
 		client_instance_t *client;
 
@@ -1470,7 +2693,7 @@ retry:
 			goto retry;
 		}
 		ret = invalidate_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 		if (ret >= 0)
 			LOGINFO("Connector dropped client id: %"PRId64, client_id);
 	} else if (cmdmatch(buf, "testclient")) {
@@ -1516,7 +2739,7 @@ retry:
 			goto retry;
 		}
 		passthrough_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 	} else if (cmdmatch(buf, "getxfd")) {
 		int fdno = -1;
 
@@ -1528,6 +2751,53 @@ retry:
 	goto retry;
 }
 
+/* Set up the receiver shards. Shard 0 uses the primary listening sockets and
+ * each other shard binds its own SO_REUSEPORT socket to the same address so the
+ * kernel distributes incoming connections across them, falling back to
+ * sharing the primary socket if that fails (such as with a handed over socket
+ * that was bound without SO_REUSEPORT). */
+static void init_shards(ckpool_t *ckp, cdata_t *cdata)
+{
+	int i, j;
+
+	cdata->receivers = ckp->receivers;
+	cdata->shards = ckzalloc(sizeof(cshard_t) * cdata->receivers);
+	for (i = 0; i < cdata->receivers; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+		shard->cdata = cdata;
+		shard->id = i;
+		cklock_init(&shard->lock);
+		if (ckp->iouring && !uring_init_shard(shard))
+			LOGWARNING("Receiver %d failed to set up io_uring, using epoll", i);
+		if (!i) {
+			shard->serverfd = cdata->serverfd;
+			continue;
+		}
+		shard->serverfd = ckalloc(sizeof(int) * ckp->serverurls);
+		for (j = 0; j < ckp->serverurls; j++) {
+			char url[INET6_ADDRSTRLEN], port[8];
+			int sockd = -1;
+
+			if (url_from_socket(cdata->serverfd[j], url, port))
+				sockd = bind_reuseport_socket(url, port);
+			if (sockd > 0 && listen(sockd, 8192) < 0)
+				Close(sockd);
+			if (sockd < 0) {
+				LOGWARNING("Receiver %d failed to bind own socket for server %d, sharing listening socket",
+					   i, j);
+				/* More than one receiver may be woken to accept */
+				sockd = cdata->serverfd[j];
+				noblock_socket(sockd);
+			}
+			shard->serverfd[j] = sockd;
+		}
+	}
+	LOGNOTICE("Connector using %d receiver threads", cdata->receivers);
+	if (ckp->runtocompletion)
+		LOGNOTICE("Connector processing shares to completion on receiver threads");
+}
+
 void *connector(void *arg)
 {
 	proc_instance_t *pi = (proc_instance_t *)arg;
@@ -1539,6 +2809,7 @@ void *connector(void *arg)
 
 	rename_proc(pi->processname);
 	LOGWARNING("%s connector starting", ckp->name);
+	send_slab = ckslab_create("sendslab", sizeof(sender_send_t));
 	ckp->cdata = cdata;
 	cdata->ckp = ckp;
 
@@ -1555,6 +2826,8 @@ void *connector(void *arg)
 			goto out;
 		}
 		setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (ckp->receivers > 1)
+			setsockopt(sockd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 		memset(&serv_addr, 0, sizeof(serv_addr));
 		serv_addr.sin_family = AF_INET;
 		serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -1613,7 +2886,10 @@ void *connector(void *arg)
 			do {
 				if (sockd > 0)
 					break;
-				sockd = bind_socket(newurl, newport);
+				if (ckp->receivers > 1)
+					sockd = bind_reuseport_socket(newurl, newport);
+				else
+					sockd = bind_socket(newurl, newport);
 				if (sockd > 0)
 					break;
 				LOGWARNING("Connector failed to bind to socket, retrying in 5s");
@@ -1644,15 +2920,25 @@ void *connector(void *arg)
 	cklock_init(&cdata->lock);
 	cdata->pi = pi;
 	cdata->nfds = 0;
-	/* Set the client id to the highest serverurl count to distinguish
-	 * them from the server fds in epoll. */
-	cdata->client_ids = ckp->serverurls;
+	if (ckp->iouring && !ckring_supported()) {
+		LOGWARNING("io_uring not supported by this kernel, using epoll");
+		ckp->iouring = false;
+	}
+	mutex_init(&cdata->recvbuf_lock);
+	init_shards(ckp, cdata);
 	mutex_init(&cdata->sender_lock);
-	cond_init(&cdata->sender_cond);
 	create_pthread(&cdata->pth_sender, sender, cdata);
-	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
-	cdata->cevents = create_ckmsgqs(ckp, "cevent", &client_event_processor, threads);
-	create_pthread(&cdata->pth_receiver, receiver, cdata);
+	/* A single receiver hands client events to a pool of processing
+	 * threads, whereas sharded receivers service their own clients. */
+	if (cdata->receivers == 1 && !cdata->shards[0].ring) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
+		cdata->cevents = create_ckmsgqs(ckp, "cevent", &client_event_processor, threads);
+	}
+	for (i = 0; i < cdata->receivers; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+		create_pthread(&shard->pth_receiver, shard->ring ? uring_receiver : receiver, shard);
+	}
 	cdata->start_time = time(NULL);
 
 	ckp->connector_ready = true;
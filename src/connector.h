@@ -10,9 +10,31 @@
 #ifndef CONNECTOR_H
 #define CONNECTOR_H
 
+/* A message serialised once and shared, immutable, by the send queues of all
+ * the clients it is broadcast to. Freed when the last reference is dropped. */
+typedef struct broadcast {
+	char *buf;
+	int len;
+	int ref;
+
+	/* Clients to deliver to, freed once the broadcast has been queued */
+	int64_t *client_ids;
+	int clients;
+} broadcast_t;
+
+/* Message from the stratifier for the connector to deliver, either json to a
+ * single client or a broadcast to many */
+typedef struct smsg {
+	json_t *json_msg;
+	int64_t client_id;
+	broadcast_t *bcast;
+} smsg_t;
+
 int64_t connector_newclientid(ckpool_t *ckp);
 void connector_upstream_msg(ckpool_t *ckp, char *msg);
-void connector_add_message(ckpool_t *ckp, json_t *val);
+broadcast_t *connector_new_broadcast(json_t *val, int64_t *client_ids, const int clients);
+void connector_add_message(ckpool_t *ckp, smsg_t *msg);
+void connector_send_json(ckpool_t *ckp, const int64_t client_id, json_t *json_msg);
 char *connector_stats(void *data, const int runtime);
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd);
 void *connector(void *arg);
@@ -17,7 +17,9 @@
 #else
 #include <sys/un.h>
 #endif
+#include <linux/futex.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/file.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
@@ -439,6 +441,287 @@ void _cksem_destroy(sem_t *sem, const char *file, const char *func, const int li
 		quitfrom(1, file, func, line, "Failed to sem_destroy errno=%d sem=0x%p", errno, sem);
 }
 
+/* Sleep for up to ms milliseconds on the futex word uaddr as long as it still
+ * holds val. May return early or spuriously so callers must recheck. */
+void ckfutex_wait(int *uaddr, const int val, const int ms)
+{
+	ts_t timeout;
+
+	ms_to_ts(&timeout, ms);
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, &timeout, NULL, 0);
+}
+
+/* Wake up to waiters threads sleeping on the futex word uaddr */
+void ckfutex_wake(int *uaddr, const int waiters)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, waiters, NULL, NULL, 0);
+}
+
+/* Each thread that enters an epoch section gets a record, never freed, on a
+ * global list which reclaimers scan. Active is the global epoch the thread
+ * saw on entering its outermost section, or 0 when outside one. */
+typedef struct epoch_record epoch_record_t;
+
+struct epoch_record {
+	epoch_record_t *next;
+	uint64_t active;
+	int nest;
+};
+
+typedef struct epoch_free epoch_free_t;
+
+struct epoch_free {
+	epoch_free_t *next;
+	void *ptr;
+	uint64_t stamp;
+};
+
+static uint64_t global_epoch = 1;
+static epoch_record_t *epoch_records;
+static __thread epoch_record_t *epoch_record;
+
+/* Pointers waiting for it to be safe to free them, oldest first */
+static epoch_free_t *epoch_frees;
+static epoch_free_t *epoch_frees_tail;
+static pthread_mutex_t epoch_free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static epoch_record_t *get_epoch_record(void)
+{
+	epoch_record_t *record = epoch_record;
+
+	if (unlikely(!record)) {
+		record = ckzalloc(sizeof(epoch_record_t));
+		record->next = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE);
+		while (!__atomic_compare_exchange_n(&epoch_records, &record->next, record, false,
+						    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			;
+		epoch_record = record;
+	}
+	return record;
+}
+
+/* Sections may nest; only the outermost one publishes the epoch */
+void ckepoch_enter(void)
+{
+	epoch_record_t *record = get_epoch_record();
+
+	if (record->nest++)
+		return;
+	__atomic_store_n(&record->active, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+			 __ATOMIC_SEQ_CST);
+}
+
+void ckepoch_exit(void)
+{
+	epoch_record_t *record = epoch_record;
+
+	if (--record->nest)
+		return;
+	__atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+}
+
+/* Call after unlinking an object to get the stamp to test it against */
+uint64_t ckepoch_retire(void)
+{
+	return __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Have all threads that could have seen an object retired at stamp left
+ * their epoch sections */
+bool ckepoch_safe(const uint64_t stamp)
+{
+	epoch_record_t *record;
+
+	record = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE);
+	for (; record; record = record->next) {
+		uint64_t active = __atomic_load_n(&record->active, __ATOMIC_SEQ_CST);
+
+		if (active && active <= stamp)
+			return false;
+	}
+	return true;
+}
+
+/* Free ptr, already unlinked from any lock free structures, once it is safe
+ * to do so, freeing any earlier deferred pointers that have become safe. */
+void ckepoch_free(void *ptr)
+{
+	epoch_free_t *efree = ckalloc(sizeof(epoch_free_t)), *tmp;
+
+	efree->next = NULL;
+	efree->ptr = ptr;
+	efree->stamp = ckepoch_retire();
+
+	pthread_mutex_lock(&epoch_free_lock);
+	if (epoch_frees_tail)
+		epoch_frees_tail->next = efree;
+	else
+		epoch_frees = efree;
+	epoch_frees_tail = efree;
+	while (epoch_frees && ckepoch_safe(epoch_frees->stamp)) {
+		tmp = epoch_frees;
+		epoch_frees = tmp->next;
+		if (!epoch_frees)
+			epoch_frees_tail = NULL;
+		free(tmp->ptr);
+		free(tmp);
+	}
+	pthread_mutex_unlock(&epoch_free_lock);
+}
+
+/* Each thread keeps its own list of free objects of each slab type, linked
+ * through their first word, so allocating and freeing normally touch no
+ * shared state. Threads that free more than they allocate, as when one
+ * thread creates messages that another consumes, hand batches of objects
+ * back to the slab for threads that run out to take. Objects are never
+ * returned to the system. Usage is counted per thread and added to the
+ * slab's totals a batch at a time. */
+#define CKSLAB_MAX	16
+#define CKSLAB_BATCH	64
+
+typedef struct slab_cache slab_cache_t;
+
+struct slab_cache {
+	void *objects;
+	int count;
+	int allocs;
+	int frees;
+};
+
+/* Batches of free objects are linked through the second word of their
+ * first object */
+struct ckslab {
+	char name[16];
+	size_t size;
+	int id;
+
+	pthread_mutex_t lock;
+	void **batches;
+
+	int64_t created;
+	int64_t allocs;
+	int64_t frees;
+};
+
+static ckslab_t *ckslabs[CKSLAB_MAX];
+static int ckslab_count;
+static pthread_mutex_t ckslab_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread slab_cache_t slab_caches[CKSLAB_MAX];
+
+ckslab_t *ckslab_create(const char *name, const size_t size)
+{
+	ckslab_t *slab = ckzalloc(sizeof(ckslab_t));
+
+	strncpy(slab->name, name, 15);
+	/* Room for the batch links, rounded up to keep objects aligned */
+	slab->size = (MAX(size, sizeof(void *) * 2) + 15) & ~(size_t)15;
+	pthread_mutex_init(&slab->lock, NULL);
+
+	pthread_mutex_lock(&ckslab_lock);
+	if (unlikely(ckslab_count >= CKSLAB_MAX))
+		quit(1, "Too many ckslabs creating %s", name);
+	slab->id = ckslab_count;
+	ckslabs[ckslab_count++] = slab;
+	pthread_mutex_unlock(&ckslab_lock);
+
+	return slab;
+}
+
+/* Take a batch of free objects from the slab, or carve a new one */
+static void slab_refill(ckslab_t *slab, slab_cache_t *cache)
+{
+	void **batch;
+	char *objects;
+	int i;
+
+	pthread_mutex_lock(&slab->lock);
+	batch = slab->batches;
+	if (batch)
+		slab->batches = batch[1];
+	pthread_mutex_unlock(&slab->lock);
+
+	if (batch) {
+		cache->objects = batch;
+		cache->count = CKSLAB_BATCH;
+		return;
+	}
+
+	objects = ckalloc(slab->size * CKSLAB_BATCH);
+	for (i = 0; i < CKSLAB_BATCH - 1; i++)
+		*(void **)(objects + slab->size * i) = objects + slab->size * (i + 1);
+	*(void **)(objects + slab->size * i) = NULL;
+	cache->objects = objects;
+	cache->count = CKSLAB_BATCH;
+	__atomic_add_fetch(&slab->created, CKSLAB_BATCH, __ATOMIC_RELAXED);
+}
+
+/* Hand a batch of this thread's free objects back to the slab */
+static void slab_spill(ckslab_t *slab, slab_cache_t *cache)
+{
+	void **batch = cache->objects, **last = batch;
+	int i;
+
+	for (i = 1; i < CKSLAB_BATCH; i++)
+		last = *last;
+	cache->objects = *last;
+	cache->count -= CKSLAB_BATCH;
+	*last = NULL;
+
+	pthread_mutex_lock(&slab->lock);
+	batch[1] = slab->batches;
+	slab->batches = batch;
+	pthread_mutex_unlock(&slab->lock);
+}
+
+/* Return a zeroed object from slab */
+void *ckslab_alloc(ckslab_t *slab)
+{
+	slab_cache_t *cache = &slab_caches[slab->id];
+	void **obj;
+
+	if (unlikely(!cache->objects))
+		slab_refill(slab, cache);
+	obj = cache->objects;
+	cache->objects = *obj;
+	cache->count--;
+	if (unlikely(++cache->allocs >= CKSLAB_BATCH)) {
+		__atomic_add_fetch(&slab->allocs, cache->allocs, __ATOMIC_RELAXED);
+		cache->allocs = 0;
+	}
+	memset(obj, 0, slab->size);
+	return obj;
+}
+
+void ckslab_free(ckslab_t *slab, void *ptr)
+{
+	slab_cache_t *cache = &slab_caches[slab->id];
+
+	if (unlikely(!ptr))
+		return;
+	*(void **)ptr = cache->objects;
+	cache->objects = ptr;
+	if (unlikely(++cache->count >= CKSLAB_BATCH * 2))
+		slab_spill(slab, cache);
+	if (unlikely(++cache->frees >= CKSLAB_BATCH)) {
+		__atomic_add_fetch(&slab->frees, cache->frees, __ATOMIC_RELAXED);
+		cache->frees = 0;
+	}
+}
+
+/* Objects in use, memory held and objects allocated in total by slab, in the
+ * same form as the other stats. The counts lag by up to a batch per thread. */
+void ckslab_stats(ckslab_t *slab, json_t **val)
+{
+	int64_t allocs, frees, memsize;
+	int objects;
+
+	allocs = __atomic_load_n(&slab->allocs, __ATOMIC_RELAXED);
+	frees = __atomic_load_n(&slab->frees, __ATOMIC_RELAXED);
+	objects = allocs > frees ? allocs - frees : 0;
+	memsize = __atomic_load_n(&slab->created, __ATOMIC_RELAXED) * slab->size;
+	JSON_CPACK(*val, "{si,sI,sI}", "count", objects, "memory", memsize, "generated", allocs);
+}
+
 /* Extract just the url and port information from a url string, allocating
  * heap memory for sockaddr_url and sockaddr_port. */
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port)
@@ -677,7 +960,7 @@ void _close(int *fd, const char *file, const char *func, const int line)
 	}
 }
 
-int bind_socket(char *url, char *port)
+static int __bind_socket(char *url, char *port, const bool reuseport)
 {
 	struct addrinfo servinfobase, *servinfo, hints, *p;
 	int ret, sockd = -1;
@@ -702,6 +985,11 @@ int bind_socket(char *url, char *port)
 		goto out;
 	}
 	setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (reuseport && setsockopt(sockd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+		LOGWARNING("Failed to set SO_REUSEPORT on socket for %s:%s", url, port);
+		Close(sockd);
+		goto out;
+	}
 	ret = bind(sockd, p->ai_addr, p->ai_addrlen);
 	if (ret < 0) {
 		LOGWARNING("Failed to bind socket for %s:%s", url, port);
@@ -714,6 +1002,18 @@ out:
 	return sockd;
 }
 
+int bind_socket(char *url, char *port)
+{
+	return __bind_socket(url, port, false);
+}
+
+/* Bind a socket with SO_REUSEPORT set so that several listening sockets can
+ * share the same address, with the kernel balancing connections across them */
+int bind_reuseport_socket(char *url, char *port)
+{
+	return __bind_socket(url, port, true);
+}
+
 int connect_socket(char *url, char *port)
 {
 	struct addrinfo servinfobase, *servinfo, hints, *p;
@@ -2206,6 +2506,17 @@ void ts_realtime(ts_t *ts)
 	clock_gettime(CLOCK_REALTIME, ts);
 }
 
+/* Realtime clock at scheduler tick resolution, which the kernel caches so it
+ * is much cheaper to read on hot paths. */
+void ts_realtime_coarse(ts_t *ts)
+{
+#ifdef CLOCK_REALTIME_COARSE
+	clock_gettime(CLOCK_REALTIME_COARSE, ts);
+#else
+	clock_gettime(CLOCK_REALTIME, ts);
+#endif
+}
+
 void cksleep_prepare_r(ts_t *ts)
 {
 	clock_gettime(CLOCK_MONOTONIC, ts);
@@ -2291,7 +2602,7 @@ double tvdiff(tv_t *end, tv_t *start)
 /* Create an exponentially decaying average over interval */
 void decay_time(double *f, double fadd, double fsecs, double interval)
 {
-	double ftotal, fprop, dexp;
+	double dexp;
 
 	if (fsecs <= 0)
 		return;
@@ -2299,7 +2610,17 @@ void decay_time(double *f, double fadd, double fsecs, double interval)
 	/* Put Sanity bound on how large the denominator can get */
 	if (unlikely(dexp > 36))
 		dexp = 36;
-	fprop = 1.0 - 1 / exp(dexp);
+	decay_prop(f, fadd, fsecs, 1.0 - 1 / exp(dexp));
+}
+
+/* As decay_time but with the proportion for fsecs over the interval already
+ * worked out, for callers with precomputed decay factors */
+void decay_prop(double *f, double fadd, double fsecs, double fprop)
+{
+	double ftotal;
+
+	if (fsecs <= 0)
+		return;
 	ftotal = 1.0 + fprop;
 	*f += (fadd / fsecs * fprop);
 	*f /= ftotal;
@@ -484,6 +484,29 @@ void _cksem_destroy(sem_t *sem, const char *file, const char *func, const int li
 #define cksem_mswait(SEM, _timeout) _cksem_mswait(SEM, _timeout, __FILE__, __func__, __LINE__)
 #define cksem_destroy(SEM) _cksem_destroy(SEM, __FILE__, __func__, __LINE__)
 
+void ckfutex_wait(int *uaddr, const int val, const int ms);
+void ckfutex_wake(int *uaddr, const int waiters);
+
+/* Epoch based reclamation for structures that are looked up without locks.
+ * Readers bracket their accesses with ckepoch_enter/exit, and an object
+ * unlinked from every lock free structure may only be reused or freed once
+ * ckepoch_safe() returns true for the stamp ckepoch_retire() returned after
+ * unlinking it. */
+void ckepoch_enter(void);
+void ckepoch_exit(void);
+uint64_t ckepoch_retire(void);
+bool ckepoch_safe(const uint64_t stamp);
+void ckepoch_free(void *ptr);
+
+/* Thread cached allocator for small fixed size objects that are allocated
+ * and freed at a high rate, such as messages passed between threads */
+typedef struct ckslab ckslab_t;
+
+ckslab_t *ckslab_create(const char *name, const size_t size);
+void *ckslab_alloc(ckslab_t *slab);
+void ckslab_free(ckslab_t *slab, void *ptr);
+void ckslab_stats(ckslab_t *slab, json_t **val);
+
 static inline bool sock_connecting(void)
 {
 	return errno == EINPROGRESS;
@@ -513,6 +536,7 @@ void _close(int *fd, const char *file, const char *func, const int line);
 #define _Close(FD) _close(FD, __FILE__, __func__, __LINE__)
 #define Close(FD) _close(&FD, __FILE__, __func__, __LINE__)
 int bind_socket(char *url, char *port);
+int bind_reuseport_socket(char *url, char *port);
 int connect_socket(char *url, char *port);
 int round_trip(char *url);
 int write_socket(int fd, const void *buf, size_t nbyte);
@@ -602,6 +626,7 @@ void ms_to_ts(ts_t *spec, int64_t ms);
 void ms_to_tv(tv_t *val, int64_t ms);
 void tv_time(tv_t *tv);
 void ts_realtime(ts_t *ts);
+void ts_realtime_coarse(ts_t *ts);
 
 void cksleep_prepare_r(ts_t *ts);
 void nanosleep_abstime(ts_t *ts_end);
@@ -616,6 +641,7 @@ int ms_tvdiff(tv_t *end, tv_t *start);
 double tvdiff(tv_t *end, tv_t *start);
 
 void decay_time(double *f, double fadd, double fsecs, double interval);
+void decay_prop(double *f, double fadd, double fsecs, double fprop);
 double sane_tdiff(tv_t *end, tv_t *start);
 void suffix_string(double val, char *buf, size_t bufsiz, int sigdigits);
 
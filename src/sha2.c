@@ -34,8 +34,14 @@
 
 #include "config.h"
 
+#include <alloca.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 #include "sha2.h"
 
@@ -85,33 +91,8 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
-#ifdef USE_AVX2
-extern void sha256_rorx(const void *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_rorx(message, ctx->h, block_nb);
-}
-#elif defined(USE_AVX1)
-extern void sha256_avx(const unsigned char *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_avx(message, ctx->h, block_nb);
-}
-#elif defined(USE_SSE4)
-extern void sha256_sse4(const unsigned char *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_sse4(message, ctx->h, block_nb);
-}
-#else
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+static void sha256_transf_c(sha256_ctx *ctx, const unsigned char *message,
+                            unsigned int block_nb)
 {
     uint32_t w[64];
     uint32_t wv[8];
@@ -155,7 +136,342 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
     }
 }
+
+#ifdef USE_ASM
+extern void sha256_rorx(const void *, uint32_t[8], uint64_t);
+extern void sha256_avx(const unsigned char *, uint32_t[8], uint64_t);
+extern void sha256_sse4(const unsigned char *, uint32_t[8], uint64_t);
+
+static void sha256_transf_rorx(sha256_ctx *ctx, const unsigned char *message,
+			       unsigned int block_nb)
+{
+	sha256_rorx(message, ctx->h, block_nb);
+}
+
+static void sha256_transf_avx(sha256_ctx *ctx, const unsigned char *message,
+			      unsigned int block_nb)
+{
+	sha256_avx(message, ctx->h, block_nb);
+}
+
+static void sha256_transf_sse4(sha256_ctx *ctx, const unsigned char *message,
+			       unsigned int block_nb)
+{
+	sha256_sse4(message, ctx->h, block_nb);
+}
+#endif /* USE_ASM */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* Intel SHA extensions, 4 rounds per pair of sha256rnds2 with the message
+ * schedule computed 4 words at a time by sha256msg1/2. The state is kept in
+ * the ABEF/CDGH order the instructions use. */
+__attribute__ ((target ("sha,sse4.1")))
+static void sha256_transf_shani(sha256_ctx *ctx, const unsigned char *message,
+				unsigned int block_nb)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg[4], tmp;
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i *)&ctx->h[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&ctx->h[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (block_nb--) {
+		abef = state0;
+		cdgh = state1;
+		for (i = 0; i < 4; i++) {
+			tmp = _mm_loadu_si128((const __m128i *)(message + (i << 4)));
+			msg[i] = _mm_shuffle_epi8(tmp, mask);
+		}
+		for (i = 0; i < 16; i++) {
+			/* Words 4i..4i+3 replace those 16 words back */
+			if (i >= 4) {
+				tmp = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(i + 3) & 3],
+									 msg[(i + 2) & 3], 4));
+				msg[i & 3] = _mm_sha256msg2_epu32(tmp, msg[(i + 3) & 3]);
+			}
+			tmp = _mm_add_epi32(msg[i & 3],
+					    _mm_loadu_si128((const __m128i *)&sha256_k[i << 2]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+			tmp = _mm_shuffle_epi32(tmp, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, tmp);
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		message += SHA256_BLOCK_SIZE;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128((__m128i *)&ctx->h[0], state0);
+	_mm_storeu_si128((__m128i *)&ctx->h[4], state1);
+}
+
+static bool cpu_has_sha(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ebx >> 29) & 1;
+}
+#endif /* __x86_64__ && __GNUC__ */
+
+typedef void (*sha256_transf_fn)(sha256_ctx *, const unsigned char *, unsigned int);
+
+static void sha256_mb_select(void);
+
+static sha256_transf_fn sha256_transf_best = sha256_transf_c;
+static const char *sha256_backend_name = "c";
+
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb)
+{
+	sha256_transf_best(ctx, message, block_nb);
+}
+
+const char *sha256_backend(void)
+{
+	return sha256_backend_name;
+}
+
+/* Compare a kernel against the portable C one over messages spanning one
+ * to several blocks. */
+static bool sha256_selftest(const sha256_transf_fn transf)
+{
+	unsigned char message[SHA256_BLOCK_SIZE * 4];
+	uint32_t h[8], ref[8];
+	unsigned int i, blocks;
+	sha256_ctx ctx;
+
+	for (i = 0; i < sizeof(message); i++)
+		message[i] = i * 131 + 7;
+	for (blocks = 1; blocks <= 4; blocks++) {
+		memcpy(ctx.h, sha256_h0, sizeof(ctx.h));
+		sha256_transf_c(&ctx, message, blocks);
+		memcpy(ref, ctx.h, sizeof(ref));
+		memcpy(ctx.h, sha256_h0, sizeof(ctx.h));
+		transf(&ctx, message, blocks);
+		memcpy(h, ctx.h, sizeof(h));
+		if (memcmp(h, ref, sizeof(h)))
+			return false;
+	}
+	return true;
+}
+
+/* Choose the fastest sha256 kernel the cpu supports that passes the self
+ * test, at startup before anything hashes. */
+__attribute__ ((constructor))
+static void sha256_select(void)
+{
+	struct {
+		const char *name;
+		sha256_transf_fn transf;
+		bool supported;
+	} kernels[4];
+	int i, n = 0;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	kernels[n].name = "shani";
+	kernels[n].transf = sha256_transf_shani;
+	kernels[n++].supported = cpu_has_sha() && __builtin_cpu_supports("sse4.1");
+#ifdef USE_ASM
+	kernels[n].name = "avx2";
+	kernels[n].transf = sha256_transf_rorx;
+	kernels[n++].supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+	kernels[n].name = "avx";
+	kernels[n].transf = sha256_transf_avx;
+	kernels[n++].supported = __builtin_cpu_supports("avx");
+	kernels[n].name = "sse4";
+	kernels[n].transf = sha256_transf_sse4;
+	kernels[n++].supported = __builtin_cpu_supports("sse4.1");
+#endif /* USE_ASM */
+#endif /* __x86_64__ && __GNUC__ */
+
+	for (i = 0; i < n; i++) {
+		if (!kernels[i].supported || !sha256_selftest(kernels[i].transf))
+			continue;
+		sha256_transf_best = kernels[i].transf;
+		sha256_backend_name = kernels[i].name;
+		break;
+	}
+	sha256_mb_select();
+}
+
+/* Multi-buffer SHA-256 transforming one block from each of several
+ * independent messages at once, one message per vector lane. The kernel is
+ * written with gcc vector extensions and instantiated for 4, 8 and 16 lanes,
+ * the wider ones compiled for avx2 and avx512f and chosen at runtime. */
+
+#define MB_ROTR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define MB_F1(x) (MB_ROTR(x,  2) ^ MB_ROTR(x, 13) ^ MB_ROTR(x, 22))
+#define MB_F2(x) (MB_ROTR(x,  6) ^ MB_ROTR(x, 11) ^ MB_ROTR(x, 25))
+#define MB_F3(x) (MB_ROTR(x,  7) ^ MB_ROTR(x, 18) ^ ((x) >>  3))
+#define MB_F4(x) (MB_ROTR(x, 17) ^ MB_ROTR(x, 19) ^ ((x) >> 10))
+
+#define SHA256_MB_TRANSF(name, vec, lanes, attr)				\
+attr static void name(uint32_t (*h)[8], const unsigned char **block)		\
+{										\
+	vec w[64], wv[8], t1, t2;						\
+	int i, l;								\
+										\
+	for (i = 0; i < 16; i++) {						\
+		for (l = 0; l < lanes; l++) {					\
+			uint32_t x;						\
+										\
+			PACK32(&block[l][i << 2], &x);				\
+			w[i][l] = x;						\
+		}								\
+	}									\
+	for (i = 16; i < 64; i++)						\
+		w[i] = MB_F4(w[i - 2]) + w[i - 7] + MB_F3(w[i - 15]) + w[i - 16]; \
+	for (i = 0; i < 8; i++) {						\
+		for (l = 0; l < lanes; l++)					\
+			wv[i][l] = h[l][i];					\
+	}									\
+	for (i = 0; i < 64; i++) {						\
+		t1 = wv[7] + MB_F2(wv[4]) + CH(wv[4], wv[5], wv[6])		\
+			+ sha256_k[i] + w[i];					\
+		t2 = MB_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);			\
+		wv[7] = wv[6];							\
+		wv[6] = wv[5];							\
+		wv[5] = wv[4];							\
+		wv[4] = wv[3] + t1;						\
+		wv[3] = wv[2];							\
+		wv[2] = wv[1];							\
+		wv[1] = wv[0];							\
+		wv[0] = t1 + t2;						\
+	}									\
+	for (i = 0; i < 8; i++) {						\
+		for (l = 0; l < lanes; l++)					\
+			h[l][i] += wv[i][l];					\
+	}									\
+}
+
+typedef uint32_t vec4_t __attribute__ ((vector_size (16)));
+SHA256_MB_TRANSF(sha256_transf_x4, vec4_t, 4, )
+
+#if defined(__x86_64__) && defined(__GNUC__)
+typedef uint32_t vec8_t __attribute__ ((vector_size (32)));
+typedef uint32_t vec16_t __attribute__ ((vector_size (64)));
+SHA256_MB_TRANSF(sha256_transf_x8, vec8_t, 8, __attribute__ ((target ("avx2"))))
+SHA256_MB_TRANSF(sha256_transf_x16, vec16_t, 16, __attribute__ ((target ("avx512f"))))
 #endif
+
+static void (*sha256_transf_mb)(uint32_t (*)[8], const unsigned char **) = sha256_transf_x4;
+static int sha256_lanes = 4;
+
+static void sha256_mb_select(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("avx512f")) {
+		sha256_transf_mb = sha256_transf_x16;
+		sha256_lanes = 16;
+	} else if (__builtin_cpu_supports("avx2")) {
+		sha256_transf_mb = sha256_transf_x8;
+		sha256_lanes = 8;
+	}
+#endif
+}
+
+int sha256_mb_lanes(void)
+{
+	return sha256_lanes;
+}
+
+/* Double hash up to one kernel's worth of lanes */
+static void sha256d_lanes(const int lanes, const sha256_ctx **ctx,
+			  const unsigned char **message, const unsigned int *len,
+			  unsigned char **digest, const int n)
+{
+	static const unsigned char idle[SHA256_BLOCK_SIZE];
+	unsigned char *buf[SHA256_MB_MAX], second[SHA256_MB_MAX][SHA256_BLOCK_SIZE];
+	unsigned int nblocks[SHA256_MB_MAX], maxblocks = 0, b;
+	const unsigned char *block[SHA256_MB_MAX];
+	uint32_t h[SHA256_MB_MAX][8];
+	int i, l;
+
+	/* Pad each message after anything buffered in its starting context
+	 * into whole blocks */
+	for (l = 0; l < n; l++) {
+		unsigned int buffered = ctx[l] ? ctx[l]->len : 0, tot, pm_len;
+		unsigned char *p;
+
+		tot = buffered + len[l];
+		pm_len = (tot + 9 + SHA256_BLOCK_SIZE - 1) & ~(SHA256_BLOCK_SIZE - 1);
+		p = buf[l] = alloca(pm_len);
+		if (buffered)
+			memcpy(p, ctx[l]->block, buffered);
+		memcpy(p + buffered, message[l], len[l]);
+		memset(p + tot, 0, pm_len - tot);
+		p[tot] = 0x80;
+		if (ctx[l])
+			tot += ctx[l]->tot_len;
+		UNPACK32(tot << 3, p + pm_len - 4);
+		nblocks[l] = pm_len / SHA256_BLOCK_SIZE;
+		if (nblocks[l] > maxblocks)
+			maxblocks = nblocks[l];
+		for (i = 0; i < 8; i++)
+			h[l][i] = ctx[l] ? ctx[l]->h[i] : sha256_h0[i];
+	}
+	for (l = n; l < lanes; l++) {
+		block[l] = idle;
+		memset(h[l], 0, sizeof(h[l]));
+	}
+
+	for (b = 0; b < maxblocks; b++) {
+		for (l = 0; l < n; l++)
+			block[l] = b < nblocks[l] ? buf[l] + (b << 6) : idle;
+		sha256_transf_mb(h, block);
+		/* Save the first digest of each lane as it finishes */
+		for (l = 0; l < n; l++) {
+			if (b + 1 != nblocks[l])
+				continue;
+			memset(second[l], 0, SHA256_BLOCK_SIZE);
+			for (i = 0; i < 8; i++)
+				UNPACK32(h[l][i], &second[l][i << 2]);
+			second[l][SHA256_DIGEST_SIZE] = 0x80;
+			UNPACK32(SHA256_DIGEST_SIZE << 3, second[l] + SHA256_BLOCK_SIZE - 4);
+		}
+	}
+
+	for (l = 0; l < n; l++) {
+		block[l] = second[l];
+		for (i = 0; i < 8; i++)
+			h[l][i] = sha256_h0[i];
+	}
+	sha256_transf_mb(h, block);
+	for (l = 0; l < n; l++) {
+		for (i = 0; i < 8; i++)
+			UNPACK32(h[l][i], &digest[l][i << 2]);
+	}
+}
+
+/* Double sha256 n independent messages with the multi-buffer kernel. Each
+ * message continues from ctx[i] if it is non-NULL, allowing a cached
+ * midstate of a common prefix to be used, and the context is not modified. */
+void sha256d_mb(const sha256_ctx **ctx, const unsigned char **message,
+		const unsigned int *len, unsigned char **digest, int n)
+{
+	const sha256_ctx *noctx[SHA256_MB_MAX] = {};
+	int lanes = sha256_mb_lanes(), i;
+
+	for (i = 0; i < n; i += lanes) {
+		int batch = n - i < lanes ? n - i : lanes;
+
+		sha256d_lanes(lanes, ctx ? ctx + i : noctx, message + i, len + i,
+			      digest + i, batch);
+	}
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -59,6 +59,9 @@ typedef struct {
 
 extern uint32_t sha256_k[64];
 
+const char *sha256_backend(void);
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb);
 void sha256_init(sha256_ctx * ctx);
 void sha256_update(sha256_ctx *ctx, const unsigned char *message,
                    unsigned int len);
@@ -66,4 +69,11 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
 
+/* Most messages the multi-buffer sha256 hashes in one pass */
+#define SHA256_MB_MAX 16
+
+int sha256_mb_lanes(void);
+void sha256d_mb(const sha256_ctx **ctx, const unsigned char **message,
+		const unsigned int *len, unsigned char **digest, int n);
+
 #endif /* !SHA2_H */
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2026 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Binary sharelog format, a compact alternative to the json sharelogs.
+ *
+ * Each workbase gets its own <workinfoid>.sharebin file in the block height
+ * log directory, so the directory listing is the index by workinfoid. A file
+ * is a header followed by fixed size records in native byte order, making it
+ * suitable for mmap and random access. Strings that repeat across shares
+ * (usernames, workernames, addresses, agents and server urls) are written
+ * once per file as string records assigning them an id, always before the
+ * first share record referring to them. Id 0 is the empty string. */
+
+#ifndef SHARELOG_H
+#define SHARELOG_H
+
+#include <stdint.h>
+
+#define SHARELOG_MAGIC "CKSHRLOG"
+#define SHARELOG_VERSION 1
+#define SHARELOG_RECSIZE 136
+/* Longer strings are truncated */
+#define SHARELOG_STRLEN 128
+
+enum sharelog_type {
+	SLR_NONE,
+	SLR_SHARE,
+	SLR_STRING,
+};
+
+struct sharelog_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t recsize;
+	int64_t workinfoid;
+	uint8_t pad[SHARELOG_RECSIZE - 24];
+};
+
+struct sharelog_share {
+	uint8_t type;
+	uint8_t result;
+	uint8_t enonce1len;
+	uint8_t nonce2len;
+	int32_t errn;
+	int64_t clientid;
+	int64_t sec;
+	uint32_t nsec;
+	uint32_t nonce;
+	double diff;
+	double sdiff;
+	uint32_t ntime;
+	/* String ids */
+	uint32_t workername;
+	uint32_t username;
+	uint32_t address;
+	uint32_t agent;
+	uint32_t createinet;
+	uint8_t hash[32];
+	uint8_t enonce1[16];
+	uint8_t nonce2[16];
+};
+
+struct sharelog_string {
+	uint8_t type;
+	uint8_t pad;
+	uint16_t len;
+	uint32_t id;
+	char str[SHARELOG_STRLEN];
+};
+
+typedef union sharelog_rec {
+	uint8_t type;
+	struct sharelog_share share;
+	struct sharelog_string string;
+} sharelog_rec_t;
+
+_Static_assert(sizeof(struct sharelog_header) == SHARELOG_RECSIZE, "sharelog header size");
+_Static_assert(sizeof(struct sharelog_share) == SHARELOG_RECSIZE, "sharelog share size");
+_Static_assert(sizeof(struct sharelog_string) == SHARELOG_RECSIZE, "sharelog string size");
+
+#endif /* SHARELOG_H */
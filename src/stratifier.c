@@ -30,6 +30,7 @@
 #include "bitcoin.h"
 #include "sha2.h"
 #include "stratifier.h"
+#include "sharelog.h"
 #include "uthash.h"
 #include "utlist.h"
 #include "connector.h"
@@ -41,6 +42,11 @@ static const char *scriptsig_header = "01000000010000000000000000000000000000000
 static uchar scriptsig_header_bin[41];
 static const double nonces = 4294967296;
 
+/* Allocators for the message and json params created for every message the
+ * stratifier receives */
+static ckslab_t *cmsg_slab;
+static ckslab_t *jp_slab;
+
 /* Add unaccounted shares when they arrive, remove them with each update of
  * rolling stats. */
 struct pool_stats {
@@ -55,7 +61,6 @@ struct pool_stats {
 	int remote_users;
 
 	/* Absolute shares stats */
-	int64_t unaccounted_shares;
 	int64_t accounted_shares;
 
 	/* Cycle of 32 to determine which users to dump stats on */
@@ -68,9 +73,7 @@ struct pool_stats {
 	double sps60;
 
 	/* Diff shares stats */
-	int64_t unaccounted_diff_shares;
 	int64_t accounted_diff_shares;
-	int64_t unaccounted_rejects;
 	int64_t accounted_rejects;
 
 	/* Diff shares per second for 1/5/15... minute rolling averages */
@@ -88,25 +91,45 @@ struct pool_stats {
 
 typedef struct pool_stats pool_stats_t;
 
+typedef struct share_counters share_counters_t;
+
+/* Unaccounted pool share counters, each block only ever written by the one
+ * thread that owns it and cache line aligned so threads never contend.
+ * statsupdate accounts for how much each has grown since it last looked. */
+struct share_counters {
+	share_counters_t *next;
+	int64_t shares;
+	int64_t diff_shares;
+	int64_t rejects;
+
+	/* Only accessed by statsupdate */
+	int64_t last_shares;
+	int64_t last_diff_shares;
+	int64_t last_rejects;
+};
+
 typedef struct genwork workbase_t;
 
+typedef struct workbase_table wbtable_t;
+
+/* Array of the live workbases, oldest first, for lock free lookups */
+struct workbase_table {
+	int count;
+	workbase_t *wbs[];
+};
+
 struct json_params {
 	json_t *method;
 	json_t *params;
 	json_t *id_val;
 	int64_t client_id;
+	/* Shares decoded by the connector have this instead of params */
+	submit_t *submit;
 };
 
 typedef struct json_params json_params_t;
 
 /* Stratum json messages with their associated client id */
-struct smsg {
-	json_t *json_msg;
-	int64_t client_id;
-};
-
-typedef struct smsg smsg_t;
-
 struct userwb {
 	UT_hash_handle hh;
 	int64_t id;
@@ -158,7 +181,7 @@ struct user_instance {
 	double dsps1440;
 	double dsps10080;
 	tv_t last_share;
-	tv_t last_decay;
+	int64_t decay_tick; /* Tick uadiff was last folded into the hashmeter */
 
 	bool authorised; /* Has this username ever been authorised? */
 	time_t auth_time;
@@ -188,7 +211,7 @@ struct worker_instance {
 	double dsps1440;
 	double dsps10080;
 	tv_t last_share;
-	tv_t last_decay;
+	int64_t decay_tick; /* Tick uadiff was last folded into the hashmeter */
 	time_t start_time;
 
 	double best_diff; /* Best share found by this worker */
@@ -217,6 +240,10 @@ struct stratum_instance {
 	stratum_instance_t *user_next;
 	stratum_instance_t *user_prev;
 
+	/* List of all stratum instances for iterating over */
+	stratum_instance_t *instance_next;
+	stratum_instance_t *instance_prev;
+
 	stratum_instance_t *node_next;
 	stratum_instance_t *node_prev;
 
@@ -227,7 +254,7 @@ struct stratum_instance {
 	char identity[128];
 
 	/* Reference count for when this instance is used outside of the
-	 * instance_lock */
+	 * instance_lock, only changed atomically */
 	int ref;
 
 	char enonce1[36]; /* Fit up to 16 byte binary enonce1 */
@@ -236,6 +263,12 @@ struct stratum_instance {
 	uint64_t enonce1_64;
 	int session_id;
 
+	/* Sha256 midstate of coinb1 + enonce1 for workbase cb1ctx_id, guarded
+	 * by the cb1seq seqlock */
+	sha256_ctx cb1ctx;
+	int64_t cb1ctx_id;
+	uint32_t cb1seq;
+
 	int64_t diff; /* Current diff */
 	int64_t old_diff; /* Previous diff */
 	int64_t diff_change_job_id; /* Last job_id we changed diff */
@@ -251,7 +284,7 @@ struct stratum_instance {
 	int ssdc; /* Shares since diff change */
 	tv_t first_share;
 	tv_t last_share;
-	tv_t last_decay;
+	int64_t decay_tick; /* Tick uadiff was last folded into the hashmeter */
 	time_t first_invalid; /* Time of first invalid in run of non stale rejects */
 	time_t upstream_invalid; /* As first_invalid but for upstream responses */
 	time_t start_time;
@@ -300,14 +333,76 @@ struct stratum_instance {
 	bool remote; /* Is this a remote client on a trusted remote server */
 };
 
+/* The share dedupe table is open addressed and split into independently
+ * locked stripes that are sized on demand. Each entry carries the generation
+ * of the workbase it was submitted against and entries whose generation has
+ * been retired count as empty, so dropping a workbase is O(1). */
+#define SHARE_STRIPES		64
+#define SHARE_STRIPE_SIZE	1024
+#define SHARE_PROBES		8
+#define SHARE_GENS		1024
+
 struct share {
-	UT_hash_handle hh;
 	uchar hash[32];
-	int64_t workbase_id;
+	int64_t gen;
 };
 
 typedef struct share share_t;
 
+struct share_stripe {
+	mutex_t lock;
+	share_t *slots;
+	int size;
+};
+
+typedef struct share_stripe share_stripe_t;
+
+/* A slot in the ring of live generations, gen is zero once retired */
+struct share_gen {
+	int64_t gen;
+	int64_t shares;
+};
+
+typedef struct share_gen share_gen_t;
+
+typedef struct sharelog sharelog_t;
+
+/* A sharelog entry queued for the sharelog writer, holding the sharelog path
+ * followed by the line to append or, for binary sharelogs, the share record
+ * followed by the nul terminated strings it refers to. A zero len entry asks
+ * the writer to close all its sharelogs. */
+struct sharelog {
+	sharelog_t *next;
+	int len;
+	bool binary;
+	int64_t workinfoid;
+	char data[];
+};
+
+typedef struct sharelog_str slstr_t;
+
+/* A string already written to a binary sharelog and the id it was given */
+struct sharelog_str {
+	UT_hash_handle hh;
+	uint32_t id;
+	char str[];
+};
+
+typedef struct sharelog_file slfile_t;
+
+/* A sharelog kept open by the sharelog writer */
+struct sharelog_file {
+	UT_hash_handle hh;
+	char *path;
+	FILE *fp;
+	time_t used;
+	bool dirty;
+
+	/* String dictionary of binary sharelogs */
+	slstr_t *strings;
+	uint32_t nstrings;
+};
+
 struct proxy_base {
 	UT_hash_handle hh;
 	UT_hash_handle sh; /* For subproxy hashlist */
@@ -377,6 +472,20 @@ struct txntable {
 	bool seen;
 };
 
+/* The stratum instance lookup table is split by client id into shards with
+ * their own locks so that looking up a client for every message does not
+ * contend on instance_lock. Adding or removing an instance takes both
+ * instance_lock and the shard lock, in that order, while iterating over all
+ * instances uses the instance list under instance_lock alone. */
+#define INSTANCE_SHARDS		64
+
+struct instance_shard {
+	cklock_t lock;
+	stratum_instance_t *instances;
+};
+
+typedef struct instance_shard instance_shard_t;
+
 #define ID_AUTH 0
 #define ID_WORKINFO 1
 #define ID_AGEWORKINFO 2
@@ -399,8 +508,8 @@ struct stratifier_data {
 	pool_stats_t stats;
 	/* Protects changes to pool stats */
 	mutex_t stats_lock;
-	/* Protects changes to unaccounted pool stats */
-	mutex_t uastats_lock;
+	/* Every share processing thread's unaccounted share counters */
+	share_counters_t *share_counters;
 
 	bool verbose;
 
@@ -414,6 +523,11 @@ struct stratifier_data {
 
 	/* For the hashtable of all workbases */
 	workbase_t *workbases;
+	/* Immutable snapshot of the workbases hashtable for lock free lookups,
+	 * republished under workbase_lock whenever the hashtable changes */
+	wbtable_t *wbtable;
+	/* Workbases removed from the hashtable waiting to be cleared */
+	workbase_t *retired_workbases;
 	workbase_t *current_workbase;
 	int workbases_generated;
 	txntable_t *txns;
@@ -432,6 +546,13 @@ struct stratifier_data {
 
 	int64_t workbase_id;
 	int64_t blockchange_id;
+	/* Network diff, or upstream diff when proxying, of the current
+	 * workbase, published for lockless readers */
+	double current_diff;
+
+	/* Lock free stack of entries for the sharelog writer */
+	sharelog_t *sharelogs;
+	sem_t sharelog_sem;
 	int session_id;
 	char lasthash[68];
 	char lastswaphash[68];
@@ -445,7 +566,9 @@ struct stratifier_data {
 
 	int user_instance_id;
 
-	stratum_instance_t *stratum_instances;
+	instance_shard_t instance_shards[INSTANCE_SHARDS];
+	stratum_instance_t *stratum_instances; /* List of all instances */
+	int stratum_count;
 	stratum_instance_t *recycled_instances;
 	stratum_instance_t *node_instances;
 	stratum_instance_t *remote_instances;
@@ -457,11 +580,13 @@ struct stratifier_data {
 
 	user_instance_t *user_instances;
 
-	/* Protects both stratum and user instances */
+	/* Protects both stratum and user instances, and the stratum instance
+	 * list */
 	cklock_t instance_lock;
 
-	share_t *shares;
-	mutex_t share_lock;
+	share_stripe_t share_stripes[SHARE_STRIPES];
+	share_gen_t share_gens[SHARE_GENS];
+	int64_t share_gen; /* Last generation handed out, under workbase_lock */
 
 	int64_t shares_generated;
 
@@ -810,6 +935,7 @@ static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 	free(wb->txn_data);
 	free(wb->txn_hashes);
 	free(wb->logdir);
+	free(wb->sharelog);
 	free(wb->coinb1bin);
 	free(wb->coinb1);
 	free(wb->coinb2bin);
@@ -821,72 +947,486 @@ static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 	free(wb);
 }
 
-/* Remove all shares with a workbase id less than wb_id for block changes */
-static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+static void clear_workbases(ckpool_t *ckp, workbase_t *wbs)
 {
-	share_t *share, *tmp;
-	int purged = 0;
+	workbase_t *wb;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id < wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			purged++;
-		}
+	while (wbs) {
+		wb = wbs;
+		wbs = wb->retired_next;
+		clear_workbase(ckp, wb);
+	}
+}
+
+/* Publish a new snapshot of the workbases hashtable for lock free lookups,
+ * freeing the old one once no reader can still be using it. Must be called
+ * with workbase_lock held for writing. */
+static void __publish_wbtable(sdata_t *sdata)
+{
+	int count = HASH_COUNT(sdata->workbases);
+	wbtable_t *wbtable, *old;
+	workbase_t *wb;
+
+	wbtable = ckalloc(sizeof(wbtable_t) + sizeof(workbase_t *) * count);
+	wbtable->count = 0;
+	for (wb = sdata->workbases; wb; wb = wb->hh.next)
+		wbtable->wbs[wbtable->count++] = wb;
+	old = __atomic_exchange_n(&sdata->wbtable, wbtable, __ATOMIC_ACQ_REL);
+	if (old)
+		ckepoch_free(old);
+}
+
+/* Add the workbases just removed from the hashtable and published snapshot
+ * to the retired list and return those retired workbases that no reader can
+ * still hold, for clearing once workbase_lock is dropped. Must be called with
+ * workbase_lock held for writing. */
+static workbase_t *__retire_workbases(sdata_t *sdata, workbase_t *aged)
+{
+	workbase_t *wb, **prev, *ret = NULL;
+
+	while (aged) {
+		wb = aged;
+		aged = wb->retired_next;
+		wb->dead_epoch = ckepoch_retire();
+		wb->retired_next = sdata->retired_workbases;
+		sdata->retired_workbases = wb;
+	}
+	prev = &sdata->retired_workbases;
+	while ((wb = *prev)) {
+		if (ckepoch_safe(wb->dead_epoch)) {
+			*prev = wb->retired_next;
+			wb->retired_next = ret;
+			ret = wb;
+		} else
+			prev = &wb->retired_next;
+	}
+	return ret;
+}
+
+static void init_share_table(sdata_t *sdata)
+{
+	int i;
+
+	for (i = 0; i < SHARE_STRIPES; i++)
+		mutex_init(&sdata->share_stripes[i].lock);
+}
+
+static void free_share_table(sdata_t *sdata)
+{
+	int i;
+
+	for (i = 0; i < SHARE_STRIPES; i++) {
+		share_stripe_t *stripe = &sdata->share_stripes[i];
+
+		mutex_lock(&stripe->lock);
+		dealloc(stripe->slots);
+		stripe->size = 0;
+		mutex_unlock(&stripe->lock);
 	}
-	mutex_unlock(&sdata->share_lock);
+}
+
+/* Hand out the share generation for a new workbase, under workbase_lock */
+static int64_t new_share_gen(sdata_t *sdata)
+{
+	int64_t gen = ++sdata->share_gen;
+	share_gen_t *sg = &sdata->share_gens[gen % SHARE_GENS];
+	int64_t old = __atomic_load_n(&sg->gen, __ATOMIC_ACQUIRE);
+
+	if (unlikely(old))
+		LOGWARNING("Share generation %"PRId64" still live, retiring early", old);
+	__atomic_store_n(&sg->shares, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&sg->gen, gen, __ATOMIC_RELEASE);
+	return gen;
+}
+
+static bool share_gen_live(sdata_t *sdata, const int64_t gen)
+{
+	if (!gen)
+		return false;
+	return __atomic_load_n(&sdata->share_gens[gen % SHARE_GENS].gen, __ATOMIC_ACQUIRE) == gen;
+}
+
+/* Retire a generation, implicitly emptying every entry carrying it. Returns
+ * how many shares it held. */
+static int64_t retire_share_gen(sdata_t *sdata, int64_t gen)
+{
+	share_gen_t *sg = &sdata->share_gens[gen % SHARE_GENS];
+
+	if (!gen || !__atomic_compare_exchange_n(&sg->gen, &gen, 0, false,
+						 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return 0;
+	return __atomic_load_n(&sg->shares, __ATOMIC_RELAXED);
+}
 
+/* Remove all shares with a generation older than gen for block changes */
+static void purge_share_hashtable(sdata_t *sdata, const int64_t gen)
+{
+	int64_t purged = 0;
+	int i;
+
+	for (i = 0; i < SHARE_GENS; i++) {
+		int64_t old = __atomic_load_n(&sdata->share_gens[i].gen, __ATOMIC_ACQUIRE);
+
+		if (old && old < gen)
+			purged += retire_share_gen(sdata, old);
+	}
 	if (purged)
-		LOGINFO("Cleared %d shares from share hashtable", purged);
+		LOGINFO("Cleared %"PRId64" shares from share hashtable", purged);
+}
+
+/* Remove all shares of a workbase being discarded */
+static void age_share_hashtable(sdata_t *sdata, const int64_t gen)
+{
+	int64_t aged = retire_share_gen(sdata, gen);
+
+	if (aged)
+		LOGINFO("Aged %"PRId64" shares from share hashtable", aged);
+}
+
+static void sharelog_push(sdata_t *sdata, sharelog_t *entry)
+{
+	sharelog_t *head = __atomic_load_n(&sdata->sharelogs, __ATOMIC_RELAXED);
+
+	do {
+		entry->next = head;
+	} while (!__atomic_compare_exchange_n(&sdata->sharelogs, &head, entry, true,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/* Only wake the writer when it may have found the stack empty */
+	if (!head)
+		cksem_post(&sdata->sharelog_sem);
+}
+
+/* Queue the json line for the sharelog at path without touching the
+ * filesystem */
+static void sharelog_add(sdata_t *sdata, const char *path, const json_t *val)
+{
+	int plen = strlen(path) + 1;
+	sharelog_t *entry;
+	char buf[2048];
+	size_t len;
+
+	len = json_dumpb(val, buf, sizeof(buf), JSON_EOL);
+	if (unlikely(!len))
+		return;
+	entry = ckalloc(sizeof(sharelog_t) + plen + len);
+	memcpy(entry->data, path, plen);
+	if (likely(len <= sizeof(buf)))
+		memcpy(entry->data + plen, buf, len);
+	else
+		json_dumpb(val, entry->data + plen, len, JSON_EOL);
+	entry->len = len;
+	entry->binary = false;
+	sharelog_push(sdata, entry);
+}
+
+#define SHARELOG_STRINGS 5
+
+/* Queue a binary sharelog record along with the workername, username,
+ * address, agent and createinet strings which the writer will replace with
+ * ids from the file's string dictionary. */
+static void sharelog_add_binary(sdata_t *sdata, const char *path, const int64_t workinfoid,
+				const struct sharelog_share *share,
+				const char *strings[SHARELOG_STRINGS])
+{
+	int plen = strlen(path) + 1, len = sizeof(*share), slen[SHARELOG_STRINGS], i;
+	sharelog_t *entry;
+	char *data;
+
+	for (i = 0; i < SHARELOG_STRINGS; i++) {
+		slen[i] = strings[i] ? strlen(strings[i]) + 1 : 1;
+		len += slen[i];
+	}
+	entry = ckalloc(sizeof(sharelog_t) + plen + len);
+	memcpy(entry->data, path, plen);
+	data = entry->data + plen;
+	memcpy(data, share, sizeof(*share));
+	data += sizeof(*share);
+	for (i = 0; i < SHARELOG_STRINGS; i++) {
+		if (strings[i])
+			memcpy(data, strings[i], slen[i]);
+		else
+			*data = '\0';
+		data += slen[i];
+	}
+	entry->len = len;
+	entry->binary = true;
+	entry->workinfoid = workinfoid;
+	sharelog_push(sdata, entry);
+}
+
+/* Ask the sharelog writer to close its files when a new logdir is started */
+static void sharelog_rotate(sdata_t *sdata)
+{
+	sharelog_push(sdata, ckzalloc(sizeof(sharelog_t)));
+}
+
+static void close_sharelog(slfile_t **files, slfile_t *file)
+{
+	slstr_t *slstr, *tmp;
+
+	HASH_DEL(*files, file);
+	if (unlikely(fclose(file->fp)))
+		LOGERR("Failed to fclose %s", file->path);
+	HASH_ITER(hh, file->strings, slstr, tmp) {
+		HASH_DEL(file->strings, slstr);
+		free(slstr);
+	}
+	free(file->path);
+	free(file);
+}
+
+static void sharelog_addstr(slfile_t *file, const char *str, const int len, const uint32_t id)
+{
+	slstr_t *slstr = ckalloc(sizeof(slstr_t) + len);
+
+	slstr->id = id;
+	memcpy(slstr->str, str, len);
+	HASH_ADD(hh, file->strings, str, len, slstr);
+	if (id > file->nstrings)
+		file->nstrings = id;
+}
+
+/* Write the header of a new binary sharelog, or reload the string dictionary
+ * of an existing one so appended shares can keep referring to its ids. */
+static bool load_sharelog(slfile_t *file, const int64_t workinfoid)
+{
+	struct sharelog_header hdr;
+	sharelog_rec_t rec;
+	long size;
+
+	if (unlikely(fseek(file->fp, 0, SEEK_END) || (size = ftell(file->fp)) < 0))
+		goto out_err;
+	if (!size) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, SHARELOG_MAGIC, sizeof(hdr.magic));
+		hdr.version = SHARELOG_VERSION;
+		hdr.recsize = SHARELOG_RECSIZE;
+		hdr.workinfoid = workinfoid;
+		if (unlikely(fwrite(&hdr, sizeof(hdr), 1, file->fp) != 1))
+			goto out_err;
+		return true;
+	}
+	rewind(file->fp);
+	if (fread(&hdr, sizeof(hdr), 1, file->fp) != 1 ||
+	    memcmp(hdr.magic, SHARELOG_MAGIC, sizeof(hdr.magic)) || hdr.recsize != SHARELOG_RECSIZE) {
+		LOGERR("Invalid binary sharelog %s", file->path);
+		return false;
+	}
+	while (fread(&rec, sizeof(rec), 1, file->fp) == 1) {
+		if (rec.type == SLR_STRING && rec.string.len <= SHARELOG_STRLEN)
+			sharelog_addstr(file, rec.string.str, rec.string.len, rec.string.id);
+	}
+	/* Drop any partial record left by an interrupted write */
+	if (size % SHARELOG_RECSIZE) {
+		LOGWARNING("Truncating partial record in binary sharelog %s", file->path);
+		if (unlikely(ftruncate(fileno(file->fp), size - size % SHARELOG_RECSIZE)))
+			goto out_err;
+	}
+	if (unlikely(fseek(file->fp, 0, SEEK_END)))
+		goto out_err;
+	return true;
+out_err:
+	LOGERR("Failed to initialise binary sharelog %s", file->path);
+	return false;
+}
+
+static slfile_t *open_sharelog(slfile_t **files, const char *path, const sharelog_t *entry)
+{
+	slfile_t *file;
+	FILE *fp;
+
+	fp = fopen(path, entry->binary ? "a+e" : "ae");
+	if (unlikely(!fp)) {
+		LOGERR("Failed to fopen %s", path);
+		return NULL;
+	}
+	setvbuf(fp, NULL, _IOFBF, 65536);
+	file = ckzalloc(sizeof(slfile_t));
+	file->path = strdup(path);
+	file->fp = fp;
+	HASH_ADD_KEYPTR(hh, *files, file->path, strlen(file->path), file);
+	if (entry->binary && unlikely(!load_sharelog(file, entry->workinfoid))) {
+		close_sharelog(files, file);
+		return NULL;
+	}
+	return file;
+}
+
+/* Return the dictionary id of str in a binary sharelog, first writing a
+ * string record for it if it is new to the file. */
+static uint32_t sharelog_strid(slfile_t *file, const char *str)
+{
+	struct sharelog_string rec;
+	int len = strlen(str);
+	slstr_t *slstr;
+
+	if (!len)
+		return 0;
+	if (len > SHARELOG_STRLEN)
+		len = SHARELOG_STRLEN;
+	HASH_FIND(hh, file->strings, str, len, slstr);
+	if (slstr)
+		return slstr->id;
+	memset(&rec, 0, sizeof(rec));
+	rec.type = SLR_STRING;
+	rec.len = len;
+	rec.id = file->nstrings + 1;
+	memcpy(rec.str, str, len);
+	if (unlikely(fwrite(&rec, sizeof(rec), 1, file->fp) != 1)) {
+		LOGERR("Failed to fwrite to %s", file->path);
+		return 0;
+	}
+	sharelog_addstr(file, str, len, rec.id);
+	return rec.id;
+}
+
+static void write_binary_sharelog(slfile_t *file, const char *data)
+{
+	struct sharelog_share share;
+	uint32_t *ids[SHARELOG_STRINGS];
+	int i;
+
+	memcpy(&share, data, sizeof(share));
+	data += sizeof(share);
+	ids[0] = &share.workername;
+	ids[1] = &share.username;
+	ids[2] = &share.address;
+	ids[3] = &share.agent;
+	ids[4] = &share.createinet;
+	for (i = 0; i < SHARELOG_STRINGS; i++) {
+		*ids[i] = sharelog_strid(file, data);
+		data += strlen(data) + 1;
+	}
+	if (unlikely(fwrite(&share, sizeof(share), 1, file->fp) != 1))
+		LOGERR("Failed to fwrite to %s", file->path);
 }
 
-/* Remove all shares with a workbase id == wb_id being discarded */
-static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+/* Append queued sharelog entries in order, keeping each sharelog open and
+ * fully buffered so that each batch costs one write per file. Files unused
+ * for as long as a workbase lives are closed, as are all of them when a new
+ * logdir is started. */
+static void *sharelog_writer(void *arg)
 {
-	share_t *share, *tmp;
-	int aged = 0;
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->sdata;
+	slfile_t *files = NULL;
+
+	rename_proc("sharelogger");
+
+	while (42) {
+		sharelog_t *entries, *entry, *next, *ordered = NULL;
+		slfile_t *file = NULL, *tmp;
+		time_t now;
+
+		cksem_mswait(&sdata->sharelog_sem, 1000);
+		entries = __atomic_exchange_n(&sdata->sharelogs, NULL, __ATOMIC_ACQUIRE);
+		/* The stack is newest first so reverse it */
+		while (entries) {
+			next = entries->next;
+			entries->next = ordered;
+			ordered = entries;
+			entries = next;
+		}
+
+		now = time(NULL);
+		for (entry = ordered; entry; entry = next) {
+			const char *path = entry->data;
+
+			next = entry->next;
+			if (!entry->len) {
+				HASH_ITER(hh, files, file, tmp)
+					close_sharelog(&files, file);
+				file = NULL;
+				goto next;
+			}
+			if (!file || strcmp(file->path, path)) {
+				HASH_FIND_STR(files, path, file);
+				if (!file)
+					file = open_sharelog(&files, path, entry);
+				if (unlikely(!file))
+					goto next;
+			}
+			if (entry->binary)
+				write_binary_sharelog(file, path + strlen(path) + 1);
+			else if (unlikely(fwrite(path + strlen(path) + 1, entry->len, 1, file->fp) != 1))
+				LOGERR("Failed to fwrite to %s", path);
+			file->used = now;
+			file->dirty = true;
+next:
+			free(entry);
+		}
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id == wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			aged++;
+		HASH_ITER(hh, files, file, tmp) {
+			if (file->dirty) {
+				if (unlikely(fflush(file->fp)))
+					LOGERR("Failed to fflush %s", file->path);
+				file->dirty = false;
+			}
+			if (now - file->used > 600)
+				close_sharelog(&files, file);
 		}
 	}
-	mutex_unlock(&sdata->share_lock);
+	return NULL;
+}
 
-	if (aged)
-		LOGINFO("Aged %d shares from share hashtable", aged);
+/* With clientaffinity the receive, share processing and send pipelines have
+ * a queue and thread each per stratifierthreads and every message for a
+ * client goes to the same one, keeping the client on one thread and its
+ * responses in order. Otherwise each pipeline has the one queue and thread. */
+static int client_shard(const ckpool_t *ckp, const int64_t client_id)
+{
+	return (uint64_t)client_id % ckp->stratifierthreads;
 }
 
-/* Append a bulk list already created to the ssends list */
-static void ssend_bulk_append(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
+static ckmsgq_t *client_ckmsgq(const ckpool_t *ckp, ckmsgq_t *ckmsgq, const int64_t client_id)
 {
-	ckmsgq_t *ssends = sdata->ssends;
+	if (!ckp->clientaffinity)
+		return ckmsgq;
+	return &ckmsgq[client_shard(ckp, client_id)];
+}
+
+/* Add a bulk list of sends already created to the ssends queue, splitting it
+ * by client across the queues with clientaffinity */
+static void ssend_bulk(sdata_t *sdata, ckmsg_t *bulk_send, const int messages, const bool prio)
+{
+	const ckpool_t *ckp = sdata->ckp;
+	ckmsg_t **shard_sends, *client_msg, *tmp;
+	int *shard_messages, i;
+
+	if (!ckp->clientaffinity) {
+		ckmsgq_add_bulk(sdata->ssends, bulk_send, messages, prio);
+		return;
+	}
+
+	shard_sends = ckzalloc(sizeof(ckmsg_t *) * ckp->stratifierthreads);
+	shard_messages = ckzalloc(sizeof(int) * ckp->stratifierthreads);
+	DL_FOREACH_SAFE(bulk_send, client_msg, tmp) {
+		smsg_t *msg = client_msg->data;
+
+		i = client_shard(ckp, msg->client_id);
+		DL_DELETE(bulk_send, client_msg);
+		DL_APPEND(shard_sends[i], client_msg);
+		shard_messages[i]++;
+	}
+	for (i = 0; i < ckp->stratifierthreads; i++) {
+		if (shard_sends[i])
+			ckmsgq_add_bulk(&sdata->ssends[i], shard_sends[i], shard_messages[i], prio);
+	}
+	free(shard_messages);
+	free(shard_sends);
+}
 
-	mutex_lock(ssends->lock);
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, bulk_send);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+/* Append a bulk list already created to the ssends queue */
+static void ssend_bulk_append(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
+{
+	ssend_bulk(sdata, bulk_send, messages, false);
 }
 
 /* As ssend_bulk_append but for high priority messages to be put at the front
- * of the list. */
+ * of the queue. */
 static void ssend_bulk_prepend(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-	ckmsg_t *tmp;
-
-	mutex_lock(ssends->lock);
-	tmp = ssends->msgs;
-	ssends->msgs = bulk_send;
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, tmp);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+	ssend_bulk(sdata, bulk_send, messages, true);
 }
 
 /* Send a json msg to an upstream trusted remote server */
@@ -955,8 +1495,8 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		json_t *json_msg = json_deep_copy(wb_val);
 
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckp->ckmsg_slab);
+		msg = ckslab_alloc(ckp->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -969,8 +1509,8 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		json_t *json_msg = json_deep_copy(wb_val);
 
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckp->ckmsg_slab);
+		msg = ckslab_alloc(ckp->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1068,7 +1608,7 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	sdata_t *ckp_sdata = ckp->sdata;
 	pool_stats_t *stats = &sdata->stats;
 	double old_diff = stats->network_diff;
-	workbase_t *tmp, *tmpa;
+	workbase_t *tmp, *tmpa, *aged = NULL;
 	int len, ret;
 
 	ts_realtime(&wb->gentime);
@@ -1092,6 +1632,7 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 		wb->mapped_id = wb->id = sdata->workbase_id++;
 	else
 		sdata->workbase_id = wb->id;
+	wb->share_gen = new_share_gen(sdata);
 	if (strncmp(wb->prevhash, sdata->lasthash, 64)) {
 		char bin[32], swap[32];
 
@@ -1103,19 +1644,25 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 		sdata->blockchange_id = wb->id;
 	}
 	if (*new_block && ckp->logshares) {
+		sharelog_rotate(ckp_sdata);
 		sprintf(wb->logdir, "%s%08x/", ckp->logdir, wb->height);
 		ret = mkdir(wb->logdir, 0750);
 		if (unlikely(ret && errno != EEXIST))
 			LOGERR("Failed to create log directory %s", wb->logdir);
 	}
 	sprintf(wb->idstring, "%016lx", wb->id);
-	if (ckp->logshares)
+	if (ckp->logshares) {
 		sprintf(wb->logdir, "%s%08x/%s", ckp->logdir, wb->height, wb->idstring);
+		ASPRINTF(&wb->sharelog, "%s.%s", wb->logdir,
+			 ckp->binsharelog ? "sharebin" : "sharelog");
+	}
 
 	HASH_ADD_I64(sdata->workbases, id, wb);
 	if (sdata->current_workbase)
 		tv_time(&sdata->current_workbase->retired);
 	sdata->current_workbase = wb;
+	__atomic_store(&sdata->current_diff, ckp->proxy ? &wb->diff : &wb->network_diff,
+		       __ATOMIC_RELEASE);
 
 	/* Is this long enough to ensure we don't dereference a workbase
 	 * immediately? Should be unless clock changes 10 minutes so we use
@@ -1125,29 +1672,28 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 			break;
 		if (wb == tmp)
 			continue;
-		if (tmp->readcount)
-			continue;
 		/*  Age old workbases older than 10 minutes old */
 		if (tmp->gentime.tv_sec < wb->gentime.tv_sec - 600) {
 			HASH_DEL(sdata->workbases, tmp);
-			ck_wunlock(&sdata->workbase_lock);
-
-			/* Drop lock to avoid recursive locks */
-			age_share_hashtable(sdata, tmp->id);
-			clear_workbase(ckp, tmp);
-
-			ck_wlock(&sdata->workbase_lock);
+			age_share_hashtable(sdata, tmp->share_gen);
+			tmp->retired_next = aged;
+			aged = tmp;
 		}
 	}
+	__publish_wbtable(sdata);
+	aged = __retire_workbases(sdata, aged);
 	ck_wunlock(&sdata->workbase_lock);
 
+	/* Drop lock to avoid recursive locks */
+	clear_workbases(ckp, aged);
+
 	/* This wb can't be pulled out from under us so no workbase lock is
 	 * required to generate_userwbs */
 	if (ckp->btcsolo)
 		generate_userwbs(sdata, wb);
 
 	if (*new_block)
-		purge_share_hashtable(sdata, wb->id);
+		purge_share_hashtable(sdata, wb->share_gen);
 
 	if (!ckp->passthrough)
 		send_workinfo(ckp, sdata, wb);
@@ -1240,8 +1786,8 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 	DL_FOREACH2(sdata->node_instances, client, node_next) {
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_TRANSACTIONS]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckp->ckmsg_slab);
+		msg = ckslab_alloc(ckp->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1251,8 +1797,8 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_TRANSACTIONS]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckp->ckmsg_slab);
+		msg = ckslab_alloc(ckp->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1598,8 +2144,8 @@ static void downstream_json(sdata_t *sdata, const json_t *val, const int64_t cli
 		if (client->id == client_id)
 			continue;
 		json_msg = json_deep_copy(val);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(sdata->ckp->ckmsg_slab);
+		msg = ckslab_alloc(sdata->ckp->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1813,8 +2359,8 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 			continue;
 		json_msg = json_deep_copy(val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckp->ckmsg_slab);
+		msg = ckslab_alloc(ckp->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1831,8 +2377,8 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 			continue;
 		json_msg = json_deep_copy(val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckp->ckmsg_slab);
+		msg = ckslab_alloc(ckp->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -2002,7 +2548,7 @@ static void add_remote_blockdata(ckpool_t *ckp, json_t *val, const int cblen, co
 	free(buf);
 }
 
-/* Entered with workbase readcount, grabs instance_lock. client_id is where the
+/* Entered with workbase reference, grabs instance_lock. client_id is where the
  * block originated. */
 static void send_nodes_block(sdata_t *sdata, const json_t *block_val, const int64_t client_id)
 {
@@ -2025,8 +2571,8 @@ static void send_nodes_block(sdata_t *sdata, const json_t *block_val, const int6
 			continue;
 		json_msg = json_deep_copy(block_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_BLOCK]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(sdata->ckp->ckmsg_slab);
+		msg = ckslab_alloc(sdata->ckp->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -2043,7 +2589,7 @@ static void send_nodes_block(sdata_t *sdata, const json_t *block_val, const int6
 }
 
 
-/* Entered with workbase readcount. */
+/* Entered with workbase reference. */
 static void send_node_block(ckpool_t *ckp, sdata_t *sdata, const char *enonce1, const char *nonce,
 			    const char *nonce2, const uint32_t ntime32, const uint32_t version_mask,
 			    const int64_t jobid, const double diff, const int64_t client_id,
@@ -2066,7 +2612,7 @@ static void send_node_block(ckpool_t *ckp, sdata_t *sdata, const char *enonce1,
 }
 
 /* Process a block into a message for the generator to submit. Must hold
- * workbase readcount */
+ * workbase reference */
 static char *
 process_block(const workbase_t *wb, const char *coinbase, const int cblen,
 	      const uchar *data, const uchar *hash, uchar *flip32, char *blockhash)
@@ -2137,15 +2683,27 @@ static bool local_block_submit(ckpool_t *ckp, char *gbt_block, const uchar *flip
 	return ret;
 }
 
+/* Look up a workbase without locking. The caller stays in an epoch section
+ * until put_workbase so the workbase can't be cleared from under it. Shares
+ * are nearly always for the newest workbases so search from the end. */
 static workbase_t *get_workbase(sdata_t *sdata, const int64_t id)
 {
-	workbase_t *wb;
+	workbase_t *wb = NULL;
+	wbtable_t *wbtable;
+	int i;
 
-	ck_wlock(&sdata->workbase_lock);
-	HASH_FIND_I64(sdata->workbases, &id, wb);
-	if (wb)
-		wb->readcount++;
-	ck_wunlock(&sdata->workbase_lock);
+	ckepoch_enter();
+	wbtable = __atomic_load_n(&sdata->wbtable, __ATOMIC_ACQUIRE);
+	if (likely(wbtable)) {
+		for (i = wbtable->count - 1; i >= 0; i--) {
+			if (wbtable->wbs[i]->id == id) {
+				wb = wbtable->wbs[i];
+				break;
+			}
+		}
+	}
+	if (!wb)
+		ckepoch_exit();
 
 	return wb;
 }
@@ -2176,15 +2734,18 @@ static workbase_t *get_remote_workbase(sdata_t *sdata, const int64_t id, const i
 	return wb;
 }
 
-static void put_workbase(sdata_t *sdata, workbase_t *wb)
+static void put_workbase(sdata_t __maybe_unused *sdata, workbase_t __maybe_unused *wb)
+{
+	ckepoch_exit();
+}
+
+static void put_remote_workbase(sdata_t *sdata, workbase_t *wb)
 {
 	ck_wlock(&sdata->workbase_lock);
 	wb->readcount--;
 	ck_wunlock(&sdata->workbase_lock);
 }
 
-#define put_remote_workbase(sdata, wb) put_workbase(sdata, wb)
-
 static void block_solve(ckpool_t *ckp, json_t *val);
 static void block_reject(json_t *val);
 
@@ -2386,13 +2947,32 @@ static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *clien
 	sdata->disconnected_generated++;
 }
 
+static void init_instance_shards(sdata_t *sdata)
+{
+	int i;
+
+	for (i = 0; i < INSTANCE_SHARDS; i++)
+		cklock_init(&sdata->instance_shards[i].lock);
+}
+
+static instance_shard_t *instance_shard(sdata_t *sdata, const int64_t id)
+{
+	return &sdata->instance_shards[id & (INSTANCE_SHARDS - 1)];
+}
+
 /* Removes a client instance we know is on the stratum_instances list and from
- * the user client list if it's been placed on it */
+ * the user client list if it's been placed on it. Enter with write
+ * instance_lock held. */
 static void __del_client(sdata_t *sdata, stratum_instance_t *client)
 {
+	instance_shard_t *shard = instance_shard(sdata, client->id);
 	user_instance_t *user = client->user_instance;
 
-	HASH_DEL(sdata->stratum_instances, client);
+	ck_wlock(&shard->lock);
+	HASH_DEL(shard->instances, client);
+	ck_wunlock(&shard->lock);
+	DL_DELETE2(sdata->stratum_instances, client, instance_prev, instance_next);
+	sdata->stratum_count--;
 	if (user) {
 		DL_DELETE2(user->clients, client, user_prev, user_next );
 		__dec_worker(sdata, user, client->worker_instance);
@@ -2408,6 +2988,23 @@ static void connector_drop_client(ckpool_t *ckp, const int64_t id)
 	send_proc(ckp->connector, buf);
 }
 
+/* Tag a client as dropped and return whether it can be removed now, which is
+ * only when nothing holds a reference to it. The shard lock keeps lockless
+ * lookups from taking a new reference between the two. Enter with write
+ * instance_lock held. */
+static bool __tag_dropped(sdata_t *sdata, stratum_instance_t *client)
+{
+	instance_shard_t *shard = instance_shard(sdata, client->id);
+	bool ret;
+
+	ck_wlock(&shard->lock);
+	__atomic_store_n(&client->dropped, true, __ATOMIC_SEQ_CST);
+	ret = !__atomic_load_n(&client->ref, __ATOMIC_SEQ_CST);
+	ck_wunlock(&shard->lock);
+
+	return ret;
+}
+
 static void drop_allclients(ckpool_t *ckp)
 {
 	stratum_instance_t *client, *tmp;
@@ -2415,14 +3012,13 @@ static void drop_allclients(ckpool_t *ckp)
 	int kills = 0;
 
 	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
+	DL_FOREACH_SAFE2(sdata->stratum_instances, client, tmp, instance_next) {
 		int64_t client_id = client->id;
 
-		if (!client->ref) {
+		if (__tag_dropped(sdata, client)) {
 			__del_client(sdata, client);
 			__kill_instance(sdata, client);
-		} else
-			client->dropped = true;
+		}
 		kills++;
 		connector_drop_client(ckp, client_id);
 	}
@@ -2453,6 +3049,8 @@ static sdata_t *duplicate_sdata(const sdata_t *sdata)
 
 	/* Give the sbuproxy its own workbase list and lock */
 	cklock_init(&dsdata->workbase_lock);
+	init_instance_shards(dsdata);
+	init_share_table(dsdata);
 	cksem_init(&dsdata->update_sem);
 	cksem_post(&dsdata->update_sem);
 	return dsdata;
@@ -2707,7 +3305,7 @@ static void reconnect_global_clients(sdata_t *sdata)
 		return;
 
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmpclient) {
+	DL_FOREACH_SAFE2(sdata->stratum_instances, client, tmpclient, instance_next) {
 		if (client->dropped)
 			continue;
 		if (!client->authorised)
@@ -2823,7 +3421,7 @@ static void dead_proxyid(sdata_t *sdata, const int id, const int subid, const bo
 		proxyid = proxy->id;
 
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
+	DL_FOREACH_SAFE2(sdata->stratum_instances, client, tmp, instance_next) {
 		if (client->proxyid != id || client->subproxyid != subid)
 			continue;
 		/* Clients could remain connected to a dead connection here
@@ -2993,7 +3591,7 @@ static void check_userproxies(sdata_t *sdata, proxy_t *proxy, const int userid)
 	int reconnects = 0;
 
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmpclient) {
+	DL_FOREACH_SAFE2(sdata->stratum_instances, client, tmpclient, instance_next) {
 		if (client->dropped)
 			continue;
 		if (!client->authorised)
@@ -3178,7 +3776,7 @@ static void update_diff(ckpool_t *ckp, const char *cmd)
 	/* If the diff has dropped, iterate over all the clients and check
 	 * they're at or below the new diff, and update it if not. */
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
+	DL_FOREACH_SAFE2(sdata->stratum_instances, client, tmp, instance_next) {
 		if (client->proxyid != id)
 			continue;
 		if (client->subproxyid != subid)
@@ -3207,22 +3805,20 @@ static void free_proxy(ckpool_t *ckp, proxy_t *proxy)
 
 	/* Delete any shares in the proxy's hashtable. */
 	if (dsdata) {
-		share_t *share, *tmpshare;
 		workbase_t *wb, *tmpwb;
 
-		mutex_lock(&dsdata->share_lock);
-		HASH_ITER(hh, dsdata->shares, share, tmpshare) {
-			HASH_DEL(dsdata->shares, share);
-			dealloc(share);
-		}
-		mutex_unlock(&dsdata->share_lock);
+		free_share_table(dsdata);
 
-		/* Do we need to check readcount here if freeing the proxy? */
+		/* Do we need to check for readers here if freeing the proxy? */
 		ck_wlock(&dsdata->workbase_lock);
 		HASH_ITER(hh, dsdata->workbases, wb, tmpwb) {
 			HASH_DEL(dsdata->workbases, wb);
 			clear_workbase(ckp, wb);
 		}
+		clear_workbases(ckp, dsdata->retired_workbases);
+		dsdata->retired_workbases = NULL;
+		if (dsdata->wbtable)
+			ckepoch_free(dsdata->wbtable);
 		ck_wunlock(&dsdata->workbase_lock);
 	}
 
@@ -3283,29 +3879,31 @@ static void reap_proxies(ckpool_t *ckp, sdata_t *sdata)
 		LOGINFO("Stratifier discarded %d dead proxies", dead);
 }
 
-/* Enter with instance_lock held */
+/* Enter with instance_lock or the shard lock for id held */
 static stratum_instance_t *__instance_by_id(sdata_t *sdata, const int64_t id)
 {
 	stratum_instance_t *client;
 
-	HASH_FIND_I64(sdata->stratum_instances, &id, client);
+	HASH_FIND_I64(instance_shard(sdata, id)->instances, &id, client);
 	return client;
 }
 
 /* Increase the reference count of instance */
 static void __inc_instance_ref(stratum_instance_t *client)
 {
-	client->ref++;
+	__atomic_add_fetch(&client->ref, 1, __ATOMIC_SEQ_CST);
 }
 
 /* Find an __instance_by_id and increase its reference count allowing us to
  * use this instance outside of instance_lock without fear of it being
- * dereferenced. Does not return dropped clients still on the list. */
+ * dereferenced. Does not return dropped clients still on the list. Only
+ * takes the read lock of the shard the client is in. */
 static inline stratum_instance_t *ref_instance_by_id(sdata_t *sdata, const int64_t id)
 {
+	instance_shard_t *shard = instance_shard(sdata, id);
 	stratum_instance_t *client;
 
-	ck_wlock(&sdata->instance_lock);
+	ck_rlock(&shard->lock);
 	client = __instance_by_id(sdata, id);
 	if (client) {
 		if (unlikely(client->dropped))
@@ -3313,7 +3911,7 @@ static inline stratum_instance_t *ref_instance_by_id(sdata_t *sdata, const int64
 		else
 			__inc_instance_ref(client);
 	}
-	ck_wunlock(&sdata->instance_lock);
+	ck_runlock(&shard->lock);
 
 	return client;
 }
@@ -3351,29 +3949,36 @@ static void __drop_client(sdata_t *sdata, stratum_instance_t *client, bool lazil
 
 static int __dec_instance_ref(stratum_instance_t *client)
 {
-	return --client->ref;
+	return __atomic_sub_fetch(&client->ref, 1, __ATOMIC_SEQ_CST);
 }
 
-/* Decrease the reference count of instance. */
+/* Decrease the reference count of instance, only taking instance_lock when
+ * this was the last reference to a dropped client. */
 static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const char *file,
 			      const char *func, const int line)
 {
 	char_entry_t *entries = NULL;
+	int64_t id = client->id;
 	bool dropped = false;
 	char *msg = NULL;
 	int ref;
 
-	ck_wlock(&sdata->instance_lock);
 	ref = __dec_instance_ref(client);
 	/* See if there are any instances that were dropped that could not be
-	 * moved due to holding a reference and drop them now. */
-	if (unlikely(client->dropped && !ref)) {
-		dropped = true;
-		__drop_client(sdata, client, true, &msg);
-		if (msg)
-			add_msg_entry(&entries, &msg);
+	 * moved due to holding a reference and drop them now. Instances are
+	 * recycled rather than freed, so recheck it's still the same client
+	 * under the lock in case another thread has already dropped it. */
+	if (unlikely(!ref && __atomic_load_n(&client->dropped, __ATOMIC_SEQ_CST))) {
+		ck_wlock(&sdata->instance_lock);
+		if (__instance_by_id(sdata, id) == client && client->dropped &&
+		    !__atomic_load_n(&client->ref, __ATOMIC_SEQ_CST)) {
+			dropped = true;
+			__drop_client(sdata, client, true, &msg);
+			if (msg)
+				add_msg_entry(&entries, &msg);
+		}
+		ck_wunlock(&sdata->instance_lock);
 	}
-	ck_wunlock(&sdata->instance_lock);
 
 	if (entries)
 		notice_msg_entries(&entries);
@@ -3402,12 +4007,15 @@ static stratum_instance_t *__recruit_stratum_instance(sdata_t *sdata)
 	return client;
 }
 
+static int64_t decay_tick(const tv_t *now_t);
+
 /* Enter with write instance_lock held, drops and grabs it again */
 static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, const char *address,
 						  int server)
 {
 	sdata_t *sdata = ckp->sdata;
 	stratum_instance_t *client;
+	instance_shard_t *shard;
 	int64_t pass_id;
 
 	client = __recruit_stratum_instance(sdata);
@@ -3415,6 +4023,7 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 
 	client->start_time = time(NULL);
 	client->id = id;
+	client->cb1ctx_id = -1;
 	client->session_id = ++sdata->session_id;
 	strcpy(client->address, address);
 	/* Sanity check to not overflow lookup in ckp->serverurl[] */
@@ -3429,11 +4038,18 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 	}
 	client->ckp = ckp;
 	tv_time(&client->ldc);
+	/* Hashmeters measure from creation */
+	client->decay_tick = decay_tick(&client->ldc);
 	/* Points to ckp sdata in ckpool mode, but is changed later in proxy
 	 * mode . */
 	client->sdata = sdata;
 	if ((pass_id = subclient(id))) {
-		stratum_instance_t *remote = __instance_by_id(sdata, pass_id);
+		instance_shard_t *shard = instance_shard(sdata, pass_id);
+		stratum_instance_t *remote;
+
+		ck_rlock(&shard->lock);
+		remote = __instance_by_id(sdata, pass_id);
+		ck_runlock(&shard->lock);
 
 		id &= 0xffffffffll;
 		if (remote && remote->node) {
@@ -3456,7 +4072,12 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 	}
 
 	ck_wlock(&sdata->instance_lock);
-	HASH_ADD_I64(sdata->stratum_instances, id, client);
+	shard = instance_shard(sdata, client->id);
+	ck_wlock(&shard->lock);
+	HASH_ADD_I64(shard->instances, id, client);
+	ck_wunlock(&shard->lock);
+	DL_APPEND2(sdata->stratum_instances, client, instance_prev, instance_next);
+	sdata->stratum_count++;
 	return client;
 }
 
@@ -3505,31 +4126,92 @@ static void connector_test_client(ckpool_t *ckp, const int64_t id)
 	send_proc(ckp->connector, buf);
 }
 
-/* For creating a list of sends without locking that can then be concatenated
- * to the stratum_sends list. Minimises locking and avoids taking recursive
- * locks. Sends only to sdata bound clients (everyone in ckpool) */
-static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
+/* Queue one message sending val to every client in client_ids */
+static void queue_broadcast(ckpool_t *ckp, ckmsgq_t *ckmsgq, json_t *val, int64_t *client_ids,
+			    const int clients)
 {
-	ckpool_t *ckp = sdata->ckp;
-	sdata_t *ckp_sdata = ckp->sdata;
-	stratum_instance_t *client, *tmp;
-	ckmsg_t *bulk_send = NULL;
-	int messages = 0;
+	smsg_t *msg = ckslab_alloc(ckp->smsg_slab);
 
-	if (unlikely(!val)) {
-		LOGERR("Sent null json to stratum_broadcast");
-		return;
-	}
+	msg->bcast = connector_new_broadcast(val, client_ids, clients);
+	ckmsgq_add(ckmsgq, msg);
+}
+
+/* Queue a json message serialised once for a list of client ids, taking
+ * ownership of val and client_ids. With clientaffinity the list is split so
+ * each client's copy goes through the same send queue as its other messages
+ * and stays in order with them. */
+static void stratum_broadcast_ids(sdata_t *sdata, json_t *val, int64_t *client_ids,
+				  const int clients)
+{
+	ckpool_t *ckp = sdata->ckp;
+	int64_t **shard_ids;
+	int *shard_clients;
+	int i, j;
 
 	if (ckp->node) {
 		json_decref(val);
+		free(client_ids);
+		return;
+	}
+	if (!ckp->clientaffinity) {
+		queue_broadcast(ckp, sdata->ssends, val, client_ids, clients);
 		return;
 	}
 
-	ck_rlock(&ckp_sdata->instance_lock);
-	HASH_ITER(hh, ckp_sdata->stratum_instances, client, tmp) {
+	shard_ids = ckzalloc(sizeof(int64_t *) * ckp->stratifierthreads);
+	shard_clients = ckzalloc(sizeof(int) * ckp->stratifierthreads);
+	for (j = 0; j < clients; j++)
+		shard_clients[client_shard(ckp, client_ids[j])]++;
+	for (i = 0; i < ckp->stratifierthreads; i++) {
+		if (shard_clients[i])
+			shard_ids[i] = ckalloc(sizeof(int64_t) * shard_clients[i]);
+		shard_clients[i] = 0;
+	}
+	for (j = 0; j < clients; j++) {
+		i = client_shard(ckp, client_ids[j]);
+		shard_ids[i][shard_clients[i]++] = client_ids[j];
+	}
+	for (i = 0; i < ckp->stratifierthreads; i++) {
+		if (!shard_clients[i])
+			continue;
+		json_incref(val);
+		queue_broadcast(ckp, &sdata->ssends[i], val, shard_ids[i], shard_clients[i]);
+	}
+	json_decref(val);
+	free(shard_clients);
+	free(shard_ids);
+	free(client_ids);
+}
+
+/* Broadcast a message to all active clients bound to sdata (everyone in
+ * ckpool). Passthrough subclients need their own copy tagged with node.method
+ * but all other clients share the one serialised message. */
+static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
+{
+	ckpool_t *ckp = sdata->ckp;
+	sdata_t *ckp_sdata = ckp->sdata;
+	stratum_instance_t *client, *tmp;
+	int messages = 0, clients = 0, ids_size;
+	ckmsg_t *bulk_send = NULL;
+	int64_t *client_ids;
+
+	if (unlikely(!val)) {
+		LOGERR("Sent null json to stratum_broadcast");
+		return;
+	}
+
+	if (ckp->node) {
+		json_decref(val);
+		return;
+	}
+
+	ck_rlock(&ckp_sdata->instance_lock);
+	ids_size = ckp_sdata->stratum_count ? : 1;
+	client_ids = ckalloc(sizeof(int64_t) * ids_size);
+	DL_FOREACH_SAFE2(ckp_sdata->stratum_instances, client, tmp, instance_next) {
 		ckmsg_t *client_msg;
 		smsg_t *msg;
+		json_t *json_msg;
 
 		if (sdata != ckp_sdata && client->sdata != sdata)
 			continue;
@@ -3541,11 +4223,15 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 		if (msg_type == SM_MSG && !client->messages)
 			continue;
 
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
-		if (subclient(client->id))
-			json_set_string(val, "node.method", stratum_msgs[msg_type]);
-		msg->json_msg = json_deep_copy(val);
+		if (likely(!subclient(client->id))) {
+			client_ids[clients++] = client->id;
+			continue;
+		}
+		json_msg = json_deep_copy(val);
+		json_set_string(json_msg, "node.method", stratum_msgs[msg_type]);
+		client_msg = ckslab_alloc(ckp->ckmsg_slab);
+		msg = ckslab_alloc(ckp->smsg_slab);
+		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
@@ -3553,10 +4239,14 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 	}
 	ck_runlock(&ckp_sdata->instance_lock);
 
-	json_decref(val);
-
 	if (likely(bulk_send))
 		ssend_bulk_append(sdata, bulk_send, messages);
+	if (likely(clients))
+		stratum_broadcast_ids(sdata, val, client_ids, clients);
+	else {
+		json_decref(val);
+		free(client_ids);
+	}
 }
 
 static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
@@ -3587,13 +4277,13 @@ static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_i
 		dec_instance_ref(sdata, remote);
 	}
 	LOGDEBUG("Sending stratum message %s", stratum_msgs[msg_type]);
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = ckslab_alloc(sdata->ckp->smsg_slab);
 	msg->json_msg = val;
 	msg->client_id = client_id;
-	if (likely(ckmsgq_add(sdata->ssends, msg)))
+	if (likely(ckmsgq_add(client_ckmsgq(sdata->ckp, sdata->ssends, client_id), msg)))
 		return;
 	json_decref(msg->json_msg);
-	free(msg);
+	ckslab_free(sdata->ckp->smsg_slab, msg);
 }
 
 static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
@@ -3610,12 +4300,11 @@ static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
 		__disconnect_session(sdata, client);
 		/* If the client is still holding a reference, don't drop them
 		 * now but wait till the reference is dropped */
-		if (!client->ref) {
+		if (__tag_dropped(sdata, client)) {
 			__drop_client(sdata, client, false, &msg);
 			if (msg)
 				add_msg_entry(&entries, &msg);
-		} else
-			client->dropped = true;
+		}
 	}
 	ck_wunlock(&sdata->instance_lock);
 
@@ -3655,7 +4344,7 @@ static void request_reconnect(sdata_t *sdata, const char *cmd)
 	/* Tag all existing clients as dropped now so they can be removed
 	 * lazily */
 	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
+	DL_FOREACH_SAFE2(sdata->stratum_instances, client, tmp, instance_next) {
 		client->dropped = true;
 	}
 	ck_wunlock(&sdata->instance_lock);
@@ -3673,7 +4362,7 @@ static void reset_bestshares(sdata_t *sdata)
 	sdata->stats.best_diff = 0;
 
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
+	DL_FOREACH_SAFE2(sdata->stratum_instances, client, tmp, instance_next) {
 		client->best_diff = 0;
 	}
 	HASH_ITER(hh, sdata->user_instances, user, tmpuser) {
@@ -3702,13 +4391,98 @@ static user_instance_t *user_by_workername(sdata_t *sdata, const char *workernam
 	return user;
 }
 
+/* Shares only add their diff to uadiff and the hashmeters are folded lazily
+ * when read or by statsupdate, in whole ticks so the decay proportions for
+ * all but long idle periods can be looked up instead of calling exp(). */
+#define DECAY_TICK_MS 250
+#define DECAY_TICKS 512
+#define DECAY_WINDOWS 5
+
+static const double decay_intervals[DECAY_WINDOWS] = { MIN1, MIN5, HOUR, DAY, WEEK };
+static double decay_props[DECAY_WINDOWS][DECAY_TICKS];
+
+static void init_decay_props(void)
+{
+	int i, j;
+
+	for (i = 0; i < DECAY_WINDOWS; i++) {
+		for (j = 0; j < DECAY_TICKS; j++) {
+			double dexp = (double)j * DECAY_TICK_MS / 1000 / decay_intervals[i];
+
+			if (dexp > 36)
+				dexp = 36;
+			decay_props[i][j] = 1.0 - 1 / exp(dexp);
+		}
+	}
+}
+
+static int64_t decay_tick(const tv_t *now_t)
+{
+	return now_t->tv_sec * (1000 / DECAY_TICK_MS) + now_t->tv_usec / (DECAY_TICK_MS * 1000);
+}
+
+/* Fold the diff accumulated in uadiff into the hashmeters dsps for the ticks
+ * elapsed since they were last folded. Only the thread that claims the
+ * elapsed ticks folds them. */
+static void decay_meter(int64_t *uadiff, int64_t *last_tick, double *dsps[DECAY_WINDOWS],
+			const tv_t *now_t)
+{
+	int64_t tick = decay_tick(now_t), last, ticks;
+	double diff, fsecs;
+	int i;
+
+	last = __atomic_load_n(last_tick, __ATOMIC_RELAXED);
+	ticks = tick - last;
+	if (ticks <= 0)
+		return;
+	if (!__atomic_compare_exchange_n(last_tick, &last, tick, false, __ATOMIC_RELAXED,
+					 __ATOMIC_RELAXED))
+		return;
+	diff = __atomic_exchange_n(uadiff, 0, __ATOMIC_RELAXED);
+	fsecs = (double)ticks * DECAY_TICK_MS / 1000;
+	for (i = 0; i < DECAY_WINDOWS; i++) {
+		if (likely(ticks < DECAY_TICKS))
+			decay_prop(dsps[i], diff, fsecs, decay_props[i][ticks]);
+		else
+			decay_time(dsps[i], diff, fsecs, decay_intervals[i]);
+	}
+}
+
+static void decay_client(stratum_instance_t *client, const tv_t *now_t)
+{
+	double *dsps[DECAY_WINDOWS] = { &client->dsps1, &client->dsps5, &client->dsps60,
+					&client->dsps1440, &client->dsps10080 };
+
+	decay_meter(&client->uadiff, &client->decay_tick, dsps, now_t);
+}
+
+static void decay_worker(worker_instance_t *worker, const tv_t *now_t)
+{
+	double *dsps[DECAY_WINDOWS] = { &worker->dsps1, &worker->dsps5, &worker->dsps60,
+					&worker->dsps1440, &worker->dsps10080 };
+
+	decay_meter(&worker->uadiff, &worker->decay_tick, dsps, now_t);
+}
+
+static void decay_user(user_instance_t *user, const tv_t *now_t)
+{
+	double *dsps[DECAY_WINDOWS] = { &user->dsps1, &user->dsps5, &user->dsps60,
+					&user->dsps1440, &user->dsps10080 };
+
+	decay_meter(&user->uadiff, &user->decay_tick, dsps, now_t);
+}
+
 static worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, const char *workername);
 
-static json_t *worker_stats(const worker_instance_t *worker)
+static json_t *worker_stats(worker_instance_t *worker)
 {
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
 	json_t *val;
 	double ghs;
+	tv_t now;
+
+	tv_time(&now);
+	decay_worker(worker, &now);
 
 	ghs = worker->dsps1 * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
@@ -3734,11 +4508,15 @@ static json_t *worker_stats(const worker_instance_t *worker)
 	return val;
 }
 
-static json_t *user_stats(const user_instance_t *user)
+static json_t *user_stats(user_instance_t *user)
 {
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
 	json_t *val;
 	double ghs;
+	tv_t now;
+
+	tv_time(&now);
+	decay_user(user, &now);
 
 	ghs = user->dsps1 * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
@@ -3761,7 +4539,7 @@ static json_t *user_stats(const user_instance_t *user)
 			"hashrate1hr", suffix60,
 			"hashrate1d", suffix1440,
 			"hashrate7d", suffix10080,
-			"shares", user->shares,
+			"shares", __atomic_load_n(&user->shares, __ATOMIC_RELAXED),
 			"authorised", user->auth_time);
 	return val;
 }
@@ -3879,18 +4657,18 @@ static void broadcast_ping(sdata_t *sdata)
 	stratum_broadcast(sdata, json_msg, SM_PING);
 }
 
-static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
+/* Queues is how many separate queues there are in the ckmsgq array */
+static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int queues, const int size, json_t **val)
 {
-	int64_t memsize, generated;
-	ckmsg_t *msg;
-	int objects;
+	int64_t memsize, generated = 0;
+	int objects = 0, i;
 
-	mutex_lock(ckmsgq->lock);
-	DL_COUNT(ckmsgq->msgs, msg, objects);
-	generated = ckmsgq->messages;
-	mutex_unlock(ckmsgq->lock);
+	for (i = 0; i < queues; i++) {
+		objects += ckmsgq_queued(&ckmsgq[i]);
+		generated += __atomic_load_n(&ckmsgq[i].ring->messages, __ATOMIC_RELAXED);
+	}
 
-	memsize = (sizeof(ckmsg_t) + size) * objects;
+	memsize = sizeof(ckmsgcell_t) * CKMSGQ_RING * queues + size * objects;
 	JSON_CPACK(*val, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 }
 
@@ -3899,7 +4677,7 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_t *val = json_object(), *subval;
 	int64_t memsize, generated;
 	sdata_t *sdata = data;
-	int objects;
+	int objects, queues, i;
 	char *buf;
 
 	ck_rlock(&sdata->workbase_lock);
@@ -3937,8 +4715,10 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	JSON_CPACK(subval, "{si,si}", "count", objects, "memory", memsize);
 	json_set_object(val, "users", subval);
 
-	objects = HASH_COUNT(sdata->stratum_instances);
-	memsize = SAFE_HASH_OVERHEAD(sdata->stratum_instances);
+	objects = sdata->stratum_count;
+	memsize = 0;
+	for (i = 0; i < INSTANCE_SHARDS; i++)
+		memsize += SAFE_HASH_OVERHEAD(sdata->instance_shards[i].instances);
 	generated = sdata->stratum_generated;
 	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "clients", subval);
@@ -3951,11 +4731,21 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_set_object(val, "disconnected", subval);
 	ck_runlock(&sdata->instance_lock);
 
-	mutex_lock(&sdata->share_lock);
-	generated = sdata->shares_generated;
-	objects = HASH_COUNT(sdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(sdata->shares) + sizeof(share_t) * objects;
-	mutex_unlock(&sdata->share_lock);
+	generated = __atomic_load_n(&sdata->shares_generated, __ATOMIC_RELAXED);
+	objects = memsize = 0;
+	for (i = 0; i < SHARE_GENS; i++) {
+		share_gen_t *sg = &sdata->share_gens[i];
+
+		if (__atomic_load_n(&sg->gen, __ATOMIC_ACQUIRE))
+			objects += __atomic_load_n(&sg->shares, __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < SHARE_STRIPES; i++) {
+		share_stripe_t *stripe = &sdata->share_stripes[i];
+
+		mutex_lock(&stripe->lock);
+		memsize += sizeof(share_t) * stripe->size;
+		mutex_unlock(&stripe->lock);
+	}
 
 	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "shares", subval);
@@ -3968,14 +4758,27 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_set_object(val, "transactions", subval);
 	ck_runlock(&sdata->txn_lock);
 
-	ckmsgq_stats(sdata->ssends, sizeof(smsg_t), &subval);
+	queues = ckp->clientaffinity ? ckp->stratifierthreads : 1;
+	ckmsgq_stats(sdata->ssends, queues, sizeof(smsg_t), &subval);
 	json_set_object(val, "ssends", subval);
 	/* Don't know exactly how big the string is so just count the pointer for now */
-	ckmsgq_stats(sdata->srecvs, sizeof(char *), &subval);
+	ckmsgq_stats(sdata->srecvs, queues, sizeof(cmsg_t), &subval);
 	json_set_object(val, "srecvs", subval);
-	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval);
+	ckmsgq_stats(sdata->stxnq, 1, sizeof(json_params_t), &subval);
 	json_set_object(val, "stxnq", subval);
 
+	ckslab_stats(ckp->ckmsg_slab, &subval);
+	json_set_object(val, "ckmsgs", subval);
+	ckslab_stats(ckp->smsg_slab, &subval);
+	json_set_object(val, "smsgs", subval);
+	ckslab_stats(cmsg_slab, &subval);
+	json_set_object(val, "cmsgs", subval);
+	ckslab_stats(jp_slab, &subval);
+	json_set_object(val, "jsonparams", subval);
+
+	JSON_CPACK(subval, "{ss,si}", "backend", sha256_backend(), "lanes", sha256_mb_lanes());
+	json_set_object(val, "sha256", subval);
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	LOGNOTICE("Stratifier stats: %s", buf);
@@ -4035,9 +4838,13 @@ static void reconnect_client_id(sdata_t *sdata, const int64_t client_id)
 
 /* API commands */
 
-static json_t *userinfo(const user_instance_t *user)
+static json_t *userinfo(user_instance_t *user)
 {
 	json_t *val;
+	tv_t now;
+
+	tv_time(&now);
+	decay_user(user, &now);
 
 	JSON_CPACK(val, "{ss,si,si,sf,sf,sf,sf,sf,sf,si}",
 		   "user", user->username, "id", user->id, "workers", user->workers,
@@ -4156,9 +4963,13 @@ out:
 	send_api_response(res, *sockd);
 }
 
-static json_t *workerinfo(const user_instance_t *user, const worker_instance_t *worker)
+static json_t *workerinfo(const user_instance_t *user, worker_instance_t *worker)
 {
 	json_t *val;
+	tv_t now;
+
+	tv_time(&now);
+	decay_worker(worker, &now);
 
 	JSON_CPACK(val, "{ss,ss,si,sf,sf,sf,sf,si,sf,si,sb}",
 		   "user", user->username, "worker", worker->workername, "id", user->id,
@@ -4238,9 +5049,13 @@ static void getusers(sdata_t *sdata, int *sockd)
 	send_api_response(val, *sockd);
 }
 
-static json_t *clientinfo(const stratum_instance_t *client)
+static json_t *clientinfo(stratum_instance_t *client)
 {
 	json_t *val = json_object();
+	tv_t now;
+
+	tv_time(&now);
+	decay_client(client, &now);
 
 	/* Too many fields for a pack object, do each discretely to keep track */
 	json_set_int(val, "id", client->id);
@@ -4308,7 +5123,7 @@ static void getclients(sdata_t *sdata, int *sockd)
 	client_arr = json_array();
 
 	ck_rlock(&sdata->instance_lock);
-	for (client = sdata->stratum_instances; client; client = client->hh.next) {
+	DL_FOREACH2(sdata->stratum_instances, client, instance_next) {
 		json_array_append_new(client_arr, clientinfo(client));
 	}
 	ck_runlock(&sdata->instance_lock);
@@ -4588,7 +5403,7 @@ retry:
 
 		/* This is a message for a node */
 		if (likely(val))
-			ckmsgq_add(sdata->srecvs, val);
+			stratifier_add_recv(ckp, val);
 		goto retry;
 	}
 	if (cmdmatch(buf, "ping")) {
@@ -4741,9 +5556,30 @@ static void *blockupdate(void *arg)
 	return NULL;
 }
 
+static bool cb1ctx_trylock(stratum_instance_t *client)
+{
+	uint32_t seq = __atomic_load_n(&client->cb1seq, __ATOMIC_RELAXED);
+
+	if (seq & 1)
+		return false;
+	return __atomic_compare_exchange_n(&client->cb1seq, &seq, seq + 1, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void cb1ctx_unlock(stratum_instance_t *client)
+{
+	__atomic_add_fetch(&client->cb1seq, 1, __ATOMIC_RELEASE);
+}
+
 /* Enter holding workbase_lock and client a ref count. */
 static void __fill_enonce1data(const workbase_t *wb, stratum_instance_t *client)
 {
+	/* Invalidate any coinbase midstate built from the old enonce1 */
+	while (!cb1ctx_trylock(client))
+		;
+	client->cb1ctx_id = -1;
+	cb1ctx_unlock(client);
+
 	if (wb->enonce1constlen)
 		memcpy(client->enonce1bin, wb->enonce1constbin, wb->enonce1constlen);
 	if (wb->enonce1varlen) {
@@ -5093,64 +5929,6 @@ static double dsps_from_key(json_t *val, const char *key)
 	return ret;
 }
 
-static void decay_client(stratum_instance_t *client, double diff, tv_t *now_t)
-{
-	double tdiff = sane_tdiff(now_t, &client->last_decay);
-
-	/* If we're calling the hashmeter too frequently we'll just end up
-	 * racing and having inappropriate values, so store up diff and update
-	 * at most 20 times per second. Use an integer for uadiff to make the
-	 * update atomic */
-	if (tdiff < 0.05) {
-		client->uadiff += diff;
-		return;
-	}
-	copy_tv(&client->last_decay, now_t);
-	diff += client->uadiff;
-	client->uadiff = 0;
-	decay_time(&client->dsps1, diff, tdiff, MIN1);
-	decay_time(&client->dsps5, diff, tdiff, MIN5);
-	decay_time(&client->dsps60, diff, tdiff, HOUR);
-	decay_time(&client->dsps1440, diff, tdiff, DAY);
-	decay_time(&client->dsps10080, diff, tdiff, WEEK);
-}
-
-static void decay_worker(worker_instance_t *worker, double diff, tv_t *now_t)
-{
-	double tdiff = sane_tdiff(now_t, &worker->last_decay);
-
-	if (tdiff < 0.05) {
-		worker->uadiff += diff;
-		return;
-	}
-	copy_tv(&worker->last_decay, now_t);
-	diff += worker->uadiff;
-	worker->uadiff = 0;
-	decay_time(&worker->dsps1, diff, tdiff, MIN1);
-	decay_time(&worker->dsps5, diff, tdiff, MIN5);
-	decay_time(&worker->dsps60, diff, tdiff, HOUR);
-	decay_time(&worker->dsps1440, diff, tdiff, DAY);
-	decay_time(&worker->dsps10080, diff, tdiff, WEEK);
-}
-
-static void decay_user(user_instance_t *user, double diff, tv_t *now_t)
-{
-	double tdiff = sane_tdiff(now_t, &user->last_decay);
-
-	if (tdiff < 0.05) {
-		user->uadiff += diff;
-		return;
-	}
-	copy_tv(&user->last_decay, now_t);
-	diff += user->uadiff;
-	user->uadiff = 0;
-	decay_time(&user->dsps1, diff, tdiff, MIN1);
-	decay_time(&user->dsps5, diff, tdiff, MIN5);
-	decay_time(&user->dsps60, diff, tdiff, HOUR);
-	decay_time(&user->dsps1440, diff, tdiff, DAY);
-	decay_time(&user->dsps10080, diff, tdiff, WEEK);
-}
-
 static user_instance_t *get_create_user(sdata_t *sdata, const char *username, bool *new_user);
 static worker_instance_t *get_create_worker(sdata_t *sdata, user_instance_t *user,
 					    const char *workername, bool *new_worker);
@@ -5229,7 +6007,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 		dealloc(buf);
 
 		copy_tv(&user->last_share, &now);
-		copy_tv(&user->last_decay, &now);
+		user->decay_tick = decay_tick(&now);
 		user->dsps1 = dsps_from_key(val, "hashrate1m");
 		user->dsps5 = dsps_from_key(val, "hashrate5m");
 		user->dsps60 = dsps_from_key(val, "hashrate1hr");
@@ -5248,7 +6026,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 			user->dsps1, user->dsps5, user->dsps60, user->dsps1440,
 			user->dsps10080, user->best_diff, user->best_ever, user->auth_time);
 		if (tvsec_diff > 60)
-			decay_user(user, 0, &now);
+			decay_user(user, &now);
 
 		worker_array = json_object_get(val, "worker");
 		json_array_foreach(worker_array, index, arr_val) {
@@ -5267,7 +6045,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 				continue;
 			}
 			workers++;
-			copy_tv(&worker->last_decay, &now);
+			worker->decay_tick = decay_tick(&now);
 			worker->dsps1 = dsps_from_key(arr_val, "hashrate1m");
 			worker->dsps5 = dsps_from_key(arr_val, "hashrate5m");
 			worker->dsps60 = dsps_from_key(arr_val, "hashrate1hr");
@@ -5283,7 +6061,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 			LOGINFO("Successfully read worker %s stats %f %f %f %f %f %ld", worker->workername,
 				worker->dsps1, worker->dsps5, worker->dsps60, worker->dsps1440, worker->best_diff, worker->best_ever);
 			if (tvsec_diff > 60)
-				decay_worker(worker, 0, &now);
+				decay_worker(worker, &now);
 		}
 		json_decref(val);
 	}
@@ -5298,7 +6076,10 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 static user_instance_t *__create_user(sdata_t *sdata, const char *username)
 {
 	user_instance_t *user = ckzalloc(sizeof(user_instance_t));
+	tv_t now;
 
+	tv_time(&now);
+	user->decay_tick = decay_tick(&now);
 	user->auth_backoff = DEFAULT_AUTH_BACKOFF;
 	strcpy(user->username, username);
 	user->id = ++sdata->user_instance_id;
@@ -5333,7 +6114,10 @@ static user_instance_t *get_user(sdata_t *sdata, const char *username)
 static worker_instance_t *__create_worker(user_instance_t *user, const char *workername)
 {
 	worker_instance_t *worker = ckzalloc(sizeof(worker_instance_t));
+	tv_t now;
 
+	tv_time(&now);
+	worker->decay_tick = decay_tick(&now);
 	worker->workername = strdup(workername);
 	worker->user_instance = user;
 	DL_APPEND(user->worker_instances, worker);
@@ -5574,20 +6358,17 @@ out:
 		workbase_t *wb;
 
 		/* To avoid grabbing recursive lock */
-		ck_wlock(&sdata->workbase_lock);
+		ckepoch_enter();
+		ck_rlock(&sdata->workbase_lock);
 		wb = sdata->current_workbase;
-		wb->readcount++;
-		ck_wunlock(&sdata->workbase_lock);
+		ck_runlock(&sdata->workbase_lock);
 
 		ck_wlock(&sdata->instance_lock);
 		__generate_userwb(sdata, wb, user);
 		ck_wunlock(&sdata->instance_lock);
 
 		update_solo_client(sdata, wb, client->id, user);
-
-		ck_wlock(&sdata->workbase_lock);
-		wb->readcount--;
-		ck_wunlock(&sdata->workbase_lock);
+		ckepoch_exit();
 
 		stratum_send_diff(sdata, client);
 	}
@@ -5617,6 +6398,46 @@ static void stratum_send_message(sdata_t *sdata, const stratum_instance_t *clien
 	stratum_add_send(sdata, json_msg, client->id, SM_MSG);
 }
 
+static __thread share_counters_t *thread_share_counters;
+
+/* Get this thread's share counters, adding them to the list statsupdate
+ * walks the first time the thread counts a share. */
+static share_counters_t *get_share_counters(sdata_t *sdata)
+{
+	share_counters_t *counters = thread_share_counters;
+
+	if (unlikely(!counters)) {
+		if (unlikely(posix_memalign((void **)&counters, 64, sizeof(share_counters_t))))
+			quit(1, "Failed to posix_memalign share counters");
+		memset(counters, 0, sizeof(share_counters_t));
+		counters->next = __atomic_load_n(&sdata->share_counters, __ATOMIC_ACQUIRE);
+		while (!__atomic_compare_exchange_n(&sdata->share_counters, &counters->next, counters,
+						    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			;
+		thread_share_counters = counters;
+	}
+	return counters;
+}
+
+/* Only the owning thread writes its counters so a plain load and store
+ * suffices, made atomic so statsupdate never reads a torn value. */
+static inline void inc_share_counter(int64_t *counter, const int64_t val)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + val,
+			 __ATOMIC_RELAXED);
+}
+
+static void count_share(sdata_t *sdata, const double diff, const bool valid)
+{
+	share_counters_t *counters = get_share_counters(sdata);
+
+	if (valid) {
+		inc_share_counter(&counters->shares, 1);
+		inc_share_counter(&counters->diff_shares, diff);
+	} else
+		inc_share_counter(&counters->rejects, diff);
+}
+
 static double time_bias(const double tdiff, const double period)
 {
 	double dexp = tdiff / period;
@@ -5635,47 +6456,36 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 	worker_instance_t *worker = client->worker_instance;
 	double tdiff, bdiff, dsps, drr, network_diff, bias;
 	user_instance_t *user = client->user_instance;
-	int64_t next_blockid, optimal, mindiff;
+	int64_t optimal, mindiff;
+	ts_t now_ts;
 	tv_t now_t;
 
-	mutex_lock(&ckp_sdata->uastats_lock);
-	if (valid) {
-		ckp_sdata->stats.unaccounted_shares++;
-		ckp_sdata->stats.unaccounted_diff_shares += diff;
-	} else
-		ckp_sdata->stats.unaccounted_rejects += diff;
-	mutex_unlock(&ckp_sdata->uastats_lock);
+	count_share(ckp_sdata, diff, valid);
 
 	/* Count only accepted and stale rejects in diff calculation. */
 	if (valid) {
-		worker->shares += diff;
-		user->shares += diff;
+		__atomic_add_fetch(&worker->shares, (int64_t)diff, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&user->shares, (int64_t)diff, __ATOMIC_RELAXED);
 	} else if (!submit)
 		return;
 
-	tv_time(&now_t);
-
-	ck_rlock(&sdata->workbase_lock);
-	next_blockid = sdata->workbase_id + 1;
-	if (ckp->proxy)
-		network_diff = sdata->current_workbase->diff;
-	else
-		network_diff = sdata->current_workbase->network_diff;
-	ck_runlock(&sdata->workbase_lock);
+	ts_realtime_coarse(&now_ts);
+	ts_to_tv(&now_t, &now_ts);
 
 	if (unlikely(!client->first_share.tv_sec)) {
 		copy_tv(&client->first_share, &now_t);
 		copy_tv(&client->ldc, &now_t);
 	}
 
-	decay_client(client, diff, &now_t);
+	/* The hashmeters are folded lazily when read */
+	__atomic_add_fetch(&client->uadiff, (int64_t)diff, __ATOMIC_RELAXED);
 	copy_tv(&client->last_share, &now_t);
 
-	decay_worker(worker, diff, &now_t);
+	__atomic_add_fetch(&worker->uadiff, (int64_t)diff, __ATOMIC_RELAXED);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	__atomic_add_fetch(&user->uadiff, (int64_t)diff, __ATOMIC_RELAXED);
 	copy_tv(&user->last_share, &now_t);
 	client->idle = false;
 
@@ -5685,8 +6495,6 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		return;
 
 	client->ssdc++;
-	bdiff = sane_tdiff(&now_t, &client->first_share);
-	bias = time_bias(bdiff, 300);
 	tdiff = sane_tdiff(&now_t, &client->ldc);
 
 	/* Check the difficulty every 240 seconds or as many shares as we
@@ -5699,6 +6507,10 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		return;
 	}
 
+	decay_client(client, &now_t);
+	bdiff = sane_tdiff(&now_t, &client->first_share);
+	bias = time_bias(bdiff, 300);
+
 	/* Diff rate ratio */
 	dsps = client->dsps5 / bias;
 	drr = dsps / (double)client->diff;
@@ -5721,6 +6533,7 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		optimal = lround(dsps * 3.33);
 
 	/* Clamp to mindiff ~ network_diff */
+	__atomic_load(&sdata->current_diff, &network_diff, __ATOMIC_ACQUIRE);
 
 	/* Set to higher of pool mindiff and optimal */
 	optimal = MAX(optimal, ckp->mindiff);
@@ -5755,7 +6568,7 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		client->identity, dsps, client->dsps5, drr, client->diff, optimal);
 
 	copy_tv(&client->ldc, &now_t);
-	client->diff_change_job_id = next_blockid;
+	client->diff_change_job_id = __atomic_load_n(&sdata->workbase_id, __ATOMIC_RELAXED) + 1;
 	client->old_diff = client->diff;
 	client->diff = optimal;
 	stratum_send_diff(sdata, client);
@@ -5774,7 +6587,7 @@ downstream_block(ckpool_t *ckp, sdata_t *sdata, const json_t *val, const int cbl
 	json_decref(block_val);
 }
 
-/* We should already be holding a wb readcount. Needs to be entered with
+/* We should already be holding a workbase reference. Needs to be entered with
  * client holding a ref count. */
 static void
 test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uchar *data,
@@ -5870,25 +6683,53 @@ out_nouserwb:
 	return wb->coinb2bin;
 }
 
-/* Needs to be entered with workbase readcount and client holding a ref count. */
-static double submission_diff(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
-			      const char *nonce2, const uint32_t ntime32, uint32_t version_mask,
-			      const char *nonce, uchar *hash, const bool stale)
+/* Get the sha256 context over the coinb1 + enonce1 prefix of the coinbase,
+ * from the client's cached midstate which is constant for any one workbase.
+ * The cache is keyed by workbase id, and ids are never reused, so it is
+ * implicitly invalidated when the workbase retires. */
+static void coinbase_midstate(stratum_instance_t *client, const workbase_t *wb,
+			      const uchar *coinbase, const int prefixlen, sha256_ctx *ctx)
+{
+	bool cached = false;
+	uint32_t seq;
+	int64_t id;
+
+	seq = __atomic_load_n(&client->cb1seq, __ATOMIC_ACQUIRE);
+	if (likely(!(seq & 1))) {
+		id = client->cb1ctx_id;
+		memcpy(ctx, &client->cb1ctx, sizeof(sha256_ctx));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		cached = id == wb->id && __atomic_load_n(&client->cb1seq, __ATOMIC_RELAXED) == seq;
+	}
+	if (unlikely(!cached)) {
+		sha256_init(ctx);
+		sha256_update(ctx, coinbase, prefixlen);
+		/* Don't wait on another share thread filling it in */
+		if (cb1ctx_trylock(client)) {
+			memcpy(&client->cb1ctx, ctx, sizeof(sha256_ctx));
+			client->cb1ctx_id = wb->id;
+			cb1ctx_unlock(client);
+		}
+	}
+}
+
+/* Build the coinbase for a share into coinbase, which needs room for
+ * share_cblen(wb) bytes, returning its length and the length of the constant
+ * coinb1 + enonce1 prefix in prefixlen. */
+#define share_cblen(wb) ((wb)->coinb1len + (wb)->enonce1constlen + (wb)->enonce1varlen + \
+	(wb)->enonce2varlen + (wb)->coinb2len + 26 + (wb)->coinb3len)
+
+static int share_coinbase(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
+			  const char *nonce2, char *coinbase, int *prefixlen)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32, benonce32;
-	char *coinbase, data[80];
-	uchar swap[80], hash1[32];
-	int cblen, i, cb2len;
 	uchar *coinb2bin;
-	double ret;
+	int cblen, cb2len;
 
-	/* Leave enough room for 25 byte generation address + length counter */
-	coinbase = alloca(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len + 26 + wb->coinb3len);
 	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
 	cblen = wb->coinb1len;
 	memcpy(coinbase + cblen, &client->enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
 	cblen += wb->enonce1constlen + wb->enonce1varlen;
+	*prefixlen = cblen;
 	hex2bin(coinbase + cblen, nonce2, wb->enonce2varlen);
 	cblen += wb->enonce2varlen;
 
@@ -5897,15 +6738,17 @@ static double submission_diff(sdata_t *sdata, const stratum_instance_t *client,
 	memcpy(coinbase + cblen, coinb2bin, cb2len);
 	ck_runlock(&sdata->instance_lock);
 
-	cblen += cb2len;
+	return cblen + cb2len;
+}
+
+/* Build the flipped header to hash for a share from its final merkle root */
+static void share_header(const workbase_t *wb, const uchar *merkle_sha, const uint32_t ntime32,
+			 uint32_t version_mask, const char *nonce, uchar *swap)
+{
+	uint32_t *data32, *swap32, benonce32;
+	uchar merkle_root[32];
+	char data[80];
 
-	gen_hash((uchar *)coinbase, merkle_root, cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
 	data32 = (uint32_t *)merkle_sha;
 	swap32 = (uint32_t *)merkle_root;
 	flip_32(swap32, data32);
@@ -5930,42 +6773,184 @@ static double submission_diff(sdata_t *sdata, const stratum_instance_t *client,
 	data32 = (uint32_t *)(data + 68);
 	*data32 = htobe32(ntime32);
 
-	/* Hash the share */
+	/* Flip the header for hashing */
 	data32 = (uint32_t *)data;
 	swap32 = (uint32_t *)swap;
 	flip_80(swap32, data32);
+}
+
+/* Most shares hashed together by the batched verification stage */
+#define SHARE_BATCH	SHA256_MB_MAX
+
+/* A share hashed ahead of parse_submit by the batched verification stage */
+struct share_hash {
+	/* Workbase reference taken for parse_submit to consume */
+	workbase_t *wb;
+	bool hashed;
+	uchar swap[80];
+	uchar hash[32];
+};
+
+typedef struct share_hash sharehash_t;
+
+/* Needs to be entered with workbase reference and client holding a ref count.
+ * Uses the hash from the batched verification stage if there is one. */
+static double submission_diff(sdata_t *sdata, stratum_instance_t *client, const workbase_t *wb,
+			      const char *nonce2, const uint32_t ntime32, uint32_t version_mask,
+			      const char *nonce, uchar *hash, const bool stale,
+			      const sharehash_t *sh)
+{
+	unsigned char merkle_root[32], merkle_sha[64];
+	int cblen, prefixlen, i;
+	uchar swap[80], hash1[32];
+	sha256_ctx ctx;
+	char *coinbase;
+	double ret;
+
+	/* Leave enough room for 25 byte generation address + length counter */
+	coinbase = alloca(share_cblen(wb));
+	cblen = share_coinbase(sdata, client, wb, nonce2, coinbase, &prefixlen);
+
+	if (sh && sh->hashed) {
+		memcpy(swap, sh->swap, 80);
+		memcpy(hash, sh->hash, 32);
+		goto out_hashed;
+	}
+
+	coinbase_midstate(client, wb, (uchar *)coinbase, prefixlen, &ctx);
+	sha256_update(&ctx, (uchar *)coinbase + prefixlen, cblen - prefixlen);
+	sha256_final(&ctx, hash1);
+	sha256(hash1, 32, merkle_root);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < wb->merkles; i++) {
+		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+	share_header(wb, merkle_sha, ntime32, version_mask, nonce, swap);
+
+	/* Hash the share */
 	sha256(swap, 80, hash1);
 	sha256(hash1, 32, hash);
-
+out_hashed:
 	/* Calculate the diff of the share here */
 	ret = diff_from_target(hash);
 
+	/* test_blocksolve takes the mask in header byte order */
+	if (version_mask)
+		version_mask = htobe32(version_mask);
+
 	/* Test we haven't solved a block regardless of share status */
 	test_blocksolve(client, wb, swap, hash, ret, coinbase, cblen, nonce2, nonce, ntime32, version_mask, stale);
 
 	return ret;
 }
 
-/* Optimised for the common case where shares are new */
-static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
+static bool share_live(sdata_t *sdata, const share_t *share)
+{
+	return share_gen_live(sdata, share->gen);
+}
+
+/* Find a free or retired slot for hash within the probe window of its home
+ * slot, returning NULL if there is none. */
+static share_t *__share_slot(sdata_t *sdata, share_t *slots, const int size,
+			     const uint64_t key)
+{
+	int i;
+
+	for (i = 0; i < SHARE_PROBES; i++) {
+		share_t *share = &slots[(key + i) & (size - 1)];
+
+		if (!share_live(sdata, share))
+			return share;
+	}
+	return NULL;
+}
+
+static uint64_t share_key(const uchar *hash)
+{
+	uint64_t key;
+
+	/* The share hash is effectively random in its low bytes */
+	memcpy(&key, hash, 8);
+	return key / SHARE_STRIPES;
+}
+
+/* Double the stripe's size until all its live entries fit within their probe
+ * windows, dropping retired entries as we go. */
+static void __grow_stripe(sdata_t *sdata, share_stripe_t *stripe)
+{
+	int size = stripe->size;
+	share_t *slots;
+
+retry:
+	size = size ? size * 2 : SHARE_STRIPE_SIZE;
+	slots = ckzalloc(sizeof(share_t) * size);
+	if (stripe->slots) {
+		int i;
+
+		for (i = 0; i < stripe->size; i++) {
+			share_t *share = &stripe->slots[i], *slot;
+
+			if (!share_live(sdata, share))
+				continue;
+			slot = __share_slot(sdata, slots, size, share_key(share->hash));
+			if (unlikely(!slot)) {
+				free(slots);
+				goto retry;
+			}
+			memcpy(slot, share, sizeof(share_t));
+		}
+		free(stripe->slots);
+	}
+	stripe->slots = slots;
+	stripe->size = size;
+}
+
+/* Optimised for the common case where shares are new. Every slot in the probe
+ * window is checked so a live duplicate is always found. */
+static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t gen)
 {
-	share_t *share = ckzalloc(sizeof(share_t)), *match = NULL;
+	share_stripe_t *stripe;
+	share_t *slot = NULL;
+	uint64_t key;
 	bool ret = true;
+	int i;
+
+	memcpy(&key, hash, 8);
+	stripe = &sdata->share_stripes[key % SHARE_STRIPES];
+	key = share_key(hash);
 
-	memcpy(share->hash, hash, 32);
-	share->workbase_id = wb_id;
+	__atomic_add_fetch(&sdata->shares_generated, 1, __ATOMIC_RELAXED);
 
-	mutex_lock(&sdata->share_lock);
-	sdata->shares_generated++;
-	HASH_FIND(hh, sdata->shares, hash, 32, match);
-	if (likely(!match))
-		HASH_ADD(hh, sdata->shares, hash, 32, share);
-	mutex_unlock(&sdata->share_lock);
+	mutex_lock(&stripe->lock);
+	if (unlikely(!stripe->slots))
+		__grow_stripe(sdata, stripe);
+	for (i = 0; i < SHARE_PROBES; i++) {
+		share_t *share = &stripe->slots[(key + i) & (stripe->size - 1)];
 
-	if (unlikely(match)) {
-		dealloc(share);
-		ret = false;
+		if (!share_live(sdata, share)) {
+			if (!slot)
+				slot = share;
+			continue;
+		}
+		if (unlikely(!memcmp(share->hash, hash, 32))) {
+			ret = false;
+			goto out_unlock;
+		}
 	}
+	/* Keep growing till the new share's probe window has room too */
+	while (unlikely(!slot)) {
+		__grow_stripe(sdata, stripe);
+		slot = __share_slot(sdata, stripe->slots, stripe->size, key);
+	}
+	memcpy(slot->hash, hash, 32);
+	slot->gen = gen;
+out_unlock:
+	mutex_unlock(&stripe->lock);
+
+	if (likely(ret))
+		__atomic_add_fetch(&sdata->share_gens[gen % SHARE_GENS].shares, 1, __ATOMIC_RELAXED);
 	return ret;
 }
 
@@ -6028,85 +7013,139 @@ static void check_best_diff(sdata_t *sdata, user_instance_t *user,worker_instanc
 
 #define JSON_ERR(err) json_string(SHARE_ERR(err))
 
-/* Needs to be entered with client holding a ref count. */
+/* Point the fields of submit at the strings in a json mining.submit params
+ * array, leaving NULL any that are missing or not strings. */
+static void json_submit(submit_t *submit, const json_t *params_val)
+{
+	memset(submit, 0, sizeof(submit_t));
+	if (unlikely(!json_is_array(params_val))) {
+		submit->params = -1;
+		return;
+	}
+	submit->params = json_array_size(params_val);
+	submit->workername = json_string_value(json_array_get(params_val, 0));
+	submit->job_id = json_string_value(json_array_get(params_val, 1));
+	submit->nonce2 = json_string_value(json_array_get(params_val, 2));
+	submit->ntime = json_string_value(json_array_get(params_val, 3));
+	submit->nonce = json_string_value(json_array_get(params_val, 4));
+	submit->version_mask = json_string_value(json_array_get(params_val, 5));
+}
+
+/* Fix broken clients sending too many or too few nonce2 chars, or too many
+ * nonce chars, using n2buf and nbuf for the corrected strings. Nonce is
+ * already known to be at least 8 chars. */
+static void fix_nonces(const workbase_t *wb, const char **nonce2, const char **nonce,
+		       char *n2buf, char *nbuf)
+{
+	int len = wb->enonce2varlen * 2, nlen = strlen(*nonce2);
+
+	if (unlikely(nlen != len)) {
+		if (nlen > len)
+			memcpy(n2buf, *nonce2, len);
+		else {
+			memset(n2buf, '0', len);
+			memcpy(n2buf, *nonce2, nlen);
+		}
+		n2buf[len] = '\0';
+		*nonce2 = n2buf;
+	}
+	if (unlikely(strlen(*nonce) > 8)) {
+		memcpy(nbuf, *nonce, 8);
+		nbuf[8] = '\0';
+		*nonce = nbuf;
+	}
+}
+
+/* Parse a share's optional version mask into version_mask32, treating a
+ * malformed one as no mask. Returns false if it rolls bits the pool does not
+ * allow changing. */
+static bool parse_version_mask(const ckpool_t *ckp, const char *version_mask,
+			       uint32_t *version_mask32)
+{
+	*version_mask32 = 0;
+	if (!version_mask || !strlen(version_mask) || !validhex(version_mask))
+		return true;
+	sscanf(version_mask, "%x", version_mask32);
+	return !(*version_mask32 & ~ckp->version_mask);
+}
+
+/* Needs to be entered with client holding a ref count. Takes the workbase
+ * and hash from sh if the share was hashed in a batch. */
 static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
-			    const json_t *params_val, json_t **err_val)
+			    const submit_t *fields, sharehash_t *sh, json_t **err_val)
 {
 	bool share = false, result = false, invalid = true, submit = false, stale = false;
-	const char *workername, *job_id, *ntime, *version_mask;
+	const char *workername, *job_id, *ntime, *version_mask, *nonce, *nonce2;
 	double diff = client->diff, wdiff = 0, sdiff = -1;
 	char hexhash[68] = {}, sharehash[32], cdfield[64];
 	user_instance_t *user = client->user_instance;
-	char *fname = NULL, *s, *nonce, *nonce2;
+	char n2buf[68], nbuf[12];
 	uint32_t ntime32, version_mask32 = 0;
 	sdata_t *sdata = client->sdata;
 	enum share_err err = SE_NONE;
 	ckpool_t *ckp = client->ckp;
 	char idstring[24] = {};
 	workbase_t *wb = NULL;
+	int64_t id, share_gen = 0;
+	const char *logpath = NULL;
+	bool loginfo, sharelog;
 	uchar hash[32];
-	int nlen, len;
 	time_t now_t;
 	json_t *val;
-	int64_t id;
 	ts_t now;
-	FILE *fp;
 
-	ts_realtime(&now);
+	ts_realtime_coarse(&now);
 	now_t = now.tv_sec;
-	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
+	loginfo = ckp->loglevel >= LOG_INFO;
+	sharelog = ckp->logshares || ckp->remote;
 
-	if (unlikely(!json_is_array(params_val))) {
+	if (unlikely(fields->params < 0)) {
 		err = SE_NOT_ARRAY;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	if (unlikely(json_array_size(params_val) < 5)) {
+	if (unlikely(fields->params < 5)) {
 		err = SE_INVALID_SIZE;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	workername = json_string_value(json_array_get(params_val, 0));
+	workername = fields->workername;
 	if (unlikely(!workername || !strlen(workername))) {
 		err = SE_NO_USERNAME;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	job_id = json_string_value(json_array_get(params_val, 1));
+	job_id = fields->job_id;
 	if (unlikely(!job_id || !strlen(job_id))) {
 		err = SE_NO_JOBID;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
+	nonce2 = fields->nonce2;
 	if (unlikely(!nonce2 || !strlen(nonce2) || !validhex(nonce2))) {
 		err = SE_NO_NONCE2;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	ntime = json_string_value(json_array_get(params_val, 3));
+	ntime = fields->ntime;
 	if (unlikely(!ntime || !strlen(ntime) || !validhex(ntime))) {
 		err = SE_NO_NTIME;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	nonce = (char *)json_string_value(json_array_get(params_val, 4));
+	nonce = fields->nonce;
 	if (unlikely(!nonce || strlen(nonce) < 8 || !validhex(nonce))) {
 		err = SE_NO_NONCE;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
 
-	version_mask = json_string_value(json_array_get(params_val, 5));
-	if (version_mask && strlen(version_mask) && validhex(version_mask)) {
-		sscanf(version_mask, "%x", &version_mask32);
-		// check version mask
-		if (version_mask32 && ((~ckp->version_mask) & version_mask32) != 0) {
-			// means client changed some bits which server doesn't allow to change
-			err = SE_INVALID_VERSION_MASK;
-			*err_val = JSON_ERR(err);
-			goto out;
-		}
+	version_mask = fields->version_mask;
+	if (!parse_version_mask(ckp, version_mask, &version_mask32)) {
+		// means client changed some bits which server doesn't allow to change
+		err = SE_INVALID_VERSION_MASK;
+		*err_val = JSON_ERR(err);
+		goto out;
 	}
 	if (safecmp(workername, client->workername)) {
 		err = SE_WORKER_MISMATCH;
@@ -6121,45 +7160,30 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 	if (unlikely(!sdata->current_workbase))
 		return json_boolean(false);
 
-	wb = get_workbase(sdata, id);
+	if (sh && sh->wb) {
+		wb = sh->wb;
+		sh->wb = NULL;
+	} else
+		wb = get_workbase(sdata, id);
 	if (unlikely(!wb)) {
 		id = sdata->current_workbase->id;
 		err = SE_INVALID_JOBID;
 		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 		strncpy(idstring, job_id, 19);
-		ASPRINTF(&fname, "%s.sharelog", sdata->current_workbase->logdir);
+		if (ckp->logshares)
+			logpath = sdata->current_workbase->sharelog;
 		goto out_nowb;
 	}
 	wdiff = wb->diff;
+	share_gen = wb->share_gen;
 	strncpy(idstring, wb->idstring, 20);
-	ASPRINTF(&fname, "%s.sharelog", wb->logdir);
-	/* Fix broken clients sending too many chars. Nonce2 is part of the
-	 * read only json so use a temporary variable and modify it. */
-	len = wb->enonce2varlen * 2;
-	nlen = strlen(nonce2);
-	if (unlikely(nlen != len)) {
-		if (nlen > len) {
-			nonce2 = strdupa(nonce2);
-			nonce2[len] = '\0';
-		} else if (nlen < len) {
-			char *tmp = nonce2;
-
-			nonce2 = strdupa("0000000000000000");
-			memcpy(nonce2, tmp, nlen);
-			nonce2[len] = '\0';
-		}
-	}
-	/* Same with nonce, but we need at least 8 chars. We checked for this
-	 * earlier. */
-	len = 8;
-	nlen = strlen(nonce);
-	if (unlikely(nlen > len)) {
-		nonce = strdupa(nonce);
-		nonce[len] = '\0';
-	}
+	if (ckp->logshares)
+		logpath = wb->sharelog;
+	fix_nonces(wb, &nonce2, &nonce, n2buf, nbuf);
 	if (id < sdata->blockchange_id)
 		stale = true;
-	sdiff = submission_diff(sdata, client, wb, nonce2, ntime32, version_mask32, nonce, hash, stale);
+	sdiff = submission_diff(sdata, client, wb, nonce2, ntime32, version_mask32, nonce, hash,
+				stale, sh);
 	if (sdiff > client->best_diff) {
 		worker_instance_t *worker = client->worker_instance;
 
@@ -6168,8 +7192,6 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 			worker->workername, client->identity, sdiff);
 		check_best_diff(sdata, user, worker, sdiff, client);
 	}
-	bswap_256(sharehash, hash);
-	__bin2hex(hexhash, sharehash, 32);
 
 	if (stale) {
 		/* Accept shares if they're received on remote nodes before the
@@ -6195,15 +7217,18 @@ no_stale:
 	if (ntime32 < wb->ntime32 || ntime32 > wb->ntime32 + 7000) {
 		err = SE_NTIME_INVALID;
 		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
-		goto out_put;
+		goto out_nowb;
 	}
 	invalid = false;
 out_submit:
 	if (sdiff >= wdiff)
 		submit = true;
-out_put:
-	put_workbase(sdata, wb);
 out_nowb:
+	/* Only format the hash if something will consume it */
+	if (wb && (loginfo || sharelog || (wb->proxy && submit))) {
+		bswap_256(sharehash, hash);
+		__bin2hex(hexhash, sharehash, 32);
+	}
 
 	/* Accept shares of the old diff until the next update */
 	if (id < client->diff_change_job_id)
@@ -6211,27 +7236,31 @@ out_nowb:
 	if (!invalid) {
 		char wdiffsuffix[16];
 
-		suffix_string(wdiff, wdiffsuffix, 16, 0);
+		if (loginfo)
+			suffix_string(wdiff, wdiffsuffix, 16, 0);
 		if (sdiff >= diff) {
-			if (new_share(sdata, hash, id)) {
-				LOGINFO("Accepted client %s share diff %.1f/%.0f/%s: %s",
-					client->identity, sdiff, diff, wdiffsuffix, hexhash);
+			if (new_share(sdata, hash, share_gen)) {
+				if (loginfo)
+					LOGINFO("Accepted client %s share diff %.1f/%.0f/%s: %s",
+						client->identity, sdiff, diff, wdiffsuffix, hexhash);
 				result = true;
 			} else {
 				err = SE_DUPE;
 				json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
-				LOGINFO("Rejected client %s dupe diff %.1f/%.0f/%s: %s",
-					client->identity, sdiff, diff, wdiffsuffix, hexhash);
+				if (loginfo)
+					LOGINFO("Rejected client %s dupe diff %.1f/%.0f/%s: %s",
+						client->identity, sdiff, diff, wdiffsuffix, hexhash);
 				submit = false;
 			}
 		} else {
 			err = SE_HIGH_DIFF;
-			LOGINFO("Rejected client %s high diff %.1f/%.0f/%s: %s",
-				client->identity, sdiff, diff, wdiffsuffix, hexhash);
+			if (loginfo)
+				LOGINFO("Rejected client %s high diff %.1f/%.0f/%s: %s",
+					client->identity, sdiff, diff, wdiffsuffix, hexhash);
 			json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 			submit = false;
 		}
-	}  else
+	} else if (loginfo)
 		LOGINFO("Rejected client %s invalid share %s", client->identity, SHARE_ERR(err));
 
 	/* Submit share to upstream pool in proxy mode. We submit valid and
@@ -6243,7 +7272,42 @@ out_nowb:
 
 	add_submit(ckp, client, diff, result, submit);
 
+	/* Only build the sharelog entry if it will be written or sent */
+	if (!sharelog)
+		goto out_put;
+
+	/* Binary sharelogs need no json so queue the record directly */
+	if (logpath && ckp->binsharelog) {
+		const char *strings[SHARELOG_STRINGS] = { client->workername, user->username,
+			client->address, client->useragent, ckp->serverurl[client->server] };
+		struct sharelog_share rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.type = SLR_SHARE;
+		rec.result = result;
+		rec.errn = err;
+		rec.clientid = ckp->remote ? client->virtualid : client->id;
+		rec.sec = now.tv_sec;
+		rec.nsec = now.tv_nsec;
+		rec.diff = diff;
+		rec.sdiff = sdiff;
+		rec.ntime = ntime32;
+		if (strlen(nonce) == 8)
+			hex2bin(&rec.nonce, nonce, 4);
+		if (wb)
+			memcpy(rec.hash, sharehash, 32);
+		rec.enonce1len = MIN(strlen(client->enonce1) / 2, sizeof(rec.enonce1));
+		memcpy(rec.enonce1, client->enonce1bin, rec.enonce1len);
+		rec.nonce2len = MIN(strlen(nonce2) / 2, sizeof(rec.nonce2));
+		hex2bin(rec.nonce2, nonce2, rec.nonce2len);
+		sharelog_add_binary(ckp->sdata, logpath, id, &rec, strings);
+		if (!ckp->remote)
+			goto out_put;
+		logpath = NULL;
+	}
+
 	/* Now write to the pool's sharelog. */
+	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 	val = json_object();
 	json_set_int(val, "workinfoid", id);
 	if (ckp->remote)
@@ -6270,22 +7334,14 @@ out_nowb:
         json_set_string(val, "address", client->address);
         json_set_string(val, "agent", client->useragent);
 
-	if (ckp->logshares) {
-		fp = fopen(fname, "ae");
-		if (likely(fp)) {
-			s = json_dumps(val, JSON_EOL);
-			len = strlen(s);
-			len = fprintf(fp, "%s", s);
-			free(s);
-			fclose(fp);
-			if (unlikely(len < 0))
-				LOGERR("Failed to fwrite to %s", fname);
-		} else
-			LOGERR("Failed to fopen %s", fname);
-	}
+	if (logpath)
+		sharelog_add(ckp->sdata, logpath, val);
 	if (ckp->remote)
 		upstream_json_msgtype(ckp, val, SM_SHARE);
 	json_decref(val);
+out_put:
+	if (wb)
+		put_workbase(sdata, wb);
 out:
 	if (!sdata->wbincomplete && ((!result && !submit) || !share)) {
 		/* Is this the first in a run of invalids? */
@@ -6328,6 +7384,7 @@ out:
 			json_set_string(val, "username", user->username);
 			json_object_set(val, "error", *err_val);
 			json_set_int(val, "errn", err);
+			sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 			json_set_string(val, "createdate", cdfield);
 			json_set_string(val, "createby", "code");
 			json_set_string(val, "createcode", __func__);
@@ -6336,7 +7393,6 @@ out:
 		}
 		LOGINFO("Invalid share from client %s: %s", client->identity, client->workername);
 	}
-	free(fname);
 	return json_boolean(result);
 }
 
@@ -6422,31 +7478,69 @@ static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user,
 	return val;
 }
 
-/* Sends a stratum update with a unique coinb2 for every client. Avoid
- * recursive locking. */
+/* Clients of one user all receive the same notify in solo mode */
+typedef struct user_broadcast {
+	user_instance_t *user;
+	int64_t *client_ids;
+	int clients;
+} user_broadcast_t;
+
+/* Build each user's notify once and broadcast it, serialised once, to all of
+ * that user's clients. Passthrough subclients still get their own copy. User
+ * instances are never freed so they can be used outside the instance lock. */
 static void stratum_broadcast_updates(sdata_t *sdata, bool clean)
 {
-	stratum_instance_t *client, *tmp;
-	json_t *json_msg;
+	user_broadcast_t *ubcasts;
+	user_instance_t *user, *tmp;
+	int users = 0, i;
 
-	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		if (!client->user_instance)
+	ck_rlock(&sdata->instance_lock);
+	ubcasts = ckzalloc(sizeof(user_broadcast_t) * (HASH_COUNT(sdata->user_instances) + 1));
+	HASH_ITER(hh, sdata->user_instances, user, tmp) {
+		user_broadcast_t *ubcast = &ubcasts[users];
+		stratum_instance_t *client;
+		int count;
+
+		DL_COUNT2(user->clients, client, count, user_next);
+		if (!count)
 			continue;
-		__inc_instance_ref(client);
-		ck_wunlock(&sdata->instance_lock);
+		ubcast->user = user;
+		ubcast->client_ids = ckalloc(sizeof(int64_t) * count);
+		DL_FOREACH2(user->clients, client, user_next)
+			ubcast->client_ids[ubcast->clients++] = client->id;
+		users++;
+	}
+	ck_runlock(&sdata->instance_lock);
+
+	for (i = 0; i < users; i++) {
+		user_broadcast_t *ubcast = &ubcasts[i];
+		int j, clients = 0;
+		json_t *json_msg;
 
 		ck_rlock(&sdata->workbase_lock);
-		json_msg = __user_notify(sdata->current_workbase, client->user_instance, clean);
+		json_msg = __user_notify(sdata->current_workbase, ubcast->user, clean);
 		ck_runlock(&sdata->workbase_lock);
 
-		if (likely(json_msg))
-			stratum_add_send(sdata, json_msg, client->id, SM_UPDATE);
+		if (unlikely(!json_msg)) {
+			free(ubcast->client_ids);
+			continue;
+		}
+		for (j = 0; j < ubcast->clients; j++) {
+			const int64_t client_id = ubcast->client_ids[j];
 
-		ck_wlock(&sdata->instance_lock);
-		__dec_instance_ref(client);
+			if (likely(!subclient(client_id)))
+				ubcast->client_ids[clients++] = client_id;
+			else
+				stratum_add_send(sdata, json_deep_copy(json_msg), client_id, SM_UPDATE);
+		}
+		if (likely(clients))
+			stratum_broadcast_ids(sdata, json_msg, ubcast->client_ids, clients);
+		else {
+			json_decref(json_msg);
+			free(ubcast->client_ids);
+		}
 	}
-	ck_wunlock(&sdata->instance_lock);
+	free(ubcasts);
 }
 
 static void send_json_err(sdata_t *sdata, const int64_t client_id, json_t *id_val, const char *err_msg)
@@ -6475,7 +7569,7 @@ static json_params_t
 *create_json_params(const int64_t client_id, const json_t *method, const json_t *params,
 		    const json_t *id_val)
 {
-	json_params_t *jp = ckalloc(sizeof(json_params_t));
+	json_params_t *jp = ckslab_alloc(jp_slab);
 
 	jp->method = json_deep_copy(method);
 	jp->params = json_deep_copy(params);
@@ -6551,10 +7645,10 @@ static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
 		JSON_CPACK(val, "{ss,so}", "node.method", stratum_msgs[SM_TRANSACTIONS],
 			   "transaction", txn_array);
 	}
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = ckslab_alloc(sdata->ckp->smsg_slab);
 	msg->json_msg = val;
 	msg->client_id = client->id;
-	ckmsgq_add(sdata->ssends, msg);
+	ckmsgq_add(client_ckmsgq(sdata->ckp, sdata->ssends, client->id), msg);
 	LOGNOTICE("Sending new node client %s all transactions", client->identity);
 }
 
@@ -6607,7 +7701,7 @@ static void add_remote_server(sdata_t *sdata, stratum_instance_t *client)
 /* Enter with client holding ref count */
 static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *client,
 			 const int64_t client_id, json_t *id_val, json_t *method_val,
-			 json_t *params_val)
+			 json_t *params_val, const enum stratum_msgtype msg_type)
 {
 	const char *method;
 
@@ -6615,10 +7709,10 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	 * copy the json item for id_val as is for the response. By far the
 	 * most common messages will be shares so look for those first */
 	method = json_string_value(method_val);
-	if (likely(cmdmatch(method, "mining.submit") && client->authorised)) {
+	if (likely(msg_type == SM_SHARE && client->authorised)) {
 		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
 
-		ckmsgq_add(sdata->sshareq, jp);
+		ckmsgq_add(client_ckmsgq(ckp, sdata->sshareq, client_id), jp);
 		return;
 	}
 
@@ -6628,7 +7722,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 		return;
 	}
 
-	if (cmdmatch(method, "mining.subscribe")) {
+	if (msg_type == SM_SUBSCRIBE) {
 		json_t *val, *result_val;
 
 		if (unlikely(client->subscribed)) {
@@ -6712,7 +7806,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 
 	/* We shouldn't really allow unsubscribed users to authorise first but
 	 * some broken stratum implementations do that and we can handle it. */
-	if (cmdmatch(method, "mining.auth")) {
+	if (msg_type == SM_AUTH) {
 		json_params_t *jp;
 
 		if (unlikely(client->authorised)) {
@@ -6725,7 +7819,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 		return;
 	}
 
-        if (cmdmatch(method, "mining.configure")) {
+	if (msg_type == SM_CONFIGURE) {
 		json_t *val, *result_val;
 		char version_str[12];
 
@@ -6758,13 +7852,13 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 		return;
 	}
 
-	if (cmdmatch(method, "mining.suggest")) {
+	if (msg_type == SM_SUGGESTDIFF) {
 		suggest_diff(ckp, client, method, params_val);
 		return;
 	}
 
 	/* Covers both get_transactions and get_txnhashes */
-	if (cmdmatch(method, "mining.get")) {
+	if (msg_type == SM_TXNS) {
 		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
 
 		ckmsgq_add(sdata->stxnq, jp);
@@ -6776,12 +7870,6 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	return;
 }
 
-static void free_smsg(smsg_t *msg)
-{
-	json_decref(msg->json_msg);
-	free(msg);
-}
-
 /* Even though we check the results locally in node mode, check the upstream
  * results in case of runs of invalids. */
 static void parse_share_result(ckpool_t *ckp, stratum_instance_t *client, json_t *val)
@@ -6930,20 +8018,17 @@ static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 	worker = get_worker(sdata, user, workername);
 	check_best_diff(sdata, user, worker, sdiff, NULL);
 
-	mutex_lock(&sdata->uastats_lock);
-	sdata->stats.unaccounted_shares++;
-	sdata->stats.unaccounted_diff_shares += diff;
-	mutex_unlock(&sdata->uastats_lock);
+	count_share(sdata, diff, true);
 
-	worker->shares += diff;
-	user->shares += diff;
+	__atomic_add_fetch(&worker->shares, (int64_t)diff, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&user->shares, (int64_t)diff, __ATOMIC_RELAXED);
 	tv_time(&now_t);
 
-	decay_worker(worker, diff, &now_t);
+	__atomic_add_fetch(&worker->uadiff, (int64_t)diff, __ATOMIC_RELAXED);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	__atomic_add_fetch(&user->uadiff, (int64_t)diff, __ATOMIC_RELAXED);
 	copy_tv(&user->last_share, &now_t);
 
 	LOGINFO("Added %.0lf remote shares to worker %s", diff, workername);
@@ -6996,7 +8081,7 @@ static stratum_instance_t *ref_instance_by_virtualid(sdata_t *sdata, int64_t *cl
 	stratum_instance_t *client, *ret = NULL;
 
 	ck_wlock(&sdata->instance_lock);
-	for (client = sdata->stratum_instances; client; client = client->hh.next) {
+	DL_FOREACH2(sdata->stratum_instances, client, instance_next) {
 		if (likely(client->virtualid != *client_id))
 			continue;
 		if (likely(!client->dropped)) {
@@ -7381,7 +8466,7 @@ static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *clie
 	switch (msg_type) {
 		case SM_SHARE:
 			jp = create_json_params(client->id, method, params, id_val);
-			ckmsgq_add(sdata->sshareq, jp);
+			ckmsgq_add(client_ckmsgq(ckp, sdata->sshareq, client->id), jp);
 			break;
 		case SM_SHARERESULT:
 			parse_share_result(ckp, client, res_val);
@@ -7441,7 +8526,7 @@ static void parse_node_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 }
 
 /* Entered with client holding ref count */
-static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg, stratum_instance_t *client)
+static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, cmsg_t *msg, stratum_instance_t *client)
 {
 	json_t *val = msg->json_msg, *id_val, *method, *params;
 	int64_t client_id = msg->client_id;
@@ -7492,79 +8577,64 @@ static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg, strat
 		if (!(++delays % 50))
 			LOGWARNING("%d Second delay waiting for bitcoind at startup", delays / 10);
 	}
-	parse_method(ckp, sdata, client, client_id, id_val, method, params);
+	parse_method(ckp, sdata, client, client_id, id_val, method, params, msg->method);
 }
 
-static void srecv_process(ckpool_t *ckp, json_t *val)
+static void srecv_process(ckpool_t *ckp, cmsg_t *msg)
 {
-	char address[INET6_ADDRSTRLEN], *buf = NULL;
 	bool noid = false, dropped = false;
 	sdata_t *sdata = ckp->sdata;
 	stratum_instance_t *client;
-	smsg_t *msg;
-	int server;
-
-	if (unlikely(!val)) {
-		LOGWARNING("srecv_process received NULL val!");
-		return;
-	}
+	instance_shard_t *shard;
 
-	msg = ckzalloc(sizeof(smsg_t));
-	msg->json_msg = val;
-	val = json_object_get(msg->json_msg, "client_id");
-	if (unlikely(!val)) {
+	if (unlikely(msg->client_id < 0)) {
 		if (ckp->node)
 			parse_node_msg(ckp, sdata, msg->json_msg);
 		else {
-			buf = json_dumps(val, JSON_COMPACT);
+			char *buf = json_dumps(msg->json_msg, JSON_COMPACT);
+
 			LOGWARNING("Failed to extract client_id from connector json smsg %s", buf);
+			free(buf);
 		}
 		goto out;
 	}
 
-	msg->client_id = json_integer_value(val);
-	json_object_clear(val);
-
-	val = json_object_get(msg->json_msg, "address");
-	if (unlikely(!val)) {
-		buf = json_dumps(val, JSON_COMPACT);
-		LOGWARNING("Failed to extract address from connector json smsg %s", buf);
-		goto out;
-	}
-	strcpy(address, json_string_value(val));
-	json_object_clear(val);
-
-	val = json_object_get(msg->json_msg, "server");
-	if (unlikely(!val)) {
-		buf = json_dumps(val, JSON_COMPACT);
-		LOGWARNING("Failed to extract server from connector json smsg %s", buf);
-		goto out;
+	/* Parse the message here. Existing clients only need the read lock of
+	 * their shard. */
+	shard = instance_shard(sdata, msg->client_id);
+	ck_rlock(&shard->lock);
+	client = __instance_by_id(sdata, msg->client_id);
+	if (likely(client)) {
+		if (unlikely(client->dropped))
+			dropped = true;
+		else
+			__inc_instance_ref(client);
 	}
-	server = json_integer_value(val);
-	json_object_clear(val);
+	ck_runlock(&shard->lock);
 
-	/* Parse the message here */
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, msg->client_id);
-	/* If client_id instance doesn't exist yet, create one */
 	if (unlikely(!client)) {
-		noid = true;
-		client = __stratum_add_instance(ckp, msg->client_id, address, server);
-	} else if (unlikely(client->dropped))
-		dropped = true;
-	if (likely(!dropped))
-		__inc_instance_ref(client);
-	ck_wunlock(&sdata->instance_lock);
+		ck_wlock(&sdata->instance_lock);
+		client = __instance_by_id(sdata, msg->client_id);
+		/* If client_id instance doesn't exist yet, create one */
+		if (likely(!client)) {
+			noid = true;
+			client = __stratum_add_instance(ckp, msg->client_id, msg->address, msg->server);
+		} else if (unlikely(client->dropped))
+			dropped = true;
+		if (likely(!dropped))
+			__inc_instance_ref(client);
+		ck_wunlock(&sdata->instance_lock);
+	}
 
 	if (unlikely(dropped)) {
 		/* Client may be NULL here */
 		LOGNOTICE("Stratifier skipped dropped instance %"PRId64" message from server %d",
-			  msg->client_id, server);
+			  msg->client_id, msg->server);
 		connector_drop_client(ckp, msg->client_id);
 		goto out;
 	}
 	if (unlikely(noid))
-		LOGINFO("Stratifier added instance %s server %d", client->identity, server);
+		LOGINFO("Stratifier added instance %s server %d", client->identity, msg->server);
 
 	if (client->trusted)
 		parse_trusted_msg(ckp, sdata, msg->json_msg, client);
@@ -7574,45 +8644,125 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 		parse_instance_msg(ckp, sdata, msg, client);
 	dec_instance_ref(sdata, client);
 out:
-	free_smsg(msg);
-	free(buf);
+	json_decref(msg->json_msg);
+	ckslab_free(cmsg_slab, msg);
+}
+
+/* Map the method of a client message to its message type for the methods
+ * parse_method matches by prefix */
+static enum stratum_msgtype client_msg_type(const json_t *val)
+{
+	const char *method = json_string_value(json_object_get(val, "method"));
+
+	if (unlikely(!method))
+		return SM_NONE;
+	if (likely(cmdmatch(method, "mining.submit")))
+		return SM_SHARE;
+	if (cmdmatch(method, "mining.subscribe"))
+		return SM_SUBSCRIBE;
+	if (cmdmatch(method, "mining.auth"))
+		return SM_AUTH;
+	if (cmdmatch(method, "mining.configure"))
+		return SM_CONFIGURE;
+	if (cmdmatch(method, "mining.suggest"))
+		return SM_SUGGESTDIFF;
+	if (cmdmatch(method, "mining.get"))
+		return SM_TXNS;
+	return SM_NONE;
+}
+
+/* Queue a message from a client, taking ownership of val */
+void stratifier_add_msg(ckpool_t *ckp, const int64_t client_id, const int server,
+			const char *address, json_t *val)
+{
+	sdata_t *sdata = ckp->sdata;
+	cmsg_t *msg;
+
+	msg = ckslab_alloc(cmsg_slab);
+	msg->client_id = client_id;
+	msg->server = server;
+	msg->method = client_msg_type(val);
+	/* Addresses from passthroughs come from the json so bound the copy */
+	snprintf(msg->address, INET6_ADDRSTRLEN, "%s", address);
+	msg->json_msg = val;
+	ckmsgq_add(client_ckmsgq(ckp, sdata->srecvs, client_id), msg);
 }
 
+/* Queue a json message that did not come from a client, such as one from an
+ * upstream pool in node mode */
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line)
 {
 	sdata_t *sdata;
+	cmsg_t *msg;
 
 	if (unlikely(!val)) {
 		LOGWARNING("_stratifier_add_recv received NULL val from %s %s:%d", file, func, line);
 		return;
 	}
 	sdata = ckp->sdata;
-	ckmsgq_add(sdata->srecvs, val);
+	msg = ckslab_alloc(cmsg_slab);
+	msg->client_id = -1;
+	msg->method = SM_NONE;
+	msg->json_msg = val;
+	ckmsgq_add(client_ckmsgq(ckp, sdata->srecvs, -1), msg);
+}
+
+static json_params_t *submit_json_params(submit_t *submit)
+{
+	json_params_t *jp = ckslab_alloc(jp_slab);
+
+	jp->client_id = submit->client_id;
+	jp->id_val = submit->id_val;
+	submit->id_val = NULL;
+	jp->submit = submit;
+	return jp;
+}
+
+/* Queue a share decoded by the connector's fast path straight to the share
+ * processor, bypassing the receive queue. */
+void stratifier_add_submit(ckpool_t *ckp, submit_t *submit)
+{
+	json_params_t *jp = submit_json_params(submit);
+	sdata_t *sdata = ckp->sdata;
+
+	ckmsgq_add(client_ckmsgq(ckp, sdata->sshareq, jp->client_id), jp);
+}
+
+static void process_shares(ckpool_t *ckp, json_params_t **jps, const int n, const bool direct);
+
+/* In runtocompletion mode, process a share decoded by the connector's fast
+ * path on the connector thread that read it, handing the result straight
+ * back to the connector to send instead of queueing it anywhere. */
+void stratifier_process_submit(ckpool_t *ckp, submit_t *submit)
+{
+	json_params_t *jp = submit_json_params(submit);
+
+	process_shares(ckp, &jp, 1, true);
 }
 
 static void ssend_process(ckpool_t *ckp, smsg_t *msg)
 {
-	if (unlikely(!msg->json_msg)) {
+	if (unlikely(!msg->json_msg && !msg->bcast)) {
 		LOGERR("Sent null json msg to stratum_sender");
-		free(msg);
+		ckslab_free(ckp->smsg_slab, msg);
 		return;
 	}
 
-	/* Add client_id to the json message and send it to the
-	 * connector process to be delivered */
-	json_object_set_new_nocheck(msg->json_msg, "client_id", json_integer(msg->client_id));
-	connector_add_message(ckp, msg->json_msg);
-	/* The connector will free msg->json_msg */
-	free(msg);
+	/* Send it to the connector to be delivered, which frees msg and
+	 * msg->json_msg */
+	connector_add_message(ckp, msg);
 }
 
 static void discard_json_params(json_params_t *jp)
 {
-	json_decref(jp->method);
-	json_decref(jp->params);
+	if (jp->method)
+		json_decref(jp->method);
+	if (jp->params)
+		json_decref(jp->params);
 	if (jp->id_val)
 		json_decref(jp->id_val);
-	free(jp);
+	free(jp->submit);
+	ckslab_free(jp_slab, jp);
 }
 
 static void steal_json_id(json_t *val, json_params_t *jp)
@@ -7622,34 +8772,191 @@ static void steal_json_id(json_t *val, json_params_t *jp)
 	jp->id_val = NULL;
 }
 
-static void sshare_process(ckpool_t *ckp, json_params_t *jp)
-{
-	json_t *result_val, *json_msg, *err_val = NULL;
-	stratum_instance_t *client;
-	sdata_t *sdata = ckp->sdata;
-	int64_t client_id;
+/* Hash a batch of shares together with the multi-buffer sha256, taking a
+ * workbase reference for each share hashed that parse_submit consumes. Shares
+ * that are malformed or stale enough to have no workbase are left for
+ * parse_submit to reject. */
+static void hash_share_batch(stratum_instance_t **clients, const submit_t **fields,
+			     sharehash_t *sh, const int n)
+{
+	uchar roots[SHARE_BATCH][32], merkle_sha[SHARE_BATCH][64], *digest[SHARE_BATCH];
+	const uchar *msg[SHARE_BATCH];
+	const char *nonce[SHARE_BATCH];
+	uint32_t ntime32[SHARE_BATCH], version_mask32[SHARE_BATCH];
+	const sha256_ctx *ctxp[SHARE_BATCH];
+	sha256_ctx ctx[SHARE_BATCH];
+	unsigned int len[SHARE_BATCH];
+	int lane[SHARE_BATCH], lanes = 0, i, j, k;
+
+	for (i = 0; i < n; i++) {
+		const submit_t *submit = fields[i];
+		stratum_instance_t *client = clients[i];
+		const char *nonce2, *job_id;
+		char *coinbase, *n2buf, *nbuf;
+		int cblen, prefixlen;
+		workbase_t *wb;
+		int64_t id;
 
-	client_id = jp->client_id;
+		memset(&sh[i], 0, sizeof(sharehash_t));
+		if (!client || submit->params < 5)
+			continue;
+		job_id = submit->job_id;
+		nonce2 = submit->nonce2;
+		nonce[lanes] = submit->nonce;
+		/* Leave malformed fields for parse_submit to reject, rather
+		 * than hashing them with hex2bin warnings */
+		if (!job_id || !nonce2 || !strlen(nonce2) || !validhex(nonce2) ||
+		    !submit->ntime || !strlen(submit->ntime) || !validhex(submit->ntime) ||
+		    !nonce[lanes] || strlen(nonce[lanes]) < 8 || !validhex(nonce[lanes]))
+			continue;
+		/* Disallowed masks are rejected by parse_submit */
+		if (!parse_version_mask(client->ckp, submit->version_mask, &version_mask32[lanes]))
+			continue;
+		sscanf(job_id, "%lx", &id);
+		wb = get_workbase(client->sdata, id);
+		if (!wb)
+			continue;
+		sh[i].wb = wb;
+
+		sscanf(submit->ntime, "%x", &ntime32[lanes]);
+		n2buf = alloca(68);
+		nbuf = alloca(12);
+		fix_nonces(wb, &nonce2, &nonce[lanes], n2buf, nbuf);
+
+		coinbase = alloca(share_cblen(wb));
+		cblen = share_coinbase(client->sdata, client, wb, nonce2, coinbase, &prefixlen);
+		coinbase_midstate(client, wb, (uchar *)coinbase, prefixlen, &ctx[lanes]);
+		ctxp[lanes] = &ctx[lanes];
+		msg[lanes] = (uchar *)coinbase + prefixlen;
+		len[lanes] = cblen - prefixlen;
+		digest[lanes] = roots[lanes];
+		lane[lanes++] = i;
+	}
+	if (!lanes)
+		return;
 
-	client = ref_instance_by_id(sdata, client_id);
-	if (unlikely(!client)) {
-		LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!", client_id);
-		goto out;
+	/* Coinbase hashes, then each level of the merkle tree for the shares
+	 * whose workbases go that deep */
+	sha256d_mb(ctxp, msg, len, digest, lanes);
+	for (i = 0; ; i++) {
+		for (j = k = 0; j < lanes; j++) {
+			const workbase_t *wb = sh[lane[j]].wb;
+
+			if (i >= wb->merkles)
+				continue;
+			memcpy(merkle_sha[j], roots[j], 32);
+			memcpy(merkle_sha[j] + 32, &wb->merklebin[i], 32);
+			msg[k] = merkle_sha[j];
+			len[k] = 64;
+			digest[k++] = roots[j];
+		}
+		if (!k)
+			break;
+		sha256d_mb(NULL, msg, len, digest, k);
 	}
-	if (unlikely(!client->authorised)) {
-		LOGDEBUG("Client %s no longer authorised to submit shares", client->identity);
-		goto out_decref;
+
+	for (j = 0; j < lanes; j++) {
+		sharehash_t *share = &sh[lane[j]];
+
+		share_header(share->wb, roots[j], ntime32[j], version_mask32[j], nonce[j], share->swap);
+		msg[j] = share->swap;
+		len[j] = 80;
+		digest[j] = share->hash;
+		share->hashed = true;
 	}
-	json_msg = json_object();
-	result_val = parse_submit(client, json_msg, jp->params, &err_val);
-	json_object_set_new_nocheck(json_msg, "result", result_val);
-	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
-	steal_json_id(json_msg, jp);
-	stratum_add_send(sdata, json_msg, client_id, SM_SHARERESULT);
+	sha256d_mb(NULL, msg, len, digest, lanes);
+}
+
+/* Process a batch of shares, hashing them together before the rest of each
+ * is processed individually. Direct results go straight to the connector
+ * instead of through the send queue. */
+static void process_shares(ckpool_t *ckp, json_params_t **jps, const int n, const bool direct)
+{
+	stratum_instance_t *clients[SHARE_BATCH];
+	const submit_t *fields[SHARE_BATCH];
+	sharehash_t sh[SHARE_BATCH];
+	sdata_t *sdata = ckp->sdata;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		json_params_t *jp = jps[i];
+		int64_t client_id = jp->client_id;
+		stratum_instance_t *client;
+		submit_t *submit;
+
+		clients[i] = NULL;
+		client = ref_instance_by_id(sdata, client_id);
+		if (unlikely(!client)) {
+			LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!", client_id);
+			/* Shares decoded by the connector skip the receive queue where
+			 * new clients are added, so this client never subscribed */
+			if (jp->submit)
+				connector_drop_client(ckp, client_id);
+			continue;
+		}
+		if (jp->submit) {
+			/* Apply the checks parse_instance_msg and parse_method would
+			 * have made on this share */
+			if (unlikely(client->reject == 3)) {
+				LOGINFO("Dropping client %s %s tagged for lazy invalidation",
+					client->identity, client->address);
+				connector_drop_client(ckp, client_id);
+				goto out_decref;
+			}
+			if (unlikely(!client->subscribed)) {
+				LOGINFO("Dropping mining.submit from unsubscribed client %s %s",
+					client->identity, client->address);
+				connector_drop_client(ckp, client_id);
+				goto out_decref;
+			}
+		}
+		if (unlikely(!client->authorised)) {
+			LOGDEBUG("Client %s no longer authorised to submit shares", client->identity);
+			goto out_decref;
+		}
+		if (!jp->submit) {
+			submit = alloca(sizeof(submit_t));
+			json_submit(submit, jp->params);
+		} else
+			submit = jp->submit;
+		fields[i] = submit;
+		clients[i] = client;
+		continue;
 out_decref:
-	dec_instance_ref(sdata, client);
+		dec_instance_ref(sdata, client);
+	}
+
+	hash_share_batch(clients, fields, sh, n);
+
+	for (i = 0; i < n; i++) {
+		json_t *result_val, *json_msg, *err_val = NULL;
+		stratum_instance_t *client = clients[i];
+		json_params_t *jp = jps[i];
+
+		if (!client)
+			goto out;
+		json_msg = json_object();
+		result_val = parse_submit(client, json_msg, fields[i], &sh[i], &err_val);
+		/* Release any workbase parse_submit rejected the share before using */
+		if (sh[i].wb)
+			put_workbase(client->sdata, sh[i].wb);
+		json_object_set_new_nocheck(json_msg, "result", result_val);
+		json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
+		steal_json_id(json_msg, jp);
+		if (direct)
+			connector_send_json(ckp, jp->client_id, json_msg);
+		else
+			stratum_add_send(sdata, json_msg, jp->client_id, SM_SHARERESULT);
+		dec_instance_ref(sdata, client);
 out:
-	discard_json_params(jp);
+		discard_json_params(jp);
+	}
+}
+
+/* Process a batch of shares from the share queue */
+static void sshare_process(ckpool_t *ckp, json_params_t **jps, const int n)
+{
+	process_shares(ckp, jps, n, false);
 }
 
 /* As ref_instance_by_id but only returns clients not authorising or authorised,
@@ -7988,9 +9295,9 @@ static void *statsupdate(void *arg)
 			} else {
 				per_tdiff = tvdiff(&now, &client->last_share);
 				/* Decay times per connected instance */
+				decay_client(client, &now);
 				if (per_tdiff > 60) {
-					/* No shares for over a minute, decay to 0 */
-					decay_client(client, 0, &now);
+					/* No shares for over a minute */
 					idle_workers++;
 					if (per_tdiff > 600)
 						client->idle = true;
@@ -8003,7 +9310,7 @@ static void *statsupdate(void *arg)
 			/* Drop the reference of the last entry we examined,
 			 * then grab the next client. */
 			__dec_instance_ref(client);
-			client = client->hh.next;
+			client = client->instance_next;
 			/* Grab a reference to this client allowing us to examine
 			 * it without holding the lock */
 			if (likely(client))
@@ -8031,9 +9338,9 @@ static void *statsupdate(void *arg)
 					LOGDEBUG("Skipping user %s", user->username);
 					continue;
 				}
-				decay_user(user, 0, &now);
 				idle = true;
 			}
+			decay_user(user, &now);
 
 			ghs = user->dsps1440 * nonces;
 			suffix_string(ghs, suffix1440, 16, 0);
@@ -8058,7 +9365,7 @@ static void *statsupdate(void *arg)
 					"hashrate7d", suffix10080,
 				        "lastshare", user->last_share.tv_sec,
 					"workers", user->workers + user->remote_workers,
-					"shares", user->shares,
+					"shares", __atomic_load_n(&user->shares, __ATOMIC_RELAXED),
 					"bestshare", user->best_diff,
 					"bestever", user->best_ever,
 					"authorised", user->auth_time);
@@ -8093,9 +9400,9 @@ static void *statsupdate(void *arg)
 						LOGDEBUG("Skipping worker %s", worker->workername);
 						continue;
 					}
-					decay_worker(worker, 0, &now);
 					worker->idle = true;
 				}
+				decay_worker(worker, &now);
 
 				ghs = worker->dsps1440 * nonces;
 				suffix_string(ghs, suffix1440, 16, 0);
@@ -8122,7 +9429,7 @@ static void *statsupdate(void *arg)
 						"hashrate1d", suffix1440,
 						"hashrate7d", suffix10080,
 					        "lastshare", worker->last_share.tv_sec,
-						"shares", worker->shares,
+						"shares", __atomic_load_n(&worker->shares, __ATOMIC_RELAXED),
 						"bestshare", worker->best_diff,
 						"bestever", worker->best_ever);
 				json_array_append_new(user_array, wval);
@@ -8288,9 +9595,10 @@ static void *statsupdate(void *arg)
 		/* Update stats 32 times per minute to divide up userstats,
 		 * displaying status every minute. */
 		for (i = 0; i < 32; i++) {
-			int64_t unaccounted_shares,
-				unaccounted_diff_shares,
-				unaccounted_rejects;
+			int64_t unaccounted_shares = 0,
+				unaccounted_diff_shares = 0,
+				unaccounted_rejects = 0;
+			share_counters_t *counters;
 
 			ts_to_tv(&diff, &stats->last_update);
 			cksleep_ms_r(&stats->last_update, 1875);
@@ -8300,14 +9608,20 @@ static void *statsupdate(void *arg)
 			 * stats update */
 			per_tdiff = tvdiff(&now, &diff);
 
-			mutex_lock(&sdata->uastats_lock);
-			unaccounted_shares = stats->unaccounted_shares;
-			unaccounted_diff_shares = stats->unaccounted_diff_shares;
-			unaccounted_rejects = stats->unaccounted_rejects;
-			stats->unaccounted_shares =
-			stats->unaccounted_diff_shares =
-			stats->unaccounted_rejects = 0;
-			mutex_unlock(&sdata->uastats_lock);
+			counters = __atomic_load_n(&sdata->share_counters, __ATOMIC_ACQUIRE);
+			for (; counters; counters = counters->next) {
+				int64_t shares, diff_shares, rejects;
+
+				shares = __atomic_load_n(&counters->shares, __ATOMIC_RELAXED);
+				diff_shares = __atomic_load_n(&counters->diff_shares, __ATOMIC_RELAXED);
+				rejects = __atomic_load_n(&counters->rejects, __ATOMIC_RELAXED);
+				unaccounted_shares += shares - counters->last_shares;
+				unaccounted_diff_shares += diff_shares - counters->last_diff_shares;
+				unaccounted_rejects += rejects - counters->last_rejects;
+				counters->last_shares = shares;
+				counters->last_diff_shares = diff_shares;
+				counters->last_rejects = rejects;
+			}
 
 			mutex_lock(&sdata->stats_lock);
 			stats->accounted_shares += unaccounted_shares;
@@ -8542,7 +9856,7 @@ static void *zmqnotify(void *arg)
 
 void *stratifier(void *arg)
 {
-	pthread_t pth_blockupdate, pth_statsupdate, pth_throbber, pth_zmqnotify;
+	pthread_t pth_blockupdate, pth_statsupdate, pth_throbber, pth_zmqnotify, pth_sharelog;
 	proc_instance_t *pi = (proc_instance_t *)arg;
 	int threads, tvsec_diff = 0;
 	ckpool_t *ckp = pi->ckp;
@@ -8551,6 +9865,8 @@ void *stratifier(void *arg)
 
 	rename_proc(pi->processname);
 	LOGWARNING("%s stratifier starting", ckp->name);
+	cmsg_slab = ckslab_create("cmsg", sizeof(cmsg_t));
+	jp_slab = ckslab_create("jsonparams", sizeof(json_params_t));
 	sdata = ckzalloc(sizeof(sdata_t));
 	ckp->sdata = sdata;
 	sdata->ckp = ckp;
@@ -8601,19 +9917,30 @@ void *stratifier(void *arg)
 		sdata->blockchange_id = sdata->workbase_id = randomiser;
 
 	cklock_init(&sdata->instance_lock);
+	init_instance_shards(sdata);
 	cksem_init(&sdata->update_sem);
 	cksem_post(&sdata->update_sem);
+	init_decay_props();
 
-	/* Create half as many share processing and receiving threads as there
-	 * are CPUs */
-	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
+	/* Each client's messages must be processed in order so without
+	 * clientaffinity each pipeline has a single thread. */
+	threads = ckp->clientaffinity ? ckp->stratifierthreads : 1;
 	sdata->updateq = create_ckmsgq(ckp, "updater", &block_update);
-	sdata->sshareq = create_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
-	sdata->ssends = create_ckmsgqs(ckp, "ssender", &ssend_process, threads);
+	LOGNOTICE("Using %s sha256 with %d lane batch share verification", sha256_backend(),
+		  sha256_mb_lanes());
+	if (ckp->clientaffinity)
+		LOGNOTICE("Stratifier using %d client affine threads per pipeline", threads);
+	sdata->sshareq = create_ckmsgq_shards(ckp, "sprocessor", NULL, &sshare_process,
+					      threads, sha256_mb_lanes());
+	sdata->ssends = create_ckmsgq_shards(ckp, "ssender", &ssend_process, NULL, threads, 0);
 	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
-	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
+	sdata->srecvs = create_ckmsgq_shards(ckp, "sreceiver", &srecv_process, NULL, threads, 0);
 	create_pthread(&pth_throbber, throbber, ckp);
+	if (ckp->logshares) {
+		cksem_init(&sdata->sharelog_sem);
+		create_pthread(&pth_sharelog, sharelog_writer, ckp);
+	}
 	read_poolstats(ckp, &tvsec_diff);
 	read_userstats(ckp, sdata, tvsec_diff);
 
@@ -8629,11 +9956,10 @@ void *stratifier(void *arg)
 	}
 
 	mutex_init(&sdata->stats_lock);
-	mutex_init(&sdata->uastats_lock);
 	if (!ckp->passthrough || ckp->node)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
 
-	mutex_init(&sdata->share_lock);
+	init_share_table(sdata);
 	if (!ckp->proxy)
 		create_pthread(&pth_zmqnotify, zmqnotify, ckp);
 
@@ -23,13 +23,22 @@ struct genwork {
 
 	char idstring[20];
 
-	/* How many readers we currently have of this workbase, set
-	 * under write workbase_lock */
+	/* How many readers we currently have of this remote workbase, set
+	 * under write workbase_lock. Local workbases are instead protected by
+	 * their readers' epoch sections. */
 	int readcount;
 
+	/* Aged out workbases waiting for readers to leave their epochs */
+	struct genwork *retired_next;
+	uint64_t dead_epoch;
+
 	/* The id a remote workinfo is mapped to locally */
 	int64_t mapped_id;
 
+	/* Generation of shares submitted against this workbase in the share
+	 * dedupe table */
+	int64_t share_gen;
+
 	ts_t gentime;
 	tv_t retired;
 
@@ -88,6 +97,7 @@ struct genwork {
 	char headerbin[112];
 
 	char *logdir;
+	char *sharelog; /* Path of this workbase's sharelog */
 
 	ckpool_t *ckp;
 	bool proxy; /* This workbase is proxied work */
@@ -97,6 +107,39 @@ struct genwork {
 	json_t *json; /* getblocktemplate json */
 };
 
+/* The fields of a mining.submit message decoded directly by the connector
+ * without building a json tree. The strings point into buf which holds a
+ * copy of the message. */
+typedef struct submit {
+	int64_t client_id;
+	json_t *id_val;
+
+	/* Number of params, or -1 if params was not an array */
+	int params;
+	const char *workername;
+	const char *job_id;
+	const char *nonce2;
+	const char *ntime;
+	const char *nonce;
+	const char *version_mask;
+
+	char buf[];
+} submit_t;
+
+/* A message received from a client, carried from the connector to the
+ * stratifier with its routing details in the envelope rather than added to
+ * the json. The address is copied so the message does not depend on the
+ * lifetime of the connector's client. */
+typedef struct client_msg {
+	int64_t client_id;
+	int server;
+	/* The method decoded once from the json, SM_NONE if it has none or it
+	 * is one the stratifier matches by name */
+	enum stratum_msgtype method;
+	char address[INET6_ADDRSTRLEN];
+	json_t *json_msg;
+} cmsg_t;
+
 void parse_remote_txns(ckpool_t *ckp, const json_t *val);
 #define parse_upstream_txns(ckp, val) parse_remote_txns(ckp, val)
 void parse_upstream_auth(ckpool_t *ckp, json_t *val);
@@ -106,6 +149,10 @@ void parse_upstream_reqtxns(ckpool_t *ckp, json_t *val);
 char *stratifier_stats(ckpool_t *ckp, void *data);
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line);
 #define stratifier_add_recv(ckp, val) _stratifier_add_recv(ckp, val, __FILE__, __func__, __LINE__)
+void stratifier_add_msg(ckpool_t *ckp, const int64_t client_id, const int server,
+			const char *address, json_t *val);
+void stratifier_add_submit(ckpool_t *ckp, submit_t *submit);
+void stratifier_process_submit(ckpool_t *ckp, submit_t *submit);
 void *stratifier(void *arg);
 
 #endif /* STRATIFIER_H */
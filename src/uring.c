@@ -0,0 +1,318 @@
+/*
+ * Copyright 2026 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+static int io_uring_setup(const unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(const int fd, const unsigned to_submit, const unsigned min_complete,
+			  const unsigned flags, void *arg, const size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int io_uring_register(const int fd, const unsigned opcode, void *arg, const unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Multishot recv, which the backend depends on, arrived in linux 6.0 and has
+ * no feature flag or probe bit of its own, so check the kernel version. */
+static bool kernel_multishot_recv(void)
+{
+	struct utsname uts;
+	int major, minor;
+
+	if (uname(&uts) || sscanf(uts.release, "%d.%d", &major, &minor) != 2)
+		return false;
+	return major >= 6;
+}
+
+static bool probe_ops(const int fd)
+{
+	static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_POLL_ADD };
+	struct io_uring_probe *probe;
+	bool ret = false;
+	int len, i;
+
+	len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = ckzalloc(len);
+	if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+		goto out;
+	for (i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+		if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			goto out;
+	}
+	ret = true;
+out:
+	free(probe);
+	return ret;
+}
+
+/* Runtime detection of everything the connector io_uring backend uses */
+bool ckring_supported(void)
+{
+	ckbufring_t *bufring;
+	ckring_t *ring;
+	bool ret = false;
+
+	if (!kernel_multishot_recv()) {
+		LOGDEBUG("Kernel too old for io_uring multishot recv");
+		return ret;
+	}
+	ring = ckring_init(4);
+	if (!ring)
+		return ret;
+	if (!probe_ops(ring->fd)) {
+		LOGDEBUG("io_uring lacks required opcodes");
+		goto out;
+	}
+	bufring = ckring_setup_bufring(ring, 0, 4, 64);
+	if (!bufring) {
+		LOGDEBUG("io_uring lacks provided buffer rings");
+		goto out;
+	}
+	free(bufring->bufs);
+	free(bufring->br);
+	free(bufring);
+	ret = true;
+out:
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+	free(ring);
+	return ret;
+}
+
+ckring_t *ckring_init(const unsigned entries)
+{
+	struct io_uring_params p;
+	ckring_t *ring;
+	char *sq_ptr;
+	int fd;
+
+	/* Multishot operations generate many completions per submission so
+	 * size the completion queue generously. */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 4;
+	fd = io_uring_setup(entries, &p);
+	if (fd < 0) {
+		LOGDEBUG("Failed to io_uring_setup errno %d: %s", errno, strerror(errno));
+		return NULL;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		LOGDEBUG("io_uring lacks single mmap or extended arg support");
+		close(fd);
+		return NULL;
+	}
+
+	ring = ckzalloc(sizeof(ckring_t));
+	ring->fd = fd;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring->cq_size > ring->sq_size)
+		ring->sq_size = ring->cq_size;
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			    fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto out_close;
+	/* With IORING_FEAT_SINGLE_MMAP both rings share the one mapping */
+	ring->cq_ptr = ring->sq_ptr;
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		munmap(ring->sq_ptr, ring->sq_size);
+		goto out_close;
+	}
+
+	sq_ptr = ring->sq_ptr;
+	ring->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned *)(sq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(sq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(sq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(sq_ptr + p.cq_off.cqes);
+	return ring;
+
+out_close:
+	LOGWARNING("Failed to mmap io_uring rings errno %d: %s", errno, strerror(errno));
+	close(fd);
+	free(ring);
+	return NULL;
+}
+
+/* Get a zeroed sqe to fill in, submitting what is pending first if the
+ * submission queue is full. Not thread safe; callers sharing a ring must
+ * serialise access. */
+struct io_uring_sqe *ckring_get_sqe(ckring_t *ring)
+{
+	unsigned head, tail = *ring->sq_tail + ring->sq_pending;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= ring->sq_entries) {
+		if (ckring_submit(ring) < 0)
+			return NULL;
+		tail = *ring->sq_tail;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring->sq_entries)
+			return NULL;
+	}
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	ring->sq_pending++;
+	return sqe;
+}
+
+/* Publish the pending sqes to the kernel and return the number submitted */
+static unsigned ckring_flush(ckring_t *ring)
+{
+	unsigned pending = ring->sq_pending;
+
+	if (pending) {
+		__atomic_store_n(ring->sq_tail, *ring->sq_tail + pending, __ATOMIC_RELEASE);
+		ring->sq_pending = 0;
+	}
+	return pending;
+}
+
+int ckring_submit(ckring_t *ring)
+{
+	unsigned pending = ckring_flush(ring);
+	int ret;
+
+	if (!pending)
+		return 0;
+	do {
+		ret = io_uring_enter(ring->fd, pending, 0, 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+/* Return the next completion or NULL if there are none. Only one thread may
+ * consume completions from a ring. */
+struct io_uring_cqe *ckring_peek_cqe(ckring_t *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void ckring_cqe_seen(ckring_t *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Wait up to timeout_ms for a completion without submitting anything, so it
+ * is safe to call without serialising against submitters. Returns less than
+ * zero only on unexpected errors. */
+int ckring_wait(ckring_t *ring, const int timeout_ms)
+{
+	struct __kernel_timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+	struct io_uring_getevents_arg arg;
+	int ret;
+
+	if (ckring_peek_cqe(ring))
+		return 0;
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	ret = io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			     &arg, sizeof(arg));
+	if (ret < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY))
+		ret = 0;
+	return ret;
+}
+
+/* Register a ring of entries buffers of bufsize bytes as buffer group bgid.
+ * Entries must be a power of 2. */
+ckbufring_t *ckring_setup_bufring(ckring_t *ring, const unsigned short bgid,
+				  const unsigned entries, const unsigned bufsize)
+{
+	struct io_uring_buf_reg reg;
+	ckbufring_t *bufring;
+	unsigned i;
+
+	bufring = ckzalloc(sizeof(ckbufring_t));
+	bufring->entries = entries;
+	bufring->bufsize = bufsize;
+	bufring->bgid = bgid;
+	if (posix_memalign((void **)&bufring->br, PAGESIZE, entries * sizeof(struct io_uring_buf)))
+		goto out_free;
+	memset(bufring->br, 0, entries * sizeof(struct io_uring_buf));
+	bufring->bufs = ckalloc((size_t)entries * bufsize);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)bufring->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		LOGDEBUG("Failed to register io_uring buffer ring errno %d: %s",
+			 errno, strerror(errno));
+		free(bufring->bufs);
+		free(bufring->br);
+		goto out_free;
+	}
+	for (i = 0; i < entries; i++) {
+		struct io_uring_buf *buf = &bufring->br->bufs[i];
+
+		buf->addr = (uint64_t)(uintptr_t)(bufring->bufs + (size_t)i * bufsize);
+		buf->len = bufsize;
+		buf->bid = i;
+	}
+	__atomic_store_n(&bufring->br->tail, entries, __ATOMIC_RELEASE);
+	return bufring;
+
+out_free:
+	free(bufring);
+	return NULL;
+}
+
+char *ckbufring_buf(ckbufring_t *bufring, const unsigned short bid)
+{
+	return bufring->bufs + (size_t)bid * bufring->bufsize;
+}
+
+/* Hand a consumed buffer back to the kernel */
+void ckbufring_recycle(ckbufring_t *bufring, const unsigned short bid)
+{
+	unsigned short tail = bufring->br->tail;
+	struct io_uring_buf *buf = &bufring->br->bufs[tail & (bufring->entries - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)ckbufring_buf(bufring, bid);
+	buf->len = bufring->bufsize;
+	buf->bid = bid;
+	__atomic_store_n(&bufring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2026 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Minimal io_uring support using the raw syscalls, for the connector's
+ * optional io_uring network backend. */
+
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct ckring ckring_t;
+typedef struct ckbufring ckbufring_t;
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+
+struct ckring {
+	int fd;
+
+	/* Submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	/* Sqes filled in but not yet submitted */
+	unsigned sq_pending;
+
+	/* Completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+};
+
+/* A ring of fixed sized buffers provided to the kernel for buffer selected
+ * receives */
+struct ckbufring {
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned entries;
+	unsigned bufsize;
+	unsigned short bgid;
+};
+
+bool ckring_supported(void);
+ckring_t *ckring_init(const unsigned entries);
+struct io_uring_sqe *ckring_get_sqe(ckring_t *ring);
+int ckring_submit(ckring_t *ring);
+int ckring_wait(ckring_t *ring, const int timeout_ms);
+struct io_uring_cqe *ckring_peek_cqe(ckring_t *ring);
+void ckring_cqe_seen(ckring_t *ring);
+ckbufring_t *ckring_setup_bufring(ckring_t *ring, const unsigned short bgid,
+				  const unsigned entries, const unsigned bufsize);
+char *ckbufring_buf(ckbufring_t *bufring, const unsigned short bid);
+void ckbufring_recycle(ckbufring_t *bufring, const unsigned short bid);
+#else /* HAVE_LINUX_IO_URING_H */
+static inline bool ckring_supported(void)
+{
+	return false;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#endif /* URING_H */